@@ -0,0 +1,408 @@
+/*
+ * Copyright (c) 2014, Peter Rutenbar <pruten@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Throughput benchmark. Runs either a built-in synthetic 68020 workload
+ * straight out of RAM (no ROM, no devices, no other threads), or a real
+ * boot from a ROM and disk image, for a fixed number of guest instructions
+ * or a fixed wall time. Prints one JSON object per run, so results can be
+ * collected and compared across commits.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include "../core/shoebill.h"
+
+#define SYNTH_RAM_SIZE (8 * 1024 * 1024)
+#define SYNTH_CODE_ADDR 0x1000
+#define SYNTH_STACK_ADDR 0x8000
+#define SYNTH_DATA_ADDR 0x10000
+#define SYNTH_TABLE_ADDR 0x100000 // page tables for mmu=1
+#define SYNTH_CHUNK 1000000 // instructions between clock checks
+
+struct {
+    const char *workload; // "synthetic" or "boot"
+    _Bool mmu; // synthetic: run with a two-level page table
+    uint64_t instructions; // stop after this many instructions...
+    double seconds; // ... or this much wall time, whichever comes first
+    const char *label; // echoed into the output, e.g. a commit id
+
+    // boot workload only
+    const char *scsi_path[8];
+    const char *rom_path;
+    const char *relative_unix_path;
+    uint32_t ram_megabytes;
+} user_params;
+
+/*
+ * The synthetic workload: a loop that walks a 4kb buffer doing
+ * load/add/store, a multiply, an eor, and a subroutine call per longword.
+ *
+ *   start: lea     SYNTH_DATA_ADDR, a0
+ *          moveq   #0, d0
+ *          move.l  #1023, d1
+ *   loop:  move.l  (a0), d2
+ *          add.l   d1, d2
+ *          move.l  d2, (a0)+
+ *          muls.w  d1, d3
+ *          eor.l   d2, d0
+ *          bsr.s   sub
+ *          dbf     d1, loop
+ *          bra.s   start
+ *   sub:   lsl.l   #3, d0
+ *          rts
+ */
+static const uint16_t synth_code[] = {
+    0x41f9, 0x0001, 0x0000,
+    0x7000,
+    0x223c, 0x0000, 0x03ff,
+    0x2410,
+    0xd481,
+    0x20c2,
+    0xc7c1,
+    0xb580,
+    0x6106,
+    0x51c9, 0xfff2,
+    0x60e0,
+    0xe788,
+    0x4e75
+};
+
+static void _print_help (void)
+{
+    printf("Arguments have the form name=value.\n");
+    printf("\n");
+    printf("workload=<synthetic or boot>\n");
+    printf("Defaults to synthetic, a small integer loop run straight out of RAM.\n");
+    printf("mmu=<1 or 0>\n");
+    printf("synthetic: translate every access through a two-level page table.\n");
+    printf("instructions=<count>\n");
+    printf("seconds=<wall time>\n");
+    printf("Stop at whichever comes first. Defaults to 100000000 instructions, 60 seconds.\n");
+    printf("label=<string>\n");
+    printf("Copied into the output as \"label\".\n");
+    printf("\n");
+    printf("boot workload:\n");
+    printf("rom=<path to Mac II ROM>\n");
+    printf("disk0..disk6=<path to disk image>\n");
+    printf("ram=<megabytes of memory>\n");
+    printf("unix-path=<path to kernel on disk0>\n");
+}
+
+static void _init_user_params (int argc, char **argv)
+{
+    char *key;
+    uint32_t i;
+
+    memset(&user_params, 0, sizeof(user_params));
+    user_params.workload = "synthetic";
+    user_params.instructions = 100000000;
+    user_params.seconds = 60.0;
+    user_params.label = "";
+    user_params.rom_path = "macii.rom";
+    user_params.relative_unix_path = "/unix";
+    user_params.ram_megabytes = 16;
+
+    for (i=1; i<argc; i++) {
+        key = "-h";
+        if ((strncmp(key, argv[i], strlen(key)) == 0) ||
+            (strncmp("help", argv[i], 4) == 0)) {
+            _print_help();
+            exit(0);
+        }
+
+        key = "workload=";
+        if (strncmp(key, argv[i], strlen(key)) == 0) {
+            user_params.workload = argv[i] + strlen(key);
+            continue;
+        }
+
+        key = "mmu=";
+        if (strncmp(key, argv[i], strlen(key)) == 0) {
+            user_params.mmu = strtoul(argv[i]+strlen(key), NULL, 10);
+            continue;
+        }
+
+        key = "instructions=";
+        if (strncmp(key, argv[i], strlen(key)) == 0) {
+            user_params.instructions = strtoull(argv[i]+strlen(key), NULL, 10);
+            continue;
+        }
+
+        key = "seconds=";
+        if (strncmp(key, argv[i], strlen(key)) == 0) {
+            user_params.seconds = strtod(argv[i]+strlen(key), NULL);
+            continue;
+        }
+
+        key = "label=";
+        if (strncmp(key, argv[i], strlen(key)) == 0) {
+            user_params.label = argv[i] + strlen(key);
+            continue;
+        }
+
+        key = "rom=";
+        if (strncmp(key, argv[i], strlen(key)) == 0) {
+            user_params.rom_path = argv[i] + strlen(key);
+            continue;
+        }
+
+        key = "ram=";
+        if (strncmp(key, argv[i], strlen(key)) == 0) {
+            user_params.ram_megabytes = strtoul(argv[i]+strlen(key), NULL, 10);
+            continue;
+        }
+
+        key = "unix-path=";
+        if (strncmp(key, argv[i], strlen(key)) == 0) {
+            user_params.relative_unix_path = argv[i] + strlen(key);
+            continue;
+        }
+
+        if ((strncmp("disk", argv[i], 4) == 0) && isdigit(argv[i][4]) && (argv[i][5] == '=')) {
+            const uint8_t num = argv[i][4] - '0';
+            if (num < 7) {
+                user_params.scsi_path[num] = argv[i] + 6;
+                continue;
+            }
+        }
+
+        printf("Unknown argument %s\n", argv[i]);
+        _print_help();
+        exit(1);
+    }
+
+    if ((strcmp(user_params.workload, "synthetic") != 0) &&
+        (strcmp(user_params.workload, "boot") != 0)) {
+        printf("Unknown workload %s\n", user_params.workload);
+        exit(1);
+    }
+}
+
+#pragma mark Timing
+
+static double _wall_seconds (void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + (ts.tv_nsec / 1000000000.0);
+}
+
+static double _process_cpu_seconds (void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+           ((usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000000.0);
+}
+
+/* CPU time consumed by one thread so far (-1 if the platform can't tell us) */
+static double _thread_cpu_seconds (pthread_t thread)
+{
+#ifdef __linux__
+    clockid_t clock;
+    struct timespec ts;
+    if ((pthread_getcpuclockid(thread, &clock) != 0) || (clock_gettime(clock, &ts) != 0))
+        return -1.0;
+    return ts.tv_sec + (ts.tv_nsec / 1000000000.0);
+#else
+    return -1.0;
+#endif
+}
+
+#pragma mark Workloads
+
+/* Load the translation control register, the way pmove does */
+static void _set_tc (uint32_t tc)
+{
+    shoe.tc = tc & 0x83ffffff;
+    shoe.tc_is = (shoe.tc >> 16) & 0xf;
+    shoe.tc_ps = (shoe.tc >> 20) & 0xf;
+    shoe.tc_pagesize = 1 << shoe.tc_ps;
+    shoe.tc_pagemask = shoe.tc_pagesize - 1;
+    shoe.tc_is_plus_ps = shoe.tc_is + shoe.tc_ps;
+    shoe.tc_enable = (shoe.tc >> 31) & 1;
+    shoe.tc_sre = (shoe.tc >> 25) & 1;
+}
+
+/*
+ * Identity-map the whole of RAM with 4kb pages: tia=10, tib=10, ps=12,
+ * 4-byte descriptors. The tables live in RAM at SYNTH_TABLE_ADDR.
+ */
+static void _build_page_tables (void)
+{
+    const uint32_t a_table = SYNTH_TABLE_ADDR;
+    const uint32_t b_tables = SYNTH_TABLE_ADDR + 4096;
+    uint32_t i;
+
+    for (i=0; i < (SYNTH_RAM_SIZE >> 12); i++)
+        pset(b_tables + i*4, 4, (i << 12) | 1); // page descriptor
+    for (i=0; i < (SYNTH_RAM_SIZE >> 22); i++)
+        pset(a_table + i*4, 4, (b_tables + i*4096) | 2); // short table descriptor
+
+    shoe.crp = (2ULL << 32) | a_table;
+    shoe.srp = shoe.crp;
+    memset(shoe.pmmu_cache, 0, sizeof(shoe.pmmu_cache));
+    _set_tc(0x80000000 | (12 << 20) | (10 << 12) | (10 << 8));
+}
+
+/* Build a bare machine with just enough state for cpu_step() to run synth_code */
+static void _setup_synthetic (void)
+{
+    uint32_t i;
+
+    shoe.pool = p_new_pool(NULL);
+    shoe.physical_mem_size = SYNTH_RAM_SIZE;
+    shoe.physical_mem_base = p_calloc(shoe.pool, uint8_t, SYNTH_RAM_SIZE + 8);
+    fpu_initialize();
+
+    for (i=0; i < sizeof(synth_code)/2; i++)
+        pset(SYNTH_CODE_ADDR + i*2, 2, synth_code[i]);
+
+    if (user_params.mmu)
+        _build_page_tables();
+
+    invalidate_pccache();
+    set_sr(0x2700);
+    shoe.a[7] = SYNTH_STACK_ADDR;
+    shoe.pc = SYNTH_CODE_ADDR;
+}
+
+static void _run_synthetic (const double deadline)
+{
+    const uint64_t target = user_params.instructions;
+
+    while (shoe.stats.instructions < target) {
+        uint64_t chunk = target - shoe.stats.instructions;
+        if (chunk > SYNTH_CHUNK)
+            chunk = SYNTH_CHUNK;
+        while (chunk--)
+            cpu_step();
+        if (_wall_seconds() >= deadline)
+            break;
+    }
+}
+
+static _Bool _setup_boot (void)
+{
+    uint32_t i;
+    shoebill_config_t config;
+
+    memset(&config, 0, sizeof(shoebill_config_t));
+    config.aux_verbose = 0;
+    config.ram_size = user_params.ram_megabytes * 1024 * 1024;
+    config.aux_kernel_path = user_params.relative_unix_path;
+    config.rom_path = user_params.rom_path;
+    shoebill_validate_or_zap_pram(config.pram, 1);
+
+    for (i=0; i<7; i++)
+        config.scsi_devices[i].path = user_params.scsi_path[i];
+
+    if (!shoebill_initialize(&config)) {
+        printf("%s\n", config.error_msg);
+        return 0;
+    }
+
+    shoebill_install_video_card(&config, 9, 640, 480);
+    return 1;
+}
+
+static void _run_boot (const double deadline)
+{
+    const struct timespec poll_interval = {0, 10 * 1000000}; // 10ms
+
+    shoebill_start();
+    while ((shoe.stats.instructions < user_params.instructions) && (_wall_seconds() < deadline))
+        nanosleep(&poll_interval, NULL);
+}
+
+#pragma mark Reporting
+
+static void _report (double wall, double process_cpu, double cpu_thread, double via_thread)
+{
+    const double stopped = shoe.stats.stopped_usecs / 1000000.0;
+    const double busy = (wall > stopped) ? (wall - stopped) : wall;
+    const double atc_hit_rate = shoe.stats.atc_lookups ?
+        (1.0 - ((double)shoe.stats.atc_misses / shoe.stats.atc_lookups)) : 0.0;
+    const double other = ((cpu_thread < 0) || (via_thread < 0)) ?
+        -1.0 : (process_cpu - cpu_thread - via_thread);
+
+    printf("{\"label\": \"%s\", \"workload\": \"%s\", \"mmu\": %u, "
+           "\"instructions\": %llu, \"wall_seconds\": %.6f, \"stopped_seconds\": %.6f, "
+           "\"mips\": %.3f, \"instructions_per_guest_second\": %.0f, "
+           "\"atc_lookups\": %llu, \"atc_misses\": %llu, \"atc_hit_rate\": %.6f, "
+           "\"cpu_thread_seconds\": %.6f, \"via_thread_seconds\": %.6f, \"other_seconds\": %.6f}\n",
+           user_params.label, user_params.workload, user_params.mmu,
+           (unsigned long long)shoe.stats.instructions, wall, stopped,
+           (shoe.stats.instructions / busy) / 1000000.0, shoe.stats.instructions / wall,
+           (unsigned long long)shoe.stats.atc_lookups, (unsigned long long)shoe.stats.atc_misses, atc_hit_rate,
+           cpu_thread, via_thread, other);
+}
+
+int main (int argc, char **argv)
+{
+    double start, deadline, wall, cpu_start;
+    _Bool boot;
+
+    _init_user_params(argc, argv);
+    boot = (strcmp(user_params.workload, "boot") == 0);
+
+    if (boot) {
+        if (!_setup_boot())
+            return 1;
+    }
+    else
+        _setup_synthetic();
+
+    start = _wall_seconds();
+    cpu_start = _process_cpu_seconds();
+    deadline = start + user_params.seconds;
+
+    if (boot) {
+        _run_boot(deadline);
+        pause_cpu_thread(); // hold the counters still while we read them
+        wall = _wall_seconds() - start;
+        _report(wall, _process_cpu_seconds() - cpu_start,
+                _thread_cpu_seconds(shoe.cpu_thread_pid),
+                _thread_cpu_seconds(shoe.via_thread_pid));
+    }
+    else {
+        // Everything ran on this thread
+        _run_synthetic(deadline);
+        wall = _wall_seconds() - start;
+        _report(wall, _process_cpu_seconds() - cpu_start, _process_cpu_seconds() - cpu_start, 0.0);
+    }
+
+    return 0;
+}
@@ -0,0 +1,26 @@
+#!/bin/bash
+
+CC=gcc
+
+files=""
+for i in adb fpu mc68851 mem via floppy core_api cpu dis; do
+	perl ../core/macro.pl ../core/$i.c $i.post.c
+	files="$files $i.post.c"
+done
+
+for i in SoftFloat/softfloat atrap_tab coff exception macii_symbols redblack scsi video filesystem alloc_pool toby_frame_buffer ethernet sound fb_server snapshot clone profiler histogram trace tracepoint symbols replay; do
+	files="$files ../core/$i.c"
+done
+
+$CC -O1 ../core/decoder_gen.c -o decoder_gen
+./decoder_gen inst .
+./decoder_gen dis .
+
+
+cmd="$CC -O3 -ggdb -flto $files bench.c -lpthread -lm -lz -o shoebill_bench"
+echo $cmd
+$cmd
+
+cmd="$CC -O3 -ggdb -flto $files microbench.c -lpthread -lm -lz -o shoebill_microbench"
+echo $cmd
+$cmd
@@ -0,0 +1,511 @@
+/*
+ * Copyright (c) 2014, Peter Rutenbar <pruten@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Microbenchmarks for the core's hot paths. Each benchmark sets up only
+ * the bits of shoe it needs, runs its loop until it has used up its share
+ * of wall time, and prints one JSON object with the cost in ns per op.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <time.h>
+#include "../core/shoebill.h"
+
+#define RAM_SIZE (8 * 1024 * 1024)
+#define STREAM_ADDR 0x1000
+#define STREAM_LEN 8192 // instructions per opcode stream, before it branches back
+#define TABLE_ADDR 0x100000
+#define DATA_ADDR 0x200000
+#define VIDEO_SLOT 9
+
+struct {
+    const char *filter; // only run benchmarks whose names contain this
+    const char *label;
+    double seconds; // per benchmark
+} user_params;
+
+static double _now (void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + (ts.tv_nsec / 1000000000.0);
+}
+
+/*
+ * Run func(n) with growing n until a run takes at least 10% of the time
+ * budget, then once more, sized to fill the budget. func does n ops.
+ */
+static void _bench (const char *name, void (*func)(uint64_t))
+{
+    uint64_t n = 16;
+    double elapsed, start;
+
+    if (user_params.filter && !strstr(name, user_params.filter))
+        return ;
+
+    while (1) {
+        start = _now();
+        func(n);
+        elapsed = _now() - start;
+        if (elapsed >= (user_params.seconds / 10.0))
+            break;
+        n *= 2;
+    }
+
+    n = (uint64_t)(n * (user_params.seconds / elapsed));
+    if (n == 0)
+        n = 1;
+    start = _now();
+    func(n);
+    elapsed = _now() - start;
+
+    printf("{\"label\": \"%s\", \"bench\": \"%s\", \"ops\": %llu, \"ns_per_op\": %.3f}\n",
+           user_params.label, name, (unsigned long long)n, (elapsed * 1000000000.0) / n);
+    fflush(stdout);
+}
+
+#pragma mark Machine setup
+
+static void _setup_machine (void)
+{
+    shoebill_config_t config;
+
+    memset(&config, 0, sizeof(config));
+
+    shoe.pool = p_new_pool(NULL);
+    shoe.physical_mem_size = RAM_SIZE;
+    shoe.physical_mem_base = p_calloc(shoe.pool, uint8_t, RAM_SIZE + 8);
+    fpu_initialize();
+    init_scsi_bus_state();
+    shoebill_install_video_card(&config, VIDEO_SLOT, 640, 480);
+
+    invalidate_pccache();
+    set_sr(0x2700);
+    shoe.a[7] = 0x8000;
+}
+
+/* Load the translation control register, the way pmove does */
+static void _set_tc (uint32_t tc)
+{
+    shoe.tc = tc & 0x83ffffff;
+    shoe.tc_is = (shoe.tc >> 16) & 0xf;
+    shoe.tc_ps = (shoe.tc >> 20) & 0xf;
+    shoe.tc_pagesize = 1 << shoe.tc_ps;
+    shoe.tc_pagemask = shoe.tc_pagesize - 1;
+    shoe.tc_is_plus_ps = shoe.tc_is + shoe.tc_ps;
+    shoe.tc_enable = (shoe.tc >> 31) & 1;
+    shoe.tc_sre = (shoe.tc >> 25) & 1;
+    memset(shoe.pmmu_cache, 0, sizeof(shoe.pmmu_cache));
+    invalidate_pccache();
+}
+
+/* Identity-map RAM with 4kb pages (tia=10, tib=10, ps=12) and turn the PMMU on */
+static void _mmu_on (void)
+{
+    const uint32_t b_tables = TABLE_ADDR + 4096;
+    uint32_t i;
+
+    for (i=0; i < (RAM_SIZE >> 12); i++)
+        pset(b_tables + i*4, 4, (i << 12) | 1 | 0x10); // page descriptor, already modified
+    for (i=0; i < (RAM_SIZE >> 22); i++)
+        pset(TABLE_ADDR + i*4, 4, (b_tables + i*4096) | 2);
+
+    shoe.crp = (2ULL << 32) | TABLE_ADDR;
+    shoe.srp = shoe.crp;
+    _set_tc(0x80000000 | (12 << 20) | (10 << 12) | (10 << 8));
+}
+
+static void _mmu_off (void)
+{
+    _set_tc(0);
+}
+
+/* Fill STREAM_ADDR with copies of pattern, followed by a bra.w back to the start */
+static void _load_stream (const uint16_t *pattern, uint32_t words)
+{
+    uint32_t addr = STREAM_ADDR, i;
+
+    for (i=0; i < STREAM_LEN; i++) {
+        pset(addr, 2, pattern[i % words]);
+        addr += 2;
+    }
+    pset(addr, 2, 0x6000);
+    pset(addr + 2, 2, (uint16_t)(STREAM_ADDR - (addr + 2)));
+
+    invalidate_pccache();
+    shoe.pc = STREAM_ADDR;
+    shoe.a[0] = DATA_ADDR;
+    shoe.a[1] = DATA_ADDR + 0x100;
+}
+
+#pragma mark CPU
+
+static void _run_cpu (uint64_t n)
+{
+    while (n--)
+        cpu_step();
+    assert(shoe.pc >= STREAM_ADDR && shoe.pc < (STREAM_ADDR + STREAM_LEN * 2 + 4));
+}
+
+static void _cpu_nop (uint64_t n)
+{
+    static const uint16_t p[] = {0x4e71}; // nop
+    _load_stream(p, 1);
+    _run_cpu(n);
+}
+
+static void _cpu_alu (uint64_t n)
+{
+    static const uint16_t p[] = {
+        0x7001, // moveq #1, d0
+        0xd280, // add.l d0, d1
+        0x9481, // sub.l d1, d2
+        0xc682, // and.l d2, d3
+        0x8883, // or.l d3, d4
+        0xe389  // lsl.l #1, d1
+    };
+    _load_stream(p, 6);
+    _run_cpu(n);
+}
+
+static void _cpu_mem (uint64_t n)
+{
+    // Two-word instructions: cpu_step() counts one op for each of these
+    static const uint16_t p[] = {
+        0x2010,         // move.l (a0), d0
+        0x2280,         // move.l d0, (a1)
+        0x2228, 0x0004, // move.l 4(a0), d1
+        0x2341, 0x0008  // move.l d1, 8(a1)
+    };
+    _load_stream(p, 6);
+    _run_cpu(n);
+}
+
+static void _cpu_mem_mmu (uint64_t n)
+{
+    _mmu_on();
+    _cpu_mem(n);
+    _mmu_off();
+}
+
+#pragma mark Memory
+
+static void _get (uint64_t n)
+{
+    uint32_t addr = 0;
+    shoe.logical_fc = 5;
+    shoe.logical_size = 4;
+    while (n--) {
+        shoe.logical_addr = DATA_ADDR + (addr & 0xfffc);
+        logical_get();
+        addr += 4;
+    }
+    assert(!shoe.abort);
+}
+
+static void _set (uint64_t n)
+{
+    uint32_t addr = 0;
+    shoe.logical_fc = 5;
+    shoe.logical_size = 4;
+    while (n--) {
+        shoe.logical_addr = DATA_ADDR + (addr & 0xfffc);
+        shoe.logical_dat = addr;
+        logical_set();
+        addr += 4;
+    }
+    assert(!shoe.abort);
+}
+
+static void _logical_get (uint64_t n) { _get(n); }
+static void _logical_set (uint64_t n) { _set(n); }
+static void _logical_get_mmu (uint64_t n) { _mmu_on(); _get(n); _mmu_off(); }
+static void _logical_set_mmu (uint64_t n) { _mmu_on(); _set(n); _mmu_off(); }
+
+/*
+ * translate_logical_addr() is static to mem.c, so drive it through
+ * logical_get(): stepping through 2048 pages, page i always evicts page
+ * i-1024 from the (direct-mapped, 1024-entry) ATC, so every access walks
+ * the tables. Subtract logical_get_mmu to get the walk alone.
+ */
+static void _translate (uint64_t n)
+{
+    uint32_t page = 0;
+    _mmu_on();
+    shoe.logical_fc = 5;
+    shoe.logical_size = 4;
+    while (n--) {
+        shoe.logical_addr = (page & 2047) << 12;
+        logical_get();
+        page++;
+    }
+    assert(!shoe.abort);
+    _mmu_off();
+}
+
+#pragma mark Video
+
+static void _clut (uint8_t depth, uint64_t n)
+{
+    shoebill_card_video_t *ctx = (shoebill_card_video_t*)shoe.slots[VIDEO_SLOT].ctx;
+    uint32_t i;
+
+    ctx->depth = depth;
+    for (i=0; i < 256; i++) {
+        ctx->clut[i].r = i;
+        ctx->clut[i].g = ~i;
+        ctx->clut[i].b = i * 3;
+    }
+    for (i=0; i < (ctx->pixels * 4); i++)
+        ctx->direct_buf[i] = i * 7;
+
+    // One op is one full-screen translation
+    while (n--) {
+        memset(ctx->dirty, 1, ctx->dirty_len);
+        nubus_video_get_frame(ctx, 0);
+    }
+}
+
+static void _clut_1 (uint64_t n) { _clut(1, n); }
+static void _clut_2 (uint64_t n) { _clut(2, n); }
+static void _clut_4 (uint64_t n) { _clut(4, n); }
+static void _clut_8 (uint64_t n) { _clut(8, n); }
+static void _clut_16 (uint64_t n) { _clut(16, n); }
+static void _clut_32 (uint64_t n) { _clut(32, n); }
+
+#pragma mark SCSI
+
+/* One op is one byte (or long) handed to the CPU in the DATA_IN phase */
+static void _scsi (uint64_t n, _Bool longs)
+{
+    while (n) {
+        uint64_t chunk = (n > (sizeof(shoe.scsi.buf) / 4)) ? (sizeof(shoe.scsi.buf) / 4) : n;
+        n -= chunk;
+
+        shoe.scsi.phase = DATA_IN;
+        shoe.scsi.in_i = 0;
+        shoe.scsi.in_len = longs ? (chunk * 4) : chunk;
+
+        if (longs) {
+            while (chunk--)
+                scsi_dma_read_long();
+        }
+        else {
+            while (chunk--)
+                scsi_dma_read();
+        }
+    }
+}
+
+static void _scsi_dma_read (uint64_t n) { _scsi(n, 0); }
+static void _scsi_dma_read_long (uint64_t n) { _scsi(n, 1); }
+
+#pragma mark FPU
+
+/*
+ * inst_fmath is reached through cpu_step(), so these include the
+ * instruction dispatch (compare with cpu_alu). fp0 = 1.0, fp1 = pi, and
+ * the pairs undo each other so the operands don't drift.
+ */
+static void _fpu_stream (const uint16_t *ops, uint32_t count, uint64_t n)
+{
+    uint16_t p[16];
+    uint32_t i;
+
+    for (i=0; i < count; i++) {
+        p[i*2] = 0xf200;
+        p[i*2 + 1] = ops[i];
+    }
+    _load_stream(p, count * 2);
+
+    // fmovecr #$32, fp0 (1.0), fmovecr #0, fp1 (pi)
+    shoe.pc = DATA_ADDR;
+    pset(DATA_ADDR + 0, 4, 0xf2005c32);
+    pset(DATA_ADDR + 4, 4, 0xf2005c80);
+    cpu_step();
+    cpu_step();
+    shoe.pc = STREAM_ADDR;
+    invalidate_pccache();
+
+    _run_cpu(n);
+}
+
+static void _fmath_fadd (uint64_t n)
+{
+    static const uint16_t ops[] = {0x0422, 0x0428}; // fadd.x fp1, fp0 / fsub.x fp1, fp0
+    _fpu_stream(ops, 2, n);
+}
+
+static void _fmath_fmul (uint64_t n)
+{
+    static const uint16_t ops[] = {0x0423, 0x0420}; // fmul.x fp1, fp0 / fdiv.x fp1, fp0
+    _fpu_stream(ops, 2, n);
+}
+
+static void _fmath_fsqrt (uint64_t n)
+{
+    static const uint16_t ops[] = {0x0404}; // fsqrt.x fp1, fp0
+    _fpu_stream(ops, 1, n);
+}
+
+static void _fmath_fsin (uint64_t n)
+{
+    static const uint16_t ops[] = {0x040e}; // fsin.x fp1, fp0
+    _fpu_stream(ops, 1, n);
+}
+
+#pragma mark Symbols
+
+#define NUM_SYMBOLS 20000
+#define NUM_LOOKUPS 4096
+
+static coff_file *fake_coff;
+static rb_tree *func_tree;
+static uint32_t lookups[NUM_LOOKUPS];
+
+/*
+ * A coff_file with just an index of NUM_SYMBOLS functions, 64 bytes apart,
+ * and the same functions in a red-black tree for comparison
+ */
+static void _setup_symbols (void)
+{
+    coff_symbol *symbols;
+    uint32_t i, r = 1;
+
+    fake_coff = p_calloc(shoe.pool, coff_file, 1);
+    fake_coff->pool = shoe.pool;
+    fake_coff->index = symbol_index_new(shoe.pool, NUM_SYMBOLS);
+    fake_coff->num_symbols = NUM_SYMBOLS;
+    symbols = p_calloc(shoe.pool, coff_symbol, NUM_SYMBOLS);
+    fake_coff->symbols = symbols;
+    func_tree = rb_new(shoe.pool, sizeof(coff_symbol*));
+
+    for (i=0; i < NUM_SYMBOLS; i++) {
+        coff_symbol *sym = &symbols[i];
+        sym->value = 0x10000 + i * 64;
+        sym->name = "func";
+        symbol_index_add(fake_coff->index, sym->value, sym->name, i, SYMBOL_ADDR);
+        rb_insert(func_tree, sym->value, &sym, NULL);
+    }
+    symbol_index_finish(fake_coff->index);
+
+    for (i=0; i < NUM_LOOKUPS; i++) {
+        r = r * 1103515245 + 12345;
+        lookups[i] = 0x10000 + ((r >> 8) % (NUM_SYMBOLS * 64));
+    }
+}
+
+static void _rb_find (uint64_t n)
+{
+    coff_symbol *sym;
+    uint32_t i = 0;
+    while (n--)
+        rb_find(func_tree, lookups[i++ % NUM_LOOKUPS] & ~63, &sym);
+}
+
+static void _coff_find_func (uint64_t n)
+{
+    uint32_t i = 0;
+    while (n--)
+        assert(coff_find_func(fake_coff, lookups[i++ % NUM_LOOKUPS]) != NULL);
+}
+
+#pragma mark Main
+
+static void _print_help (void)
+{
+    printf("Arguments have the form name=value.\n");
+    printf("\n");
+    printf("filter=<substring>\n");
+    printf("Only run the benchmarks whose names contain <substring>.\n");
+    printf("seconds=<time per benchmark>\n");
+    printf("Defaults to 0.5\n");
+    printf("label=<string>\n");
+    printf("Copied into each line of output as \"label\".\n");
+}
+
+int main (int argc, char **argv)
+{
+    uint32_t i;
+
+    user_params.filter = NULL;
+    user_params.label = "";
+    user_params.seconds = 0.5;
+
+    for (i=1; i<argc; i++) {
+        if ((strncmp(argv[i], "-h", 2) == 0) || (strncmp(argv[i], "help", 4) == 0)) {
+            _print_help();
+            return 0;
+        }
+        else if (strncmp(argv[i], "filter=", 7) == 0)
+            user_params.filter = argv[i] + 7;
+        else if (strncmp(argv[i], "label=", 6) == 0)
+            user_params.label = argv[i] + 6;
+        else if (strncmp(argv[i], "seconds=", 8) == 0)
+            user_params.seconds = strtod(argv[i] + 8, NULL);
+        else {
+            printf("Unknown argument %s\n", argv[i]);
+            _print_help();
+            return 1;
+        }
+    }
+
+    _setup_machine();
+    _setup_symbols();
+
+    _bench("cpu_step_nop", _cpu_nop);
+    _bench("cpu_step_alu", _cpu_alu);
+    _bench("cpu_step_mem", _cpu_mem);
+    _bench("cpu_step_mem_mmu", _cpu_mem_mmu);
+
+    _bench("logical_get", _logical_get);
+    _bench("logical_set", _logical_set);
+    _bench("logical_get_mmu", _logical_get_mmu);
+    _bench("logical_set_mmu", _logical_set_mmu);
+    _bench("translate_logical_addr", _translate);
+
+    _bench("clut_translation_1bit_640x480", _clut_1);
+    _bench("clut_translation_2bit_640x480", _clut_2);
+    _bench("clut_translation_4bit_640x480", _clut_4);
+    _bench("clut_translation_8bit_640x480", _clut_8);
+    _bench("clut_translation_16bit_640x480", _clut_16);
+    _bench("clut_translation_32bit_640x480", _clut_32);
+
+    _bench("scsi_dma_read", _scsi_dma_read);
+    _bench("scsi_dma_read_long", _scsi_dma_read_long);
+
+    _bench("fmath_fadd_fsub", _fmath_fadd);
+    _bench("fmath_fmul_fdiv", _fmath_fmul);
+    _bench("fmath_fsqrt", _fmath_fsqrt);
+    _bench("fmath_fsin", _fmath_fsin);
+
+    _bench("rb_find", _rb_find);
+    _bench("coff_find_func", _coff_find_func);
+
+    return 0;
+}
@@ -58,12 +58,13 @@ enum {
 
 /*----------------------------------------------------------------------------
 | Floating-point rounding mode, extended double-precision rounding precision,
-| and exception flags.
+| and exception flags. (Shoebill: these are per-thread, so each machine's CPU
+| thread has its own.)
 *----------------------------------------------------------------------------*/
-int8 float_rounding_mode = float_round_nearest_even;
-int8 float_exception_flags = 0;
+__thread int8 float_rounding_mode = float_round_nearest_even;
+__thread int8 float_exception_flags = 0;
 #ifdef FLOATX80
-int8 floatx80_rounding_precision = 80;
+__thread int8 floatx80_rounding_precision = 80;
 #endif
 
 /*----------------------------------------------------------------------------
@@ -64,7 +64,7 @@ typedef struct {
 /*----------------------------------------------------------------------------
 | Software IEC/IEEE floating-point underflow tininess-detection mode.
 *----------------------------------------------------------------------------*/
-extern signed char float_detect_tininess;
+extern __thread signed char float_detect_tininess;
 enum {
     float_tininess_after_rounding  = 0,
     float_tininess_before_rounding = 1
@@ -73,7 +73,7 @@ enum {
 /*----------------------------------------------------------------------------
 | Software IEC/IEEE floating-point rounding mode.
 *----------------------------------------------------------------------------*/
-extern signed char float_rounding_mode;
+extern __thread signed char float_rounding_mode;
 enum {
     float_round_nearest_even = 0,
     float_round_down         = 1,
@@ -84,7 +84,7 @@ enum {
 /*----------------------------------------------------------------------------
 | Software IEC/IEEE floating-point exception flags.
 *----------------------------------------------------------------------------*/
-extern signed char float_exception_flags;
+extern __thread signed char float_exception_flags;
 enum {
     float_flag_invalid   =  1,
     float_flag_divbyzero =  4,
@@ -204,7 +204,7 @@ float128 floatx80_to_float128( floatx80 );
 | Software IEC/IEEE extended double-precision rounding precision.  Valid
 | values are 32, 64, and 80.
 *----------------------------------------------------------------------------*/
-extern signed char floatx80_rounding_precision;
+extern __thread signed char floatx80_rounding_precision;
 
 /*----------------------------------------------------------------------------
 | Software IEC/IEEE extended double-precision operations.
@@ -23,154 +23,275 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+
 #include <stdlib.h>
 #include <assert.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <string.h>
 #include "../core/shoebill.h"
 
+/*
+ * Each pool is an arena: small allocations are bump-allocated out of
+ * calloc()'d chunks (which double in size, from POOL_FIRST_CHUNK up to
+ * POOL_MAX_CHUNK), and p_free() puts them on a per-size-class free list
+ * for the next p_alloc() of that class. Only allocations bigger than
+ * POOL_MAX_SMALL get their own calloc(). p_free_pool() releases the
+ * chunks wholesale, without visiting individual allocations.
+ *
+ * Every allocation is preceded by a pool_header_t, so p_free() and
+ * p_realloc() can find the owning pool and size class.
+ */
 
+#define POOL_FIRST_CHUNK (16 * 1024)
+#define POOL_MAX_CHUNK (1024 * 1024)
+#define POOL_LARGE 0xffffffff // size_class for allocations bigger than POOL_MAX_SMALL
+#define POOL_ALLOC_MAGIC 0x5a17c0de
+#define POOL_FREED_MAGIC 0xdeadf7ee
 
-/*
-#define POOL_ALLOC_TYPE 0
-#define POOL_CHILD_LINK 1
-#define POOL_HEAD 2
-typedef struct _alloc_pool_t {
-    struct _alloc_pool_t *prev, *next;
-    uint8_t type;
-    union {
-        struct {
-            uint32_t size;
-        } alloc;
-        struct {
-            struct _alloc_pool_t *child; // pointer to the child's HEAD
-        } child_link;
-        struct {
-            struct _alloc_pool_t *parent_link; // pointer to the parent's CHILD_LINK
-        } head;
-    } t;
-    
+typedef struct _pool_chunk_t {
+    struct _pool_chunk_t *next;
+    uint64_t unused; // keep the allocations 16-byte aligned
+} pool_chunk_t;
+
+typedef struct {
+    alloc_pool_t *pool;
+    uint32_t size_class;
     uint32_t magic;
-} alloc_pool_t;
-*/
+} __attribute__ ((aligned (16))) pool_header_t;
+
+typedef struct _pool_large_t {
+    struct _pool_large_t *prev, *next;
+    size_t size;
+    pool_header_t header;
+} pool_large_t;
+
+static pool_header_t* _ptr_to_header(void *ptr)
+{
+    pool_header_t *header = (pool_header_t*)ptr;
+    return &header[-1];
+}
+
+static pool_large_t* _header_to_large(pool_header_t *header)
+{
+    return (pool_large_t*)(((uint8_t*)header) - offsetof(pool_large_t, header));
+}
+
+static uint32_t _size_class(size_t size)
+{
+    uint32_t c;
+    
+    if (size <= 512)
+        return (size == 0) ? 0 : ((size - 1) >> 4);
+    
+    for (c = 32; (1024 << (c - 32)) < size; c++) ;
+    return c;
+}
+
+static size_t _class_capacity(uint32_t size_class)
+{
+    if (size_class < 32)
+        return (size_class + 1) << 4;
+    return 1024 << (size_class - 32);
+}
 
 static void _check_pool(alloc_pool_t *pool)
 {
+    assert(pool->start_magic == POOL_START_MAGIC);
+    assert(pool->end_magic == POOL_END_MAGIC);
+}
+
+static void _link_large(alloc_pool_t *pool, pool_large_t *large)
+{
+    large->prev = NULL;
+    large->next = pool->large;
+    if (pool->large)
+        pool->large->prev = large;
+    pool->large = large;
+}
+
+static void* _alloc_large(alloc_pool_t *pool, size_t size)
+{
+    pool_large_t *large = (pool_large_t*)calloc(sizeof(pool_large_t) + size, 1);
+    
+    if (large == NULL)
+        return NULL;
+    
+    large->size = size;
+    large->header.pool = pool;
+    large->header.size_class = POOL_LARGE;
+    large->header.magic = POOL_ALLOC_MAGIC;
+    _link_large(pool, large);
     
+    return &large[1];
 }
 
-static alloc_pool_t* _ptr_to_header(void *ptr)
+static void _unlink_large(pool_large_t *large)
 {
-    alloc_pool_t *apt = (alloc_pool_t*)ptr;
-    return &apt[-1];
+    alloc_pool_t *pool = large->header.pool;
+    
+    if (large->prev)
+        large->prev->next = large->next;
+    else
+        pool->large = large->next;
+    if (large->next)
+        large->next->prev = large->prev;
 }
 
-void* p_alloc(alloc_pool_t *pool, size_t size)
+/*
+ * Start a new chunk big enough for at least one allocation of this size
+ */
+static _Bool _new_chunk(alloc_pool_t *pool, size_t need)
 {
-    alloc_pool_t *buf = (alloc_pool_t *)calloc(sizeof(alloc_pool_t) + size, 1);
+    size_t size = pool->next_chunk_size;
+    pool_chunk_t *chunk;
     
-    buf->type = POOL_ALLOC_TYPE;
-    buf->t.alloc.size = size;
+    while (size < (need + sizeof(pool_chunk_t)))
+        size *= 2;
     
-    buf->start_magic = POOL_START_MAGIC;
-    buf->end_magic = POOL_END_MAGIC;
+    if ((chunk = (pool_chunk_t*)calloc(size, 1)) == NULL)
+        return 0;
     
-    buf->next = pool->next;
-    buf->prev = pool;
+    chunk->next = pool->chunks;
+    pool->chunks = chunk;
+    pool->bump = (uint8_t*)&chunk[1];
+    pool->bump_end = ((uint8_t*)chunk) + size;
     
-    if (pool->next)
-        pool->next->prev = buf;
-    pool->next = buf;
+    if (pool->next_chunk_size < POOL_MAX_CHUNK)
+        pool->next_chunk_size *= 2;
     
-    return &buf[1];
+    return 1;
 }
 
-void* p_realloc(void *ptr, size_t size)
+void* p_alloc(alloc_pool_t *pool, size_t size)
 {
-    alloc_pool_t *header = _ptr_to_header(ptr);
-
-    assert(header->start_magic == POOL_START_MAGIC);
-    assert(header->end_magic == POOL_END_MAGIC);
-    assert(header->type == POOL_ALLOC_TYPE);
+    pool_header_t *header;
+    
+    if sunlikely(size > POOL_MAX_SMALL)
+        return _alloc_large(pool, size);
     
-    alloc_pool_t *new_header = (alloc_pool_t *)realloc(header, size + sizeof(alloc_pool_t));
+    const uint32_t size_class = _size_class(size);
+    const size_t capacity = _class_capacity(size_class);
+    void *recycled = pool->free_lists[size_class];
     
-    if (new_header) {
-        new_header->t.alloc.size = size;
+    if (recycled) {
+        // Free blocks keep the next pointer in their first word
+        pool->free_lists[size_class] = *(void**)recycled;
+        header = _ptr_to_header(recycled);
+        assert(header->magic == POOL_FREED_MAGIC);
+        memset(recycled, 0, capacity);
+    }
+    else {
+        const size_t need = sizeof(pool_header_t) + capacity;
         
-        if (new_header->next)
-            new_header->next->prev = new_header;
+        if sunlikely((size_t)(pool->bump_end - pool->bump) < need) {
+            if (!_new_chunk(pool, need))
+                return NULL;
+        }
         
-        if (new_header->prev)
-            new_header->prev->next = new_header;
-    
-        return &new_header[1];
+        // Chunks come from calloc(), so fresh space is already zeroed
+        header = (pool_header_t*)pool->bump;
+        pool->bump += need;
     }
     
-    return NULL;
+    header->pool = pool;
+    header->size_class = size_class;
+    header->magic = POOL_ALLOC_MAGIC;
+    
+    return &header[1];
 }
 
-/* 
- * Free *any* kind of alloc_pool_t header
- */
-static void _p_free_any(alloc_pool_t *header)
+void* p_realloc(void *ptr, size_t size)
 {
-    assert(header->start_magic == POOL_START_MAGIC);
-    assert(header->end_magic == POOL_END_MAGIC);
+    pool_header_t *header = _ptr_to_header(ptr);
+    alloc_pool_t *pool = header->pool;
+    size_t capacity;
+    void *new_ptr;
     
-    if (header->next)
-        header->next->prev = header->prev;
+    assert(header->magic == POOL_ALLOC_MAGIC);
     
-    if (header->prev)
-        header->prev->next = header->next;
+    if (header->size_class == POOL_LARGE) {
+        pool_large_t *large = _header_to_large(header);
+        
+        if (size > POOL_MAX_SMALL) {
+            // Stay large, and let realloc() move it (if it fails, the old allocation is still valid)
+            _unlink_large(large);
+            pool_large_t *new_large = (pool_large_t*)realloc(large, sizeof(pool_large_t) + size);
+            if (new_large) {
+                large = new_large;
+                large->size = size;
+            }
+            _link_large(pool, large);
+            return new_large ? &new_large[1] : NULL;
+        }
+        capacity = large->size;
+    }
+    else {
+        capacity = _class_capacity(header->size_class);
+        if (size <= capacity)
+            return ptr;
+    }
     
-    free(header);
+    if ((new_ptr = p_alloc(pool, size)) == NULL)
+        return NULL;
+    memcpy(new_ptr, ptr, (size < capacity) ? size : capacity);
+    p_free(ptr);
+    
+    return new_ptr;
 }
 
-/*
- * Free an alloc_pool allocation (but not HEAD or CHILD_LINK)
- */
 void p_free(void *ptr)
 {
-    alloc_pool_t *header = _ptr_to_header(ptr);
-    assert(header->type == POOL_ALLOC_TYPE);
-    memset(ptr, 0xaa, header->t.alloc.size);
-    _p_free_any(header);
+    pool_header_t *header = _ptr_to_header(ptr);
+    alloc_pool_t *pool = header->pool;
+    
+    assert(header->magic == POOL_ALLOC_MAGIC);
+    
+    if (header->size_class == POOL_LARGE) {
+        pool_large_t *large = _header_to_large(header);
+        _unlink_large(large);
+        memset(ptr, 0xaa, large->size);
+        free(large);
+        return ;
+    }
+    
+    memset(ptr, 0xaa, _class_capacity(header->size_class));
+    header->magic = POOL_FREED_MAGIC;
+    *(void**)ptr = pool->free_lists[header->size_class];
+    pool->free_lists[header->size_class] = ptr;
 }
 
 void p_free_pool(alloc_pool_t *pool)
 {
-    while (pool->prev)
-        pool = pool->prev;
-    
-    while (pool) {
-        alloc_pool_t *cur = pool;
-        pool = cur->next;
-        assert(cur->start_magic == POOL_START_MAGIC);
-        assert(cur->end_magic == POOL_END_MAGIC);
-        
-        switch (cur->type) {
-            case POOL_ALLOC_TYPE:
-                _p_free_any(cur);
-                break;
-            case POOL_CHILD_LINK: {
-                // p_free_pool will free and unlink cur
-                // (its parent's CHILD_LINK)
-                p_free_pool(cur->t.child_link.child);
-                break;
-            }
-            case POOL_HEAD: {
-                if (cur->t.head.parent_link) {
-                    assert(cur->t.head.parent_link->type == POOL_CHILD_LINK);
-                    _p_free_any(cur->t.head.parent_link);
-                }
-                _p_free_any(cur);
-                break;
-            }
-            default:
-                assert(!"unknown POOL_ type");
-        }
+    _check_pool(pool);
+    
+    // Children unlink themselves from pool->children
+    while (pool->children)
+        p_free_pool(pool->children);
+    
+    while (pool->large) {
+        pool_large_t *large = pool->large;
+        pool->large = large->next;
+        free(large);
     }
+    
+    while (pool->chunks) {
+        pool_chunk_t *chunk = pool->chunks;
+        pool->chunks = chunk->next;
+        free(chunk);
+    }
+    
+    if (pool->parent) {
+        if (pool->prev_sibling)
+            pool->prev_sibling->next_sibling = pool->next_sibling;
+        else
+            pool->parent->children = pool->next_sibling;
+        if (pool->next_sibling)
+            pool->next_sibling->prev_sibling = pool->prev_sibling;
+    }
+    
+    memset(pool, 0xaa, sizeof(alloc_pool_t));
+    free(pool);
 }
 
 alloc_pool_t* p_new_pool(alloc_pool_t *parent_pool)
@@ -179,17 +300,17 @@ alloc_pool_t* p_new_pool(alloc_pool_t *parent_pool)
     
     pool->start_magic = POOL_START_MAGIC;
     pool->end_magic = POOL_END_MAGIC;
-    pool->type = POOL_HEAD;
+    pool->next_chunk_size = POOL_FIRST_CHUNK;
     
+    // The first chunk is allocated lazily, so empty pools stay cheap
     if (parent_pool) {
-        alloc_pool_t *link = _ptr_to_header(p_alloc(parent_pool, 0));
-        link->type = POOL_CHILD_LINK;
-        link->t.child_link.child = pool; // child_link.child points to the child's HEAD
-        
-        pool->t.head.parent_link = link; // head.parent_link points to the parent's CHILD_LINK
+        _check_pool(parent_pool);
+        pool->parent = parent_pool;
+        pool->next_sibling = parent_pool->children;
+        if (parent_pool->children)
+            parent_pool->children->prev_sibling = pool;
+        parent_pool->children = pool;
     }
-    else
-        pool->t.head.parent_link = NULL;
     
     return pool;
-}
\ No newline at end of file
+}
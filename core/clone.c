@@ -0,0 +1,196 @@
+/*
+ * Copyright (c) 2014, Peter Rutenbar <pruten@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * Cloning a running machine with fork(). Each child starts out as an exact
+ * copy of the parent at the instant of the fork: guest RAM (and everything
+ * else) is shared copy-on-write by the host kernel, so a booted A/UX can be
+ * fanned out into many independent machines nearly for free.
+ *
+ * Only the forking thread survives into a child, so the child rebuilds the
+ * machine's locks and restarts its CPU and VIA clock threads. Disk images
+ * are reopened read-only, and all of the child's disk writes go to a private
+ * overlay file instead (see _disk_read()/_disk_write() in scsi.c).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include "shoebill.h"
+
+/* Point every disk at a fresh, private overlay */
+static _Bool _make_overlays (uint32_t index, const char *overlay_dir)
+{
+    uint32_t i;
+    
+    for (i=0; i<8; i++) {
+        scsi_device_t *dev = &shoe.scsi_devices[i];
+        char path[1024];
+        FILE *f;
+        
+        if (dev->f == NULL)
+            continue;
+        
+        /*
+         * The parent's FILE shares its file offset with ours, and the
+         * parent keeps seeking it, so get our own (read-only) descriptor
+         */
+        f = fopen(dev->image_path, "rb");
+        if (f == NULL) {
+            slog("clone %u: couldn't reopen disk image %s\n", index, dev->image_path);
+            return 0;
+        }
+        fclose(dev->f);
+        dev->f = f;
+        
+        // A clone of a clone inherits its parent's overlay contents
+        if (dev->overlay) {
+            fclose(dev->overlay);
+            dev->overlay = NULL;
+        }
+        
+        if (overlay_dir) {
+            snprintf(path, sizeof(path), "%s/clone%u.%u.scsi%u.overlay", overlay_dir, (uint32_t)getppid(), index, i);
+            dev->overlay = fopen(path, "w+b");
+        }
+        else
+            dev->overlay = tmpfile();
+        
+        if (dev->overlay == NULL) {
+            slog("clone %u: couldn't create an overlay for scsi id %u (errno=%d)\n", index, i, errno);
+            return 0;
+        }
+        
+        if (dev->overlay_map == NULL)
+            dev->overlay_map = p_alloc(shoe.pool, (dev->num_blocks + 7) / 8);
+        else
+            memset(dev->overlay_map, 0, (dev->num_blocks + 7) / 8);
+    }
+    
+    return 1;
+}
+
+/* In the child: the parent's threads are gone, and their locks are in whatever state fork() caught them */
+static void _restart_machine (void)
+{
+    pthread_mutex_init(&shoe.via_cpu_lock, NULL);
+    pthread_mutex_init(&shoe.via_clock_thread_lock, NULL);
+    pthread_mutex_init(&shoe.cpu_thread_lock, NULL);
+    pthread_mutex_init(&shoe.cpu_stop_mutex, NULL);
+    pthread_mutex_init(&shoe.adb.lock, NULL);
+    pthread_cond_init(&shoe.cpu_stop_cond, NULL);
+    pthread_cond_init(&shoe.cpu_pause_cond, NULL);
+    
+    // The CPU thread was parked between instructions, and the new one picks up right there
+    shoe.cpu_thread_notifications &= ~(SHOEBILL_STATE_PAUSE | SHOEBILL_STATE_PROFILE |
+                                       SHOEBILL_STATE_TRACE | SHOEBILL_STATE_REPLAY);
+    shoe.cpu_paused = 0;
+    shoe.cpu_pausers = 0;
+    
+    // The profiler's and tracer's threads didn't come along, and their output (like a recording) is the parent's
+    shoe.profiler = NULL;
+    shoe.tracer = NULL;
+    shoe.trace_mem = 0;
+    shoe.replayer = NULL;
+    
+    /*
+     * Same for the checkpointer. Its struct (and its lock and log FILE) are the
+     * parent's, so leave them be. Dirty tracking stays on; a child that wants
+     * checkpoints calls shoebill_checkpoint_start() with its own log.
+     */
+    shoe.checkpointer = NULL;
+    
+    pthread_create(&shoe.via_thread_pid, NULL, via_clock_thread, shoe_ctx);
+    pthread_create(&shoe.cpu_thread_pid, NULL, _cpu_thread, shoe_ctx);
+}
+
+/*
+ * Fork the running machine into n children. pids (if not NULL) receives the
+ * children's process IDs. overlay_dir is where the children's disk overlays
+ * go (NULL for anonymous temp files, discarded when the child exits).
+ *
+ * Returns 0 in the parent, the child's index (1 through n) in each child,
+ * or -1 if the machine can't be cloned. If a fork() fails partway, the
+ * children already forked are left running, and their pids are in pids[].
+ */
+int32_t shoebill_clone(uint32_t n, const char *overlay_dir, pid_t *pids)
+{
+    uint32_t i;
+    
+    if (!shoe.running || shoe.config_copy.debug_mode) {
+        slog("shoebill_clone: the machine has to be running (and not under the debugger)\n");
+        return -1;
+    }
+    
+    for (i=0; i<16; i++) {
+        if (shoe.slots[i].card_type == card_shoebill_ethernet) {
+            slog("shoebill_clone: can't clone the ethernet card in slot %u (its tap device can't be shared)\n", i);
+            return -1;
+        }
+    }
+    
+    // Stop the machine at an instruction boundary, same as shoebill_save_state()
+    pause_cpu_thread();
+    pthread_mutex_lock(&shoe.via_cpu_lock);
+    pthread_mutex_lock(&shoe.adb.lock);
+    
+    for (i=1; i<=n; i++) {
+        /*
+         * These are shared by every machine in the process, and the threads
+         * that might be holding them don't exist in the child, so take them
+         * for the fork itself
+         */
+        coff_kernel_cache_lock();
+        tp_lock_rings();
+        const pid_t pid = fork();
+        tp_unlock_rings();
+        coff_kernel_cache_unlock();
+        
+        if (pid == 0) {
+            if (!_make_overlays(i, overlay_dir))
+                _exit(1);
+            _restart_machine();
+            return i;
+        }
+        
+        if (pid < 0) {
+            slog("shoebill_clone: fork() failed after %u children (errno=%d)\n", i - 1, errno);
+            break;
+        }
+        
+        if (pids)
+            pids[i - 1] = pid;
+    }
+    
+    pthread_mutex_unlock(&shoe.adb.lock);
+    pthread_mutex_unlock(&shoe.via_cpu_lock);
+    resume_cpu_thread();
+    
+    return (i > n) ? 0 : -1;
+}
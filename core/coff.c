@@ -29,6 +29,7 @@
 #include <time.h>
 #include <stdint.h>
 #include <assert.h>
+#include <pthread.h>
 #include "shoebill.h"
 
 void symb_inorder(rb_node *cur) {
@@ -177,8 +178,7 @@ coff_file* coff_parse(uint8_t *buf, uint32_t buflen, alloc_pool_t *parent_pool)
     if (cf->num_symbols == 0) // if num_symbols==0, symtab_offset may be bogus
         return cf; // just return
     
-    cf->func_tree = rb_new(cf->pool, sizeof(coff_symbol*));
-    //slog("func_tree = %llx, *func_tree = %llx\n", cf->func_tree, *cf->func_tree);
+    cf->index = symbol_index_new(cf->pool, cf->num_symbols);
     cf->symbols = p_calloc(cf->pool, coff_symbol, cf->num_symbols);
     
     // Seek to the symbol table
@@ -241,16 +241,14 @@ coff_file* coff_parse(uint8_t *buf, uint32_t buflen, alloc_pool_t *parent_pool)
         //}
         
     
-        if (cf->symbols[i].sclass == 2 || cf->symbols[i].sclass == 3) {
-            void *ptr = &cf->symbols[i];
-            rb_insert(cf->func_tree, cf->symbols[i].value, &ptr, NULL);
-            //slog("%s addr=0x%x\n", cf->symbols[i].name, cf->symbols[i].value);
-        }
+        // Only external and static symbols are findable by address
+        symbol_index_add(cf->index, cf->symbols[i].value, cf->symbols[i].name, i,
+                         SYMBOL_NAME | (((cf->symbols[i].sclass == 2) || (cf->symbols[i].sclass == 3)) ? SYMBOL_ADDR : 0));
         // slog("%u: %s (class=%u)\n", i+1, cf->symbols[i].name, cf->symbols[i].sclass);
         
     }
     
-    // symb_inorder(*cf->func_tree);
+    symbol_index_finish(cf->index);
     
     // and we're done
     return cf;
@@ -295,6 +293,132 @@ coff_file* coff_parse_from_path(const char *path, alloc_pool_t *parent_pool)
     return coff;
 }
 
+/* --- Kernel cache --- */
+#pragma mark Kernel cache
+
+/*
+ * Extracting and parsing the A/UX kernel at every boot and restart is slow,
+ * so parsed kernels stay cached (outside any machine's pool) and are shared
+ * read-only between restarts and machines. An entry is reused as long as
+ * the disk image and the kernel's inode in it look the same.
+ */
+
+#define KERNEL_CACHE_SIZE 4
+
+typedef struct {
+    shoebill_kernel_id_t id;
+    char *kernel_path;
+    coff_file *coff;
+    uint32_t refcount;
+} kernel_cache_entry_t;
+
+static pthread_mutex_t kernel_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static kernel_cache_entry_t kernel_cache[KERNEL_CACHE_SIZE];
+
+static void _kernel_cache_evict(kernel_cache_entry_t *entry)
+{
+    coff_free(entry->coff);
+    free(entry->kernel_path);
+    memset(entry, 0, sizeof(*entry));
+}
+
+/* Load the kernel at kernel_path from disk_path, or reuse the cached copy */
+coff_file* coff_load_kernel(const char *disk_path, const char *kernel_path, char *error_str)
+{
+    shoebill_kernel_id_t id;
+    kernel_cache_entry_t *slot = NULL;
+    coff_file *coff;
+    uint8_t *kernel_data;
+    uint32_t i, kernel_size;
+    
+    if (!shoebill_identify_kernel(disk_path, kernel_path, error_str, &id))
+        return NULL;
+    
+    pthread_mutex_lock(&kernel_cache_lock);
+    for (i=0; i<KERNEL_CACHE_SIZE; i++) {
+        kernel_cache_entry_t *entry = &kernel_cache[i];
+        if (entry->coff && (strcmp(entry->kernel_path, kernel_path) == 0) &&
+            (memcmp(&entry->id, &id, sizeof(id)) == 0)) {
+            entry->refcount++;
+            pthread_mutex_unlock(&kernel_cache_lock);
+            slog("coff_load_kernel: reusing cached %s\n", kernel_path);
+            return entry->coff;
+        }
+    }
+    pthread_mutex_unlock(&kernel_cache_lock);
+    
+    kernel_data = shoebill_extract_kernel(disk_path, kernel_path, error_str, &kernel_size);
+    if (!kernel_data)
+        return NULL;
+    
+    coff = coff_parse(kernel_data, kernel_size, NULL);
+    free(kernel_data); // kernel_data was allocated with malloc()
+    if (!coff)
+        return NULL;
+    
+    pthread_mutex_lock(&kernel_cache_lock);
+    for (i=0; i<KERNEL_CACHE_SIZE; i++) {
+        kernel_cache_entry_t *entry = &kernel_cache[i];
+        if (entry->coff && (entry->refcount == 0) &&
+            (entry->id.dev == id.dev) && (entry->id.ino == id.ino) &&
+            (strcmp(entry->kernel_path, kernel_path) == 0))
+            _kernel_cache_evict(entry); // A stale copy of this same kernel
+    }
+    for (i=0; (i<KERNEL_CACHE_SIZE) && !slot; i++) {
+        if (kernel_cache[i].coff == NULL)
+            slot = &kernel_cache[i];
+    }
+    for (i=0; (i<KERNEL_CACHE_SIZE) && !slot; i++) {
+        if (kernel_cache[i].refcount == 0) {
+            _kernel_cache_evict(&kernel_cache[i]);
+            slot = &kernel_cache[i];
+        }
+    }
+    // If every entry is in use, this kernel just doesn't get cached
+    if (slot) {
+        slot->id = id;
+        slot->kernel_path = strdup(kernel_path);
+        slot->coff = coff;
+        slot->refcount = 1;
+    }
+    pthread_mutex_unlock(&kernel_cache_lock);
+    
+    return coff;
+}
+
+/* Drop a reference to a kernel from coff_load_kernel() */
+void coff_release_kernel(coff_file *coff)
+{
+    uint32_t i;
+    
+    pthread_mutex_lock(&kernel_cache_lock);
+    for (i=0; i<KERNEL_CACHE_SIZE; i++) {
+        if (kernel_cache[i].coff == coff) {
+            assert(kernel_cache[i].refcount > 0);
+            kernel_cache[i].refcount--;
+            pthread_mutex_unlock(&kernel_cache_lock);
+            return ;
+        }
+    }
+    pthread_mutex_unlock(&kernel_cache_lock);
+    
+    coff_free(coff); // It was never cached
+}
+
+/*
+ * shoebill_clone() holds the cache across fork(), so a child never inherits
+ * it locked (and maybe half-updated) by some other machine's thread
+ */
+void coff_kernel_cache_lock(void)
+{
+    pthread_mutex_lock(&kernel_cache_lock);
+}
+
+void coff_kernel_cache_unlock(void)
+{
+    pthread_mutex_unlock(&kernel_cache_lock);
+}
+
 // dump some data about a coff_file structure
 void print_coff_info(coff_file *coff)
 {
@@ -320,38 +444,24 @@ void print_coff_info(coff_file *coff)
 
 coff_symbol* coff_find_symbol(coff_file *coff, const char *name)
 {
-    uint32_t i;
+    const symbol_entry_t *entry;
     
-    for (i=0; i < coff->num_symbols; i++) {
-        if (strcmp(coff->symbols[i].name, name) == 0)
-            return &coff->symbols[i];
-    }
-    return NULL;
+    if (coff->num_symbols == 0)
+        return NULL;
+    if ((entry = symbol_find_name(coff->index, name)) == NULL)
+        return NULL;
+    return &coff->symbols[entry->payload];
 }
 
 coff_symbol* coff_find_func(coff_file *coff, uint32_t addr)
 {
-    rb_node *cur;
-    coff_symbol *last = NULL;
+    const symbol_entry_t *entry;
     
-    // slog("coff->num_symbols = %u\n", coff->num_symbols);
-    if (coff->num_symbols == 0) 
+    if (coff->num_symbols == 0)
         return NULL;
-    cur = coff->func_tree->root;
-    
-    while (cur) {
-        // slog("... iterating\n");
-        if (addr < cur->key) 
-            cur = cur->left;
-        else if (addr > cur->key) {
-            last = *(coff_symbol**)&cur[1];
-            cur = cur->right;
-        }
-        else
-            return *(coff_symbol**)&cur[1];
-    }
-    
-    return last;
+    if ((entry = symbol_find_addr(coff->index, addr)) == NULL)
+        return NULL;
+    return &coff->symbols[entry->payload];
 }
       
 
@@ -27,6 +27,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <assert.h>
 #include <pthread.h>
 #include <unistd.h>
@@ -36,6 +37,79 @@
 #include "../core/shoebill.h"
 
 
+/*
+ * Guest RAM comes straight from an anonymous mapping, so it's zero-filled
+ * lazily as the guest touches it. The usable part starts 2MB-aligned (so
+ * the host can back it with huge pages), is rounded up to cover the 8 bytes
+ * that physical_get may read past the end, and has a PROT_NONE guard page
+ * on either side.
+ */
+#define RAM_ALIGN (2 * 1024 * 1024)
+
+static size_t _ram_usable_size (uint32_t ram_size)
+{
+    const size_t page_size = sysconf(_SC_PAGESIZE);
+    return (((size_t)ram_size + 8 + page_size - 1) / page_size) * page_size;
+}
+
+static _Bool _alloc_ram (uint32_t ram_size)
+{
+    const size_t page_size = sysconf(_SC_PAGESIZE);
+    const size_t usable = _ram_usable_size(ram_size);
+    const size_t map_size = page_size + RAM_ALIGN + usable + page_size;
+    uint8_t *map, *base;
+    
+    map = mmap(NULL, map_size, PROT_NONE, MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (map == MAP_FAILED)
+        return 0;
+    
+    base = (uint8_t*)((((uintptr_t)map + page_size + RAM_ALIGN - 1) / RAM_ALIGN) * RAM_ALIGN);
+    if (mprotect(base, usable, PROT_READ | PROT_WRITE) != 0) {
+        munmap(map, map_size);
+        return 0;
+    }
+#ifdef MADV_HUGEPAGE
+    madvise(base, usable, MADV_HUGEPAGE); // Just advice, transparent huge pages may be off
+#endif
+    
+    shoe.physical_mem_map = map;
+    shoe.physical_mem_map_size = map_size;
+    shoe.physical_mem_base = base;
+    shoe.physical_mem_size = ram_size;
+    return 1;
+}
+
+/*
+ * Zero guest RAM by mapping fresh anonymous pages over it, rather than
+ * writing every page (which would commit all of RAM on the host again).
+ * Every page counts as dirty afterwards.
+ */
+void zero_ram (void)
+{
+    const size_t usable = _ram_usable_size(shoe.physical_mem_size);
+    void *base;
+    
+    base = mmap(shoe.physical_mem_base, usable, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANON | MAP_FIXED, -1, 0);
+    if (base == MAP_FAILED)
+        memset(shoe.physical_mem_base, 0, usable);
+#ifdef MADV_HUGEPAGE
+    else
+        madvise(base, usable, MADV_HUGEPAGE);
+#endif
+    
+    if (shoe.dirty_map)
+        memset(shoe.dirty_map, 1, shoe.dirty_map_len);
+}
+
+static void _free_ram (void)
+{
+    if (shoe.physical_mem_map)
+        munmap(shoe.physical_mem_map, shoe.physical_mem_map_size);
+    shoe.physical_mem_map = NULL;
+    shoe.physical_mem_base = NULL;
+}
+
 void shoebill_start()
 {
     shoe.running = 1;
@@ -47,6 +121,11 @@ void shoebill_stop()
 {
     uint32_t i;
     
+    shoebill_profile_stop();
+    shoebill_trace_stop();
+    shoebill_checkpoint_stop();
+    shoebill_record_stop();
+    
     // Tear down the CPU / timer threads
     shoe.cpu_thread_notifications |= SHOEBILL_STATE_RETURN;
     shoe.via_thread_notifications = SHOEBILL_STATE_RETURN;
@@ -66,6 +145,7 @@ void shoebill_stop()
     
     pthread_mutex_destroy(&shoe.cpu_stop_mutex);
     pthread_cond_destroy(&shoe.cpu_stop_cond);
+    pthread_cond_destroy(&shoe.cpu_pause_cond);
     
     shoe.running = 0;
     
@@ -79,9 +159,15 @@ void shoebill_stop()
         if (shoe.scsi_devices[i].f)
             fclose(shoe.scsi_devices[i].f);
         shoe.scsi_devices[i].f = NULL;
+        if (shoe.scsi_devices[i].overlay)
+            fclose(shoe.scsi_devices[i].overlay);
+        shoe.scsi_devices[i].overlay = NULL;
     }
     
-    // Free the alloc pool
+    // Release the kernel, unmap RAM and free the alloc pool
+    if (shoe.coff)
+        coff_release_kernel(shoe.coff);
+    _free_ram();
     p_free_pool(shoe.pool);
     
     // Zero the global context
@@ -90,7 +176,7 @@ void shoebill_stop()
 
 static void _await_interrupt (void)
 {
-    struct timeval now;
+    struct timeval now, after;
     struct timespec later;
     
     assert(pthread_mutex_lock(&shoe.cpu_stop_mutex) == 0);
@@ -107,11 +193,102 @@ static void _await_interrupt (void)
     pthread_cond_timedwait(&shoe.cpu_stop_cond,
                            &shoe.cpu_stop_mutex,
                            &later);
+    
+    gettimeofday(&after, NULL);
+    shoe.stats.stopped_usecs += ((after.tv_sec - now.tv_sec) * 1000000) + (after.tv_usec - now.tv_usec);
+    
+    assert(pthread_mutex_unlock(&shoe.cpu_stop_mutex) == 0);
+}
+
+/*
+ * Park the CPU thread between instructions until resume_cpu_thread(),
+ * so other threads can read or replace the machine state (snapshots).
+ * Pauses nest: the CPU only starts again when the last pauser resumes.
+ * Don't call this from the CPU thread.
+ */
+void pause_cpu_thread (void)
+{
+    // The debugger runs its own CPU thread, which doesn't know about pausing
+    if (!shoe.running || shoe.config_copy.debug_mode)
+        return ;
+    
+    assert(pthread_mutex_lock(&shoe.cpu_stop_mutex) == 0);
+    shoe.cpu_pausers++;
+    while (1) {
+        struct timeval now;
+        struct timespec later;
+        
+        /*
+         * The CPU thread clears its own notification bits without a lock,
+         * so keep re-asserting PAUSE until it actually parks. This also
+         * holds it parked if the last pauser just resumed it, but it
+         * hasn't woken up yet.
+         */
+        pthread_mutex_lock(&shoe.via_cpu_lock);
+        shoe.cpu_thread_notifications |= SHOEBILL_STATE_PAUSE;
+        pthread_mutex_unlock(&shoe.via_cpu_lock);
+        
+        if (shoe.cpu_paused)
+            break;
+        
+        // Wake it up if it's STOPPED
+        pthread_cond_signal(&shoe.cpu_stop_cond);
+        
+        gettimeofday(&now, NULL);
+        later.tv_sec = now.tv_sec;
+        later.tv_nsec = (now.tv_usec * 1000) + (1000000000 / 100);
+        if (later.tv_nsec >= 1000000000) {
+            later.tv_nsec -= 1000000000;
+            later.tv_sec++;
+        }
+        pthread_cond_timedwait(&shoe.cpu_pause_cond, &shoe.cpu_stop_mutex, &later);
+    }
     assert(pthread_mutex_unlock(&shoe.cpu_stop_mutex) == 0);
 }
 
+void resume_cpu_thread (void)
+{
+    if (!shoe.running || shoe.config_copy.debug_mode)
+        return ;
+    
+    assert(pthread_mutex_lock(&shoe.cpu_stop_mutex) == 0);
+    assert(shoe.cpu_pausers > 0);
+    if (--shoe.cpu_pausers == 0) {
+        pthread_mutex_lock(&shoe.via_cpu_lock);
+        shoe.cpu_thread_notifications &= ~~SHOEBILL_STATE_PAUSE;
+        pthread_mutex_unlock(&shoe.via_cpu_lock);
+        pthread_cond_broadcast(&shoe.cpu_pause_cond);
+    }
+    assert(pthread_mutex_unlock(&shoe.cpu_stop_mutex) == 0);
+}
+
+static void _park_cpu_thread (void)
+{
+    assert(pthread_mutex_lock(&shoe.cpu_stop_mutex) == 0);
+    shoe.cpu_paused = 1;
+    pthread_cond_broadcast(&shoe.cpu_pause_cond);
+    while (shoe.cpu_thread_notifications & SHOEBILL_STATE_PAUSE)
+        pthread_cond_wait(&shoe.cpu_pause_cond, &shoe.cpu_stop_mutex);
+    shoe.cpu_paused = 0;
+    assert(pthread_mutex_unlock(&shoe.cpu_stop_mutex) == 0);
+}
+
+/*
+ * Without the debugger, there's nowhere to stop on a watchpoint, so just log it
+ */
+static void _report_watch_hit (void)
+{
+    const watch_hit_t *hit = &shoe.watch_hit;
+    
+    slog("watchpoint %u: pc 0x%08x %s 0x%08x (%u bytes) 0x%llx -> 0x%llx\n",
+         hit->num, hit->pc, hit->is_write ? "wrote" : "read", hit->addr, hit->size,
+         hit->old_dat, hit->is_write ? hit->new_dat : hit->old_dat);
+    __sync_fetch_and_and(&shoe.cpu_thread_notifications, ~~SHOEBILL_STATE_WATCH);
+}
+
 void *_cpu_thread (void *arg)
 {
+    shoe_ctx = arg;
     pthread_mutex_lock(&shoe.cpu_thread_lock);
     
     while (1) {
@@ -128,8 +305,29 @@ void *_cpu_thread (void *arg)
                 return NULL;
             }
             
+            if (shoe.cpu_thread_notifications & SHOEBILL_STATE_PROFILE)
+                profile_sample();
+            
+            if (shoe.cpu_thread_notifications & SHOEBILL_STATE_WATCH)
+                _report_watch_hit();
+            
+            if (shoe.cpu_thread_notifications & SHOEBILL_STATE_PAUSE) {
+                _park_cpu_thread();
+                continue;
+            }
+            
             if (shoe.cpu_thread_notifications & SHOEBILL_STATE_STOPPED) {
-                _await_interrupt();
+                // While recording or replaying, the interrupt that ends the STOP comes through replay_poll()
+                if (!(shoe.cpu_thread_notifications & SHOEBILL_STATE_REPLAY) || !replay_poll(1))
+                    _await_interrupt();
+                continue;
+            }
+            
+            if (shoe.cpu_thread_notifications & SHOEBILL_STATE_REPLAY)
+                replay_poll(0);
+            
+            if (shoe.cpu_thread_notifications & SHOEBILL_STATE_TRACE) {
+                trace_step();
                 continue;
             }
         }
@@ -342,8 +540,7 @@ static void _init_kernel_info(shoebill_config_t *config, scsi_device_t *disks, u
     fix_endian(ki.swap_drive);
     fix_endian(ki.swap_partition);
     
-    for (i=0; i<sizeof(struct kernel_info); i++)
-        pset(ki_addr+i, 1, ((uint8_t*)&ki)[i]);
+    physical_write_block(ki_addr, (uint8_t*)&ki, sizeof(struct kernel_info));
     
     /* ---- Copy DrvQEl elements into memory ---- */
     // FIXME: btw, this is probably wrong. DrvQEl elements are supposed to be partitions, I think
@@ -493,7 +690,7 @@ fail:
 
 static uint32_t _load_aux_kernel(shoebill_config_t *config, coff_file *coff, uint32_t *_pc)
 {
-    uint32_t j, i, pc = 0xffffffff;
+    uint32_t i, pc = 0xffffffff;
     for (i = 0; i < coff->num_sections; i++) {
         coff_section *s = &coff->sections[i];
         
@@ -504,8 +701,7 @@ static uint32_t _load_aux_kernel(shoebill_config_t *config, coff_file *coff, uin
         if ((s->flags & coff_text) || (s->flags & coff_data)) {
             /* copy text or data section */
             
-            for (j = 0; j < s->sz; j++)
-                pset(s->p_addr+j, 1, s->data[j]);
+            physical_write_block(s->p_addr, s->data, s->sz);
             
             if (strcmp(s->name, "pstart") == 0)
                 pc = s->p_addr;
@@ -513,8 +709,7 @@ static uint32_t _load_aux_kernel(shoebill_config_t *config, coff_file *coff, uin
         else if (s->flags & coff_bss) {
             /* Create an empty .bss segment */
             
-            for (j = 0; j < s->sz; j++)
-                pset(s->p_addr+j, 1, 0);
+            physical_fill(s->p_addr, 0, s->sz);
         }
     }
     
@@ -558,6 +753,7 @@ uint32_t shoebill_install_video_card(shoebill_config_t *config, uint8_t slotnum,
     shoe.slots[slotnum].write_func = nubus_video_write_func;
     shoe.slots[slotnum].destroy_func = NULL;
     shoe.slots[slotnum].interrupts_enabled = 1;
+    shoe.slots[slotnum].vbl_hz = 60.0;
     nubus_video_init(ctx, slotnum, width, height, scanline_width);
     return 1;
 }
@@ -581,6 +777,7 @@ uint32_t shoebill_install_tfb_card(shoebill_config_t *config, uint8_t slotnum)
     shoe.slots[slotnum].write_func = nubus_tfb_write_func;
     shoe.slots[slotnum].destroy_func = NULL;
     shoe.slots[slotnum].interrupts_enabled = 1;
+    shoe.slots[slotnum].vbl_hz = 66.67; // the Toby card drives the 13" monitor at 66.67hz
     nubus_tfb_init(ctx, slotnum);
     return 1;
 }
@@ -607,6 +804,11 @@ uint32_t shoebill_install_ethernet_card(shoebill_config_t *config, uint8_t slotn
     return 1;
 }
 
+void shoebill_get_stats(shoebill_stats_t *stats)
+{
+    memcpy(stats, &shoe.stats, sizeof(shoebill_stats_t));
+}
+
 shoebill_video_frame_info_t shoebill_get_video_frame(uint8_t slotnum,
                                                      _Bool just_params)
 {
@@ -641,8 +843,8 @@ uint32_t shoebill_initialize(shoebill_config_t *config)
     uint32_t i, j, pc = 0xffffffff;
     coff_file *coff = NULL;
     scsi_device_t disks[8];
-    uint8_t *rom_data = NULL, *kernel_data = NULL;
-    uint32_t rom_size = 0, kernel_size;
+    uint8_t *rom_data = NULL;
+    uint32_t rom_size = 0;
     
     
     memset(&disks[0], 0, 8 * sizeof(scsi_device_t));
@@ -673,20 +875,16 @@ uint32_t shoebill_initialize(shoebill_config_t *config)
         goto fail;
     }
     
-    // Load the kernel from the disk at scsi id #0
-    kernel_data = shoebill_extract_kernel((char*)config->scsi_devices[0].path,
-                                 config->aux_kernel_path,
-                                 config->error_msg,
-                                 &kernel_size);
-    if (!kernel_data)
-        goto fail;
-    
-    coff = coff_parse(kernel_data, kernel_size, shoe.pool);
-    free(kernel_data); // kernel_data was allocated with malloc()
+    // Load the kernel from the disk at scsi id #0 (or the kernel cache)
+    config->error_msg[0] = 0;
+    coff = coff_load_kernel((char*)config->scsi_devices[0].path,
+                            config->aux_kernel_path,
+                            config->error_msg);
     
     if (coff == NULL) {
-        sprintf(config->error_msg, "Can't open that A/UX kernel [%s]\n",
-                config->aux_kernel_path);
+        if (strlen(config->error_msg) == 0)
+            sprintf(config->error_msg, "Can't open that A/UX kernel [%s]\n",
+                    config->aux_kernel_path);
         goto fail;
     }
     shoe.coff = coff;
@@ -708,9 +906,10 @@ uint32_t shoebill_initialize(shoebill_config_t *config)
     p_free(rom_data);
     rom_data = NULL;
     
-    shoe.physical_mem_size = config->ram_size;
-    shoe.physical_mem_base = p_calloc(shoe.pool, uint8_t, config->ram_size+8); // +8 because of physical_get hack
-    memset(shoe.physical_mem_base, 0, shoe.physical_mem_size);
+    if (!_alloc_ram(config->ram_size)) {
+        sprintf(config->error_msg, "Can't allocate %u bytes of ram\n", config->ram_size);
+        goto fail;
+    }
     
     // Initialize Macintosh lomem variables that A/UX actually cares about
     
@@ -752,22 +951,23 @@ uint32_t shoebill_initialize(shoebill_config_t *config)
     pthread_mutex_init(&shoe.via_clock_thread_lock, NULL);
     
     pthread_mutex_lock(&shoe.via_clock_thread_lock);
-    pthread_create(&shoe.via_thread_pid, NULL, via_clock_thread, NULL);
+    pthread_create(&shoe.via_thread_pid, NULL, via_clock_thread, shoe_ctx);
     
     /*
      * config->debug_mode is a hack - the debugger implements its own CPU thread
      */
     
     pthread_cond_init(&shoe.cpu_stop_cond, NULL);
+    pthread_cond_init(&shoe.cpu_pause_cond, NULL);
     pthread_mutex_init(&shoe.cpu_stop_mutex, NULL);
     pthread_mutex_init(&shoe.cpu_thread_lock, NULL);
     
     pthread_mutex_lock(&shoe.cpu_thread_lock);
     if(config->debug_mode == 0) {
-        pthread_create(&shoe.cpu_thread_pid, NULL, _cpu_thread, NULL);
+        pthread_create(&shoe.cpu_thread_pid, NULL, _cpu_thread, shoe_ctx);
     } else {
 #if SHOEBILL_DEBUG_CLI
-        pthread_create(&shoe.cpu_thread_pid, NULL, cpu_debugger_thread, NULL);
+        pthread_create(&shoe.cpu_thread_pid, NULL, cpu_debugger_thread, shoe_ctx);
 #endif
     }
     
@@ -780,7 +980,8 @@ fail:
         if (disks[i].f) fclose(disks[i].f);
     
     if (shoe.physical_rom_base) p_free(shoe.physical_rom_base);
-    if (shoe.physical_mem_base) p_free(shoe.physical_mem_base);
+    _free_ram();
+    if (shoe.coff) coff_release_kernel(shoe.coff);
     
     p_free_pool(shoe.pool);
     memset(&shoe, 0, sizeof(global_shoebill_context_t));
@@ -795,8 +996,7 @@ fail:
 void shoebill_restart (void)
 {
     coff_file *coff;
-    uint32_t pc, kernel_size;
-    uint8_t *kernel_data;
+    uint32_t pc;
     
     // block other threads from twiddling shoe.adb
     pthread_mutex_lock(&shoe.adb.lock);
@@ -804,7 +1004,7 @@ void shoebill_restart (void)
     // FIXME: block via thread from firing timers
     
     // zero memory
-    memset(shoe.physical_mem_base, 0, shoe.physical_mem_size);
+    zero_ram();
     
     // clear the pmmu cache
     memset(shoe.pmmu_cache, 0, sizeof(shoe.pmmu_cache));
@@ -840,27 +1040,19 @@ void shoebill_restart (void)
     // Reset all FPU registers
     fpu_reset();
     
-    // Free the old unix coff_file,
-    coff_free(shoe.coff);
+    // Release the old unix coff_file (it stays in the kernel cache)
+    coff_release_kernel(shoe.coff);
     
     // Close the disk at scsi id #0
     fclose(shoe.scsi_devices[0].f);
     
-    // Reload the kernel from that disk
-    kernel_data = shoebill_extract_kernel((char*)shoe.scsi_devices[0].image_path,
-                                          shoe.config_copy.aux_kernel_path,
-                                          shoe.config_copy.error_msg,
-                                          &kernel_size);
+    // Reload the kernel from that disk, or the cache if it hasn't changed
+    coff = coff_load_kernel((char*)shoe.scsi_devices[0].image_path,
+                            shoe.config_copy.aux_kernel_path,
+                            shoe.config_copy.error_msg);
     
     // FIXME: handle this more gracefully
-    assert(kernel_data && "can't reload the kernel from the root filesystem");
-    
-    // Re-parse the kernel binary
-    coff = coff_parse(kernel_data, kernel_size, shoe.pool);
-    free(kernel_data); // kernel_data was allocated with malloc()
-    
-    // FIXME: also handle this more gracefully
-    assert(coff && "can't parse the kernel");
+    assert(coff && "can't reload the kernel from the root filesystem");
     
     // Re-open the root disk image
     shoe.scsi_devices[0].f = fopen(shoe.scsi_devices[0].image_path, "r+b");
@@ -886,7 +1078,8 @@ void shoebill_restart (void)
     
     set_sr(0x2000);
     shoe.pc = pc;
-    shoe.cpu_thread_notifications = 0;
+    // a running trace (or recording) carries on through the reset
+    shoe.cpu_thread_notifications &= SHOEBILL_STATE_TRACE | SHOEBILL_STATE_REPLAY;
     
     pthread_mutex_unlock(&shoe.adb.lock);
 }
@@ -904,6 +1097,9 @@ void shoebill_key(uint8_t down, uint8_t key)
 {
     if (!shoe.running)
         return ;
+    // While recording, the CPU thread applies input between instructions (see replay.c)
+    if (replay_post(REPLAY_EV_KEY, down, key, 0, 0, NULL, 0))
+        return ;
     
     const uint8_t down_mask = down ? 0 : 0x80;
     assert(pthread_mutex_lock(&shoe.adb.lock) == 0);
@@ -918,6 +1114,8 @@ void shoebill_key_modifier(uint8_t modifier_mask)
 {
     if (!shoe.running)
         return ;
+    if (replay_post(REPLAY_EV_KEY_MODIFIER, modifier_mask, 0, 0, 0, NULL, 0))
+        return ;
     
     assert(pthread_mutex_lock(&shoe.adb.lock) == 0);
     
@@ -946,6 +1144,8 @@ void shoebill_mouse_move(int32_t x, int32_t y)
 {
     if (!shoe.running)
         return ;
+    if (replay_post(REPLAY_EV_MOUSE_MOVE, 0, 0, x, y, NULL, 0))
+        return ;
     
     assert(pthread_mutex_lock(&shoe.adb.lock) == 0);
     
@@ -968,6 +1168,8 @@ void shoebill_mouse_move_delta (int32_t x, int32_t y)
 {
     if (!shoe.running)
         return ;
+    if (replay_post(REPLAY_EV_MOUSE_DELTA, 0, 0, x, y, NULL, 0))
+        return ;
     
     assert(pthread_mutex_lock(&shoe.adb.lock) == 0);
     
@@ -984,6 +1186,8 @@ void shoebill_mouse_click(uint8_t down)
 {
     if (!shoe.running)
         return ;
+    if (replay_post(REPLAY_EV_MOUSE_CLICK, down, 0, 0, 0, NULL, 0))
+        return ;
     
     assert(pthread_mutex_lock(&shoe.adb.lock) == 0);
     
@@ -995,17 +1199,9 @@ void shoebill_mouse_click(uint8_t down)
     pthread_mutex_unlock(&shoe.adb.lock);
 }
 
+/* Kept for older front ends, VBLs come from via_clock_thread at each card's vbl_hz */
 void shoebill_send_vbl_interrupt(uint8_t slotnum)
 {
-    if (!shoe.running)
-        return ;
-    
-    assert((slotnum >= 9) && (slotnum <= 14) && shoe.slots[slotnum].connected);
-    
-    if (shoe.slots[slotnum].interrupts_enabled) {
-        shoe.via[1].rega_input &= ~b(00111111) & ~~(1 << (slotnum - 9));
-        via_raise_interrupt(2, IFR_CA1);
-    }
 }
 
 void shoebill_validate_or_zap_pram(uint8_t *pram, _Bool forcezap)
@@ -1024,11 +1220,9 @@ void shoebill_validate_or_zap_pram(uint8_t *pram, _Bool forcezap)
     pram[9] = 0x88;
 }
 
-void slog(const char *fmt, ...)
+void _slog(const char *fmt, ...)
 {
     va_list args;
- 
-    return ;
     
     va_start(args, fmt);
     vprintf(fmt, args);
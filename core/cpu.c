@@ -30,7 +30,33 @@
 #include "../core/shoebill.h"
 #include "../core/mc68851.h"
 
-global_shoebill_context_t shoe;
+static global_shoebill_context_t shoe_default;
+__thread global_shoebill_context_t *shoe_ctx = &shoe_default;
+
+shoebill_machine_t* shoebill_new_machine (void)
+{
+    return calloc(1, sizeof(global_shoebill_context_t));
+}
+
+void shoebill_set_machine (shoebill_machine_t *machine)
+{
+    shoe_ctx = machine ? machine : &shoe_default;
+}
+
+shoebill_machine_t* shoebill_current_machine (void)
+{
+    return shoe_ctx;
+}
+
+void shoebill_free_machine (shoebill_machine_t *machine)
+{
+    assert(machine != &shoe_default);
+    assert(!machine->running);
+    if (shoe_ctx == machine)
+        shoe_ctx = &shoe_default;
+    profile_free(machine->profiler);
+    free(machine);
+}
 
 /* Precomputed results for condition code tests */
 static const uint16_t cc_consts[16] = {
@@ -3263,6 +3289,8 @@ static void inst_trap (void) {
     const uint32_t vector_num = 32 + v;
     const uint32_t vector_offset = vector_num * 4;
     
+    note_exception(vector_num);
+    
     // trap_debug();
     
     set_sr_s(1);
@@ -3298,6 +3326,7 @@ void cpu_step()
     // remember the PC and SR (so we can throw exceptions later)
     shoe.orig_pc = shoe.pc;
     shoe.orig_sr = shoe.sr;
+    shoe.stats.instructions++;
     
     // Fetch the next instruction word
     shoe.op = pccache_nextword(shoe.pc);
@@ -3305,6 +3334,12 @@ void cpu_step()
     // If the fetch succeeded, execute it
     if slikely(!shoe.abort) {
         shoe.pc += 2;
+#if SHOEBILL_OP_HISTOGRAM
+        const uint8_t index = inst_opcode_map[shoe.op];
+        shoe.histogram.ops[shoe.op]++;
+        shoe.histogram.pairs[shoe.histogram.last_index][index]++;
+        shoe.histogram.last_index = index;
+#endif
         inst_instruction_to_pointer[inst_opcode_map[shoe.op]]();
     }
     
@@ -419,6 +419,14 @@ void write_decoder (const char *prefix, const char *path)
     }
     fprintf(f, "\t%s_%s\n};\n\n", prefix, ctx.inst[i].name);
     
+    /* --- write inst_num -> name table --- */
+    
+    fprintf(f, "const char *%s_instruction_names[%u] = {\n", prefix, ctx.num_instructions);
+    for (i=0; i<ctx.num_instructions-1; i++) {
+        fprintf(f, "\t\"%s\",\n", ctx.inst[i].name);
+    }
+    fprintf(f, "\t\"%s\"\n};\n\n", ctx.inst[i].name);
+    
     /* --- write opcode -> inst_num table --- */
     
     fprintf(f, "const uint8_t %s_opcode_map[0x10000] = {\n", prefix);
@@ -31,8 +31,8 @@
 #include "../core/shoebill.h"
 #include "../core/mc68851.h"
 
-struct dis_t dis;
-uint16_t dis_op;
+__thread struct dis_t dis;
+__thread uint16_t dis_op;
 
 //
 // Helper routines
@@ -193,6 +193,120 @@ static void _clear_nubus_interrupt(uint8_t slotnum)
 })
 
 
+/*
+ * Store a received packet (buf holds a 4 byte header's worth of space, then the
+ * packet) in the card's receive ring, and interrupt. If the ring is full, wait
+ * for the guest to make room, or drop the packet if we can't wait.
+ */
+static void _store_packet(shoebill_card_ethernet_t *ctx, uint8_t *buf, uint32_t received_bytes, _Bool can_wait)
+{
+    uint32_t i;
+    
+    pthread_mutex_lock(&ctx->lock);
+    
+    /*
+     * If the card isn't initialized yet, just drop the packet
+     */
+    if (ctx->cr & cr_stp) {
+        tp(TP_ETHERNET, TP_INFO, "ethernet: dropped packet, card is stopped");
+        __atomic_fetch_add(&shoe.stats.ethernet_drops, 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&ctx->lock);
+        return ;
+    }
+    
+    /*
+     * If the receive-register state is bogus, just drop the
+     * packet
+     */
+    if ((ctx->pstop <= ctx->pstart) ||
+        (ctx->curr < ctx->pstart) ||
+        (ctx->bnry < ctx->pstart) ||
+        (ctx->pstop > 0x40) ||
+        (ctx->pstart == 0)) {
+        // This shouldn't happen if the card is initialized
+        assert(!"ethernet: receive register state is bogus");
+        pthread_mutex_unlock(&ctx->lock);
+        return ;
+    }
+    
+    tp(TP_ETHERNET, TP_DEBUG, "ethernet: storing packet, req=%u free=%u", eth_recv_required_bufs(received_bytes), eth_recv_free_bufs());
+    
+    /*
+     * If there isn't enough buffer space to store the packet,
+     * block until ctx->bnry is modified.
+     */
+    const uint8_t required_bufs = eth_recv_required_bufs(received_bytes);
+    while (eth_recv_free_bufs() < required_bufs) {
+        pthread_mutex_unlock(&ctx->lock);
+        
+        if (ctx->teardown)
+            return ;
+        
+        // The CPU thread (storing a recorded packet) would be waiting on itself
+        if (!can_wait) {
+            tp(TP_ETHERNET, TP_INFO, "ethernet: dropped packet, receive ring is full");
+            __atomic_fetch_add(&shoe.stats.ethernet_drops, 1, __ATOMIC_RELAXED);
+            return ;
+        }
+        
+        printf("ethernet: sleeping\n");
+        usleep(50); // FIXME: use a cond variable here
+        pthread_mutex_lock(&ctx->lock);
+    }
+    
+    /* Roll around ctx->curr if necessary */
+    if (ctx->curr >= ctx->pstop)
+        ctx->curr = ctx->pstart;
+    
+    const uint8_t orig_curr = ctx->curr;
+    
+    /* Copy the packet to card RAM */
+    for (i = 0; i < required_bufs; i++) {
+        assert(ctx->curr != ctx->bnry); // this can't happen if we did our math right earlier
+        
+        uint8_t *ptr = &ctx->ram[ctx->curr * 256];
+        memcpy(ptr, &buf[i * 256], 256);
+        
+        ctx->curr++;
+        if (ctx->curr >= ctx->pstop)
+            ctx->curr = ctx->pstart;
+    }
+    assert(ctx->curr != ctx->bnry); // this can't happen if we did our math right earlier
+    
+    /* The packet was received intact */
+    ctx->rsr = rsr_prx;
+    
+    /* Fill in the 4 byte packet header */
+    ctx->ram[orig_curr * 256 + 0] = ctx->rsr;
+    ctx->ram[orig_curr * 256 + 1] = ctx->curr;
+    ctx->ram[orig_curr * 256 + 2] = received_bytes & 0xff; // low byte
+    ctx->ram[orig_curr * 256 + 3] = (received_bytes >> 8) & 0xff; // high byte
+    __atomic_fetch_add(&shoe.stats.ethernet_packets_in, 1, __ATOMIC_RELAXED);
+    
+    /* If the prx interrupt is enabled, interrupt */
+    if (ctx->imr & imr_pxre) {
+        ctx->isr |= isr_prx;
+        _nubus_interrupt(ctx->slotnum);
+    }
+    
+    tp(TP_ETHERNET, TP_DEBUG, "ethernet: stored packet, curr=%x", ctx->curr);
+    
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+/* Store a packet that was recorded by replay_post(), from the CPU thread */
+void nubus_ethernet_receive(uint8_t slotnum, const uint8_t *packet, uint16_t len)
+{
+    shoebill_card_ethernet_t *ctx = (shoebill_card_ethernet_t*)shoe.slots[slotnum].ctx;
+    uint8_t buf[4096];
+    
+    if ((shoe.slots[slotnum].card_type != card_shoebill_ethernet) || (len > 4092))
+        return ;
+    
+    memcpy(buf + 4, packet, len);
+    _store_packet(ctx, buf, len + 4, 0);
+}
+
 void *_ethernet_receiver_thread(void *arg)
 {
     const uint8_t multicast_addr[6] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
@@ -200,12 +314,13 @@ void *_ethernet_receiver_thread(void *arg)
     uint8_t *buf = (uint8_t *)malloc(4096);
     assert(buf);
     
+    shoe_ctx = ctx->machine;
+    
     // While nubus_ethernet_destroy() hasn't been called
     while (!ctx->teardown) {
         struct timeval tv;
         fd_set fdset;
         int ret;
-        uint32_t i;
         
         FD_ZERO(&fdset);
         FD_SET(ctx->tap_fd, &fdset);
@@ -225,29 +340,30 @@ void *_ethernet_receiver_thread(void *arg)
              */
             int actual_packet_length = read(ctx->tap_fd, buf + 4, 4092);
             
-            slog("ethernet: received packet bnry=%x curr=%x pstart=%x pstop=%x cr=%x ret=%d frame=0x%02x%02x\n",
-                 ctx->bnry, ctx->curr, ctx->pstart, ctx->pstop, ctx->cr, actual_packet_length,
-                 buf[0x10], buf[0x11]);
+            tp(TP_ETHERNET, TP_DEBUG, "ethernet: received packet len=%d bnry=%x curr=%x pstart=%x pstop=%x",
+               actual_packet_length, ctx->bnry, ctx->curr, ctx->pstart, ctx->pstop);
             
             /*
              * If it's a bogus packet length, reject it
              * (what's the actual minimum allowable packet length?)
              */
             if (actual_packet_length <= 12) {
-                slog("ethernet: too small len\n");
+                tp(TP_ETHERNET, TP_INFO, "ethernet: dropped packet, len=%d is too small", actual_packet_length);
+                __atomic_fetch_add(&shoe.stats.ethernet_drops, 1, __ATOMIC_RELAXED);
                 continue;
             }
             
             /* I'm sure A/UX can't handle > 2kb packets */
             if (actual_packet_length > 2048) {
-                slog("ethernet: too high len\n");
+                tp(TP_ETHERNET, TP_INFO, "ethernet: dropped packet, len=%d is too big", actual_packet_length);
+                __atomic_fetch_add(&shoe.stats.ethernet_drops, 1, __ATOMIC_RELAXED);
                 continue;
             }
             
             /* If it's neither multicast nor addressed to us, reject it */
             if ((memcmp(buf + 4, ctx->ethernet_addr, 6) != 0) &&
                 (memcmp(buf + 4, multicast_addr, 6) != 0)) {
-                slog("ethernet: bad address\n");
+                tp(TP_ETHERNET, TP_DEBUG, "ethernet: ignored packet for another address");
                 continue;
             }
             
@@ -255,95 +371,15 @@ void *_ethernet_receiver_thread(void *arg)
             if (actual_packet_length < 60)
                 actual_packet_length = 60;
             
-            /* The number of bytes to write + the 4 byte header */
-            const uint32_t received_bytes = actual_packet_length + 4;
-            
-            pthread_mutex_lock(&ctx->lock);
-            
-            /*
-             * If the card isn't initialized yet, just drop the packet
-             */
-            if (ctx->cr & cr_stp) {
-                slog("ethernet: uninit\n");
-                pthread_mutex_unlock(&ctx->lock);
-                continue;
-            }
-            
-            /*
-             * If the receive-register state is bogus, just drop the
-             * packet
-             */
-            if ((ctx->pstop <= ctx->pstart) ||
-                (ctx->curr < ctx->pstart) ||
-                (ctx->bnry < ctx->pstart) ||
-                (ctx->pstop > 0x40) ||
-                (ctx->pstart == 0)) {
-                // This shouldn't happen if the card is initialized
-                assert(!"ethernet: receive register state is bogus");
-                pthread_mutex_unlock(&ctx->lock);
+            /* While recording, the CPU thread stores the packet (and while replaying, the log does) */
+            if (replay_post(REPLAY_EV_ETHERNET_RX, ctx->slotnum, 0, 0, 0, buf + 4, actual_packet_length))
                 continue;
-            }
-            
-            slog("ethernet: success, req=%u free=%u\n", eth_recv_required_bufs(received_bytes), eth_recv_free_bufs());
-            
-            /*
-             * If there isn't enough buffer space to store the packet,
-             * block until ctx->bnry is modified.
-             */
-            const uint8_t required_bufs = eth_recv_required_bufs(received_bytes);
-            while (eth_recv_free_bufs() < required_bufs) {
-                pthread_mutex_unlock(&ctx->lock);
-                
-                if (ctx->teardown)
-                    goto bail;
-                
-                printf("ethernet: sleeping\n");
-                usleep(50); // FIXME: use a cond variable here
-                pthread_mutex_lock(&ctx->lock);
-            }
-            
-            /* Roll around ctx->curr if necessary */
-            if (ctx->curr >= ctx->pstop)
-                ctx->curr = ctx->pstart;
-            
-            const uint8_t orig_curr = ctx->curr;
-            
-            /* Copy the packet to card RAM */
-            for (i = 0; i < required_bufs; i++) {
-                assert(ctx->curr != ctx->bnry); // this can't happen if we did our math right earlier
-                
-                uint8_t *ptr = &ctx->ram[ctx->curr * 256];
-                memcpy(ptr, &buf[i * 256], 256);
-                
-                ctx->curr++;
-                if (ctx->curr >= ctx->pstop)
-                    ctx->curr = ctx->pstart;
-            }
-            assert(ctx->curr != ctx->bnry); // this can't happen if we did our math right earlier
-            
-            /* The packet was received intact */
-            ctx->rsr = rsr_prx;
             
-            /* Fill in the 4 byte packet header */
-            ctx->ram[orig_curr * 256 + 0] = ctx->rsr;
-            ctx->ram[orig_curr * 256 + 1] = ctx->curr;
-            ctx->ram[orig_curr * 256 + 2] = received_bytes & 0xff; // low byte
-            ctx->ram[orig_curr * 256 + 3] = (received_bytes >> 8) & 0xff; // high byte
-            
-            /* If the prx interrupt is enabled, interrupt */
-            if (ctx->imr & imr_pxre) {
-                ctx->isr |= isr_prx;
-                _nubus_interrupt(ctx->slotnum);
-            }
-            
-            slog("ethernet: received packet (len=%d)\n", ret);
-            
-            pthread_mutex_unlock(&ctx->lock);
+            /* The number of bytes to write + the 4 byte header */
+            _store_packet(ctx, buf, actual_packet_length + 4, 1);
         }
     }
    
-bail:
-    
     free(buf);
     
     return NULL;
@@ -393,9 +429,34 @@ void _test_write_packet(shoebill_card_ethernet_t *ctx)
 }
 */
 
+/* Tell the guest that the packet it asked to send has gone out */
+void nubus_ethernet_sent(uint8_t slotnum)
+{
+    shoebill_card_ethernet_t *ctx = (shoebill_card_ethernet_t*)shoe.slots[slotnum].ctx;
+    
+    if (shoe.slots[slotnum].card_type != card_shoebill_ethernet)
+        return ;
+    
+    // Lock the ethernet context (we're going to manipulate the ethernet registers)
+    pthread_mutex_lock(&ctx->lock);
+    
+    // indicate that the packet has been sent
+    ctx->cr &= ~cr_txp; // clear the command register txp bit
+    ctx->isr |= isr_ptx; // interrupt status: packet transmitted with no errors
+    
+    // the "packet transmitted" interrupt really should be enabled
+    if (ctx->imr & imr_ptxe) {
+        _nubus_interrupt(ctx->slotnum);
+        tp(TP_ETHERNET, TP_DEBUG, "ethernet: sent packet, interrupting slot %u", ctx->slotnum);
+    }
+    
+    assert(pthread_mutex_unlock(&ctx->lock) == 0);
+}
+
 void *_ethernet_sender_thread(void *arg)
 {
     shoebill_card_ethernet_t *ctx = (shoebill_card_ethernet_t*)arg;
+    shoe_ctx = ctx->machine;
     
     slog("ethernet: ethernet_sender_thread starts...\n");
     
@@ -427,33 +488,29 @@ void *_ethernet_sender_thread(void *arg)
         if (!ctx->send_ready)
             continue;
         
-        slog("ethernet: sender thread wakes up...\n");
+        tp(TP_ETHERNET, TP_DEBUG, "ethernet: sending packet len=%u", ctx->tbcr);
         
         ctx->send_ready = 0;
         
+        // A replayed guest's packets don't go out, and the log says when they finished
+        if (replay_replaying())
+            continue;
+        
         // --- Send the packet here ---
         assert(ctx->tbcr <= 2048); // sanity check the packet len
         assert(ctx->tbcr >= 42);
         
         ret = write(ctx->tap_fd, ctx->ram, ctx->tbcr);
         if (ret != ctx->tbcr) {
-            slog("ethernet: write() returned %d, not %d errno=%d\n", ret, ctx->tbcr, errno);
-        }
-        
-        // Lock the ethernet context (we're going to manipulate the ethernet registers)
-        pthread_mutex_lock(&ctx->lock);
-        
-        // indicate that the packet has been sent
-        ctx->cr &= ~cr_txp; // clear the command register txp bit
-        ctx->isr |= isr_ptx; // interrupt status: packet transmitted with no errors
-        
-        // the "packet transmitted" interrupt really should be enabled
-        if (ctx->imr & imr_ptxe) {
-            _nubus_interrupt(ctx->slotnum);
-            slog("ethernet: sender: sending interrupt to slot %u\n", ctx->slotnum);
+            tp(TP_ETHERNET, TP_ERROR, "ethernet: write() returned %d, not %d errno=%d", ret, ctx->tbcr, errno);
+            __atomic_fetch_add(&shoe.stats.ethernet_drops, 1, __ATOMIC_RELAXED);
         }
+        else
+            shoe.stats.ethernet_packets_out++;
         
-        assert(pthread_mutex_unlock(&ctx->lock) == 0);
+        // While recording, the CPU thread finishes the send (see replay.c)
+        if (!replay_post(REPLAY_EV_ETHERNET_TX, ctx->slotnum, 0, 0, 0, NULL, 0))
+            nubus_ethernet_sent(ctx->slotnum);
     }
     
     return NULL;
@@ -471,6 +528,7 @@ void nubus_ethernet_init(void *_ctx, uint8_t slotnum, uint8_t ethernet_addr[6],
     ctx->rom[7] = 0x00;
     
     ctx->slotnum = slotnum; // so the threads know which slot this is
+    ctx->machine = shoe_ctx; // ... and which machine
     
     pthread_mutex_init(&ctx->lock, NULL);
     pthread_cond_init(&ctx->sender_cond, NULL);
@@ -58,6 +58,8 @@ void throw_long_bus_error(uint32_t addr, uint8_t is_write)
     const uint32_t vector_num = 2;
     const uint32_t vector_offset = vector_num * 4;
     
+    note_exception(vector_num);
+    
     // fetch vector handler address
     const uint32_t vector_addr = lget(shoe.vbr + vector_offset, 4);
     //slog("throw_long_bus_error(): shoe.vbr=0x%08x, vector_addr=0x%08x, offending addr=0x%08x, shoe.op=0x%04x\n", shoe.vbr, vector_addr, addr, shoe.op);
@@ -133,6 +135,8 @@ void throw_bus_error(uint32_t addr, uint8_t is_write)
     const uint32_t vector_num = 2;
     const uint32_t vector_offset = vector_num * 4;
     
+    note_exception(vector_num);
+    
     // fetch vector handler address
     const uint32_t vector_addr = lget(shoe.vbr + vector_offset, 4);
     //slog("throw_bus_error(): shoe.vbr=0x%08x, vector_addr=0x%08x, offending addr=0x%08x, shoe.op=0x%04x, a7=0x%08x", shoe.vbr, vector_addr, addr, shoe.op, shoe.a[7]);
@@ -174,6 +178,8 @@ void throw_address_error()
 
 void throw_frame_zero(uint16_t sr, uint32_t pc, uint16_t vector_num)
 {
+    note_exception(vector_num);
+    
     // set supervisor bit
     set_sr_s(1);
     
@@ -195,6 +201,8 @@ void throw_frame_zero(uint16_t sr, uint32_t pc, uint16_t vector_num)
 
 void throw_frame_two (uint16_t sr, uint32_t next_pc, uint32_t vector_num, uint32_t orig_pc)
 {
+    note_exception(vector_num);
+    
     set_sr_s(1);
     
     // inhibit tracing
@@ -228,6 +236,9 @@ void throw_illegal_instruction()
         ((shoe.op>>12) == 0xa) ? 10 :
         (((shoe.op>>12) == 0xf) ? 11 : 4);
     
+    if (vector_num == 10)
+        shoe.last_atrap = shoe.op;
+    
     throw_frame_zero(shoe.orig_sr, shoe.orig_pc, vector_num);
     
     /*if ((shoe.op >> 12) == 0xa) {
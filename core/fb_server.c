@@ -0,0 +1,443 @@
+/*
+ * Copyright (c) 2014, Peter Rutenbar <pruten@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * A tiny framebuffer server, so a remote viewer only gets the tiles that
+ * changed instead of whole frames. One client at a time, over a unix socket
+ * or a loopback-only TCP port. All integers are big-endian.
+ *
+ * Server -> client
+ *   hello:  "SHFB" u16 version(1) u16 width u16 height
+ *   update: u8 type(1) u16 tile_count, then per tile:
+ *           u16 x, y, w, h  u8 encoding  u32 len  <len bytes>
+ *           encoding 0 = raw RGB triplets, row-major
+ *                    1 = RLE: (u8 run_length-1, r, g, b)...
+ *                    2 = zlib'd raw RGB triplets
+ *
+ * Client -> server (always 6 bytes)
+ *   [1] [down] [adb keycode] [modifier mask] [0] [0]   key (see modShift etc.)
+ *   [2] [x hi] [x lo] [y hi] [y lo] [0]                 absolute mouse position
+ *   [3] [down] [0] [0] [0] [0]                          mouse button
+ *   [4] [0] [0] [0] [0] [0]                             resend the whole screen
+ *
+ * Tiles are found by diffing the translated frame against a shadow copy of
+ * what the client already has. video.c's dirty map already keeps the CLUT
+ * translation down to what the guest touched; the diff just keeps the wire
+ * traffic down to what actually changed on screen.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <zlib.h>
+#include "shoebill.h"
+
+#define FB_TILE 64
+#define FB_TILE_HEADER 13
+#define FB_CLIENT_MSG 6
+
+typedef struct {
+    shoebill_machine_t *machine;
+    pthread_t threadid;
+    uint8_t slotnum;
+    int listen_fd;
+    uint32_t frame_ms;
+
+    uint16_t width, height;
+    uint8_t *shadow; // RGBA, what the client currently has on screen
+    uint8_t *msg; // outgoing update message
+    uint8_t *tile, *rle; // scratch space for one tile
+    uint32_t msg_size;
+} fb_server_t;
+
+// Each server has its own thread, which finds its state here
+static __thread fb_server_t *fbs;
+
+static uint64_t _now_ms (void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return ((uint64_t)tv.tv_sec * 1000) + (tv.tv_usec / 1000);
+}
+
+static void _put16 (uint8_t *p, uint16_t v)
+{
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+static void _put32 (uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static _Bool _write_all (int fd, const uint8_t *buf, uint32_t len)
+{
+#ifdef MSG_NOSIGNAL
+    const int flags = MSG_NOSIGNAL;
+#else
+    const int flags = 0; // SO_NOSIGPIPE is set on the socket instead
+#endif
+    while (len > 0) {
+        const ssize_t ret = send(fd, buf, len, flags);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return 0;
+        }
+        buf += ret;
+        len -= ret;
+    }
+    return 1;
+}
+
+/* RLE-encode an RGB tile. Returns 0 if it doesn't come out smaller than raw */
+static uint32_t _rle_tile (const uint8_t *rgb, uint32_t pixels, uint8_t *out)
+{
+    const uint32_t raw_len = pixels * 3;
+    uint32_t i = 0, len = 0;
+
+    while (i < pixels) {
+        uint32_t run = 1;
+        while ((i + run < pixels) && (run < 256) &&
+               (memcmp(&rgb[i*3], &rgb[(i+run)*3], 3) == 0))
+            run++;
+
+        if (len + 4 >= raw_len)
+            return 0;
+
+        out[len++] = run - 1;
+        out[len++] = rgb[i*3 + 0];
+        out[len++] = rgb[i*3 + 1];
+        out[len++] = rgb[i*3 + 2];
+        i += run;
+    }
+    return len;
+}
+
+/* Append one tile (already known to be dirty) to fbs->msg at *pos */
+static void _encode_tile (const uint8_t *frame, uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint32_t *pos)
+{
+    const uint32_t pixels = w * h;
+    const uint32_t raw_len = pixels * 3;
+    uint8_t *header = &fbs->msg[*pos];
+    uint8_t *payload = header + FB_TILE_HEADER;
+    uint32_t row, col, len;
+    uint8_t encoding;
+
+    for (row=0; row<h; row++) {
+        const uint8_t *src = &frame[((y + row) * fbs->width + x) * 4];
+        uint8_t *dst = &fbs->tile[row * w * 3];
+        for (col=0; col<w; col++) {
+            dst[col*3 + 0] = src[col*4 + 0];
+            dst[col*3 + 1] = src[col*4 + 1];
+            dst[col*3 + 2] = src[col*4 + 2];
+        }
+    }
+
+    /*
+     * Most of the A/UX desktop is flat fills, which RLE handles for much
+     * less CPU than zlib. Only fall back to zlib when RLE doesn't get at
+     * least 4:1, and to raw when neither one helps.
+     */
+    len = _rle_tile(fbs->tile, pixels, fbs->rle);
+    if (len && (len <= raw_len / 4)) {
+        encoding = 1;
+        memcpy(payload, fbs->rle, len);
+    }
+    else {
+        uLongf zlen = compressBound(raw_len);
+        if ((compress2(payload, &zlen, fbs->tile, raw_len, 1) == Z_OK) && (zlen < raw_len)) {
+            encoding = 2;
+            len = zlen;
+        }
+        else {
+            encoding = 0;
+            len = raw_len;
+            memcpy(payload, fbs->tile, raw_len);
+        }
+    }
+
+    _put16(&header[0], x);
+    _put16(&header[2], y);
+    _put16(&header[4], w);
+    _put16(&header[6], h);
+    header[8] = encoding;
+    _put32(&header[9], len);
+
+    *pos += FB_TILE_HEADER + len;
+}
+
+/* Send every tile that differs from the shadow frame (or all of them, if force) */
+static _Bool _send_update (int fd, _Bool force)
+{
+    shoebill_video_frame_info_t frame = shoebill_get_video_frame(fbs->slotnum, 0);
+    uint32_t pos = 3, count = 0;
+    uint16_t x, y, row;
+
+    if ((frame.buf == NULL) || (frame.width != fbs->width) || (frame.height != fbs->height))
+        return 1;
+
+    for (y=0; y<fbs->height; y+=FB_TILE) {
+        const uint16_t h = ((fbs->height - y) < FB_TILE) ? (fbs->height - y) : FB_TILE;
+        for (x=0; x<fbs->width; x+=FB_TILE) {
+            const uint16_t w = ((fbs->width - x) < FB_TILE) ? (fbs->width - x) : FB_TILE;
+            _Bool changed = force;
+
+            for (row=0; row<h; row++) {
+                const uint32_t off = ((y + row) * fbs->width + x) * 4;
+                if (memcmp(&frame.buf[off], &fbs->shadow[off], w * 4) != 0) {
+                    memcpy(&fbs->shadow[off], &frame.buf[off], w * 4);
+                    changed = 1;
+                }
+            }
+
+            if (!changed)
+                continue;
+
+            // Encode from the shadow, since the guest may be scribbling on frame.buf right now
+            _encode_tile(fbs->shadow, x, y, w, h, &pos);
+            count++;
+        }
+    }
+
+    if (count == 0)
+        return 1;
+
+    fbs->msg[0] = 1;
+    _put16(&fbs->msg[1], count);
+    return _write_all(fd, fbs->msg, pos);
+}
+
+static void _handle_client_msg (const uint8_t *msg, _Bool *force)
+{
+    switch (msg[0]) {
+        case 1:
+            shoebill_key_modifier(msg[3]);
+            shoebill_key(msg[1], msg[2]);
+            break;
+        case 2:
+            shoebill_mouse_move((msg[1] << 8) | msg[2], (msg[3] << 8) | msg[4]);
+            break;
+        case 3:
+            shoebill_mouse_click(msg[1]);
+            break;
+        case 4:
+            *force = 1;
+            break;
+        default:
+            slog("fb_server: unknown client message %u\n", msg[0]);
+    }
+}
+
+static void _serve_client (int fd)
+{
+    uint8_t hello[10];
+    uint8_t in[FB_CLIENT_MSG];
+    uint32_t in_len = 0;
+    uint64_t last_update = 0;
+    _Bool force = 1;
+
+#ifdef SO_NOSIGPIPE
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+
+    memcpy(hello, "SHFB", 4);
+    _put16(&hello[4], 1);
+    _put16(&hello[6], fbs->width);
+    _put16(&hello[8], fbs->height);
+    if (!_write_all(fd, hello, sizeof(hello)))
+        return ;
+
+    while (1) {
+        const uint64_t now = _now_ms();
+        struct pollfd pfd = {.fd = fd, .events = POLLIN};
+        int timeout = 0;
+
+        if ((now - last_update) >= fbs->frame_ms) {
+            if (!_send_update(fd, force))
+                return ;
+            force = 0;
+            last_update = now;
+        }
+        else
+            timeout = fbs->frame_ms - (now - last_update);
+
+        if (poll(&pfd, 1, timeout) < 0) {
+            if (errno == EINTR)
+                continue;
+            return ;
+        }
+
+        if (!(pfd.revents & (POLLIN | POLLHUP | POLLERR)))
+            continue;
+
+        const ssize_t ret = recv(fd, &in[in_len], FB_CLIENT_MSG - in_len, 0);
+        if (ret == 0)
+            return ;
+        else if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return ;
+        }
+
+        in_len += ret;
+        if (in_len == FB_CLIENT_MSG) {
+            _handle_client_msg(in, &force);
+            in_len = 0;
+        }
+    }
+}
+
+static void* _fb_server_thread (void *arg)
+{
+    fbs = arg;
+    shoe_ctx = fbs->machine;
+    
+    while (1) {
+        const int fd = accept(fbs->listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR)
+                continue;
+            slog("fb_server: accept() failed errno=%d\n", errno);
+            return NULL;
+        }
+
+        slog("fb_server: client connected\n");
+        memset(fbs->shadow, 0, fbs->width * fbs->height * 4);
+        _serve_client(fd);
+        close(fd);
+        slog("fb_server: client disconnected\n");
+    }
+    return NULL;
+}
+
+static int _listen (const char *address)
+{
+    int fd = -1;
+
+    if (strncmp(address, "unix:", 5) == 0) {
+        struct sockaddr_un sun;
+        const char *path = address + 5;
+
+        if (strlen(path) >= sizeof(sun.sun_path))
+            return -1;
+
+        memset(&sun, 0, sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        strcpy(sun.sun_path, path);
+        unlink(path);
+
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if ((fd < 0) || (bind(fd, (struct sockaddr*)&sun, sizeof(sun)) != 0))
+            goto fail;
+    }
+    else if (strncmp(address, "tcp:", 4) == 0) {
+        struct sockaddr_in sin;
+        int one = 1;
+
+        memset(&sin, 0, sizeof(sin));
+        sin.sin_family = AF_INET;
+        sin.sin_port = htons(strtoul(address + 4, NULL, 10));
+        sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK); // loopback only, there's no authentication
+
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0)
+            goto fail;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(fd, (struct sockaddr*)&sin, sizeof(sin)) != 0)
+            goto fail;
+    }
+    else
+        return -1;
+
+    if (listen(fd, 1) != 0)
+        goto fail;
+
+    return fd;
+
+fail:
+    if (fd >= 0)
+        close(fd);
+    return -1;
+}
+
+/*
+ * Start serving the frames of the video card in slotnum at (at most) fps
+ * frames per second. address is "unix:<path>" or "tcp:<port>".
+ * Call after shoebill_start(), once the video card is installed.
+ */
+uint32_t shoebill_start_fb_server(uint8_t slotnum, const char *address, uint32_t fps)
+{
+    shoebill_video_frame_info_t frame = shoebill_get_video_frame(slotnum, 1);
+    uint32_t tiles;
+    fb_server_t *fbs;
+
+    if ((frame.width == 0) || (frame.height == 0)) {
+        slog("fb_server: no video card in slot %u\n", slotnum);
+        return 0;
+    }
+
+    fbs = calloc(1, sizeof(fb_server_t));
+    fbs->listen_fd = _listen(address);
+    if (fbs->listen_fd < 0) {
+        slog("fb_server: can't listen on %s (errno=%d)\n", address, errno);
+        free(fbs);
+        return 0;
+    }
+    
+    fbs->machine = shoebill_current_machine();
+
+    fbs->slotnum = slotnum;
+    fbs->frame_ms = 1000 / (fps ? fps : 30);
+    fbs->width = frame.width;
+    fbs->height = frame.height;
+
+    // Worst case, every tile is sent raw (compressBound() slop included)
+    tiles = ((fbs->width + FB_TILE - 1) / FB_TILE) * ((fbs->height + FB_TILE - 1) / FB_TILE);
+    fbs->msg_size = 3 + tiles * (FB_TILE_HEADER + compressBound(FB_TILE * FB_TILE * 3));
+
+    fbs->shadow = calloc(fbs->width * fbs->height, 4);
+    fbs->msg = malloc(fbs->msg_size);
+    fbs->tile = malloc(FB_TILE * FB_TILE * 3);
+    fbs->rle = malloc(FB_TILE * FB_TILE * 3);
+
+    pthread_create(&fbs->threadid, NULL, _fb_server_thread, fbs);
+    return 1;
+}
@@ -28,6 +28,9 @@
 #include <stdint.h>
 #include <assert.h>
 #include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include "../core/shoebill.h"
 
 /* --- Disk/partition management stuff --- */
@@ -113,6 +116,8 @@ typedef struct _disk_t {
     // -- "private" --
     alloc_pool_t *pool;
     FILE *f;
+    uint8_t *map; // The whole image, if we could mmap it (else we fall back to reading f)
+    uint64_t size;
     uint32_t block_size;
     
     driver_descriptor_record_t ddr;
@@ -122,24 +127,63 @@ typedef struct _disk_t {
     partition_t *partitions;
 } disk_t;
 
-static void disk_get_block (disk_t *disk, uint8_t buf[512], uint32_t blockno)
+/*
+ * Read len bytes at offset from the disk image. Mapped images are just a memcpy
+ * (the kernel's page cache is our block cache); otherwise it's one fread per extent.
+ */
+static uint8_t disk_read (disk_t *disk, void *buf, uint64_t offset, uint64_t len)
 {
-    const uint32_t block_size = disk->block_size;
-    assert(0 == fseeko(disk->f, block_size * blockno, SEEK_SET));
-    assert(fread(buf, block_size, 1, disk->f) == 1);
+    if ((offset > disk->size) || (len > (disk->size - offset))) {
+        sprintf(disk->error_str, "read past the end of the disk (offset=0x%llx len=0x%llx)",
+                (unsigned long long)offset, (unsigned long long)len);
+        return 0;
+    }
+    
+    if (disk->map) {
+        memcpy(buf, disk->map + offset, len);
+        return 1;
+    }
+    
+    if ((fseeko(disk->f, offset, SEEK_SET) != 0) || (fread(buf, len, 1, disk->f) != 1)) {
+        sprintf(disk->error_str, "couldn't read the disk (offset=0x%llx len=0x%llx)",
+                (unsigned long long)offset, (unsigned long long)len);
+        return 0;
+    }
+    return 1;
 }
 
-static void part_get_block(partition_t *part, uint8_t buf[512], uint32_t blockno)
+static uint8_t disk_get_block (disk_t *disk, uint8_t buf[512], uint32_t blockno)
 {
-    assert(blockno < part->num_blocks);
-    disk_get_block(part->disk, buf, part->start_block + blockno);
+    return disk_read(disk, buf, (uint64_t)disk->block_size * blockno, disk->block_size);
+}
+
+/* Read len bytes at byte offset into the partition */
+static uint8_t part_read (partition_t *part, void *buf, uint64_t offset, uint64_t len)
+{
+    const uint64_t part_size = (uint64_t)part->num_blocks * part->disk->block_size;
+    
+    if ((offset > part_size) || (len > (part_size - offset))) {
+        sprintf(part->error_str, "read past the end of the partition (offset=0x%llx len=0x%llx)",
+                (unsigned long long)offset, (unsigned long long)len);
+        return 0;
+    }
+    
+    return disk_read(part->disk, buf, ((uint64_t)part->start_block * part->disk->block_size) + offset, len);
+}
+
+/* Read count consecutive blocks from the partition */
+static uint8_t part_get_blocks (partition_t *part, uint8_t *buf, uint32_t blockno, uint32_t count)
+{
+    const uint32_t block_size = part->disk->block_size;
+    return part_read(part, buf, (uint64_t)blockno * block_size, (uint64_t)count * block_size);
 }
 
 static uint8_t disk_load_partition_map(disk_t *disk, apple_partition_map_t *apm, uint32_t idx)
 {
     uint8_t block[512];
     
-    disk_get_block(disk, block, 1 + idx);
+    if (!disk_get_block(disk, block, 1 + idx))
+        return 0;
     memcpy(apm, block, sizeof(apple_partition_map_t));
     
     fix_endian(apm->pmSigPad);
@@ -177,6 +221,8 @@ static uint8_t disk_load_partition_map(disk_t *disk, apple_partition_map_t *apm,
 
 static void close_disk(disk_t *disk)
 {
+    if (disk->map)
+        munmap(disk->map, disk->size);
     fclose(disk->f);
     p_free_pool(disk->pool);
 }
@@ -189,6 +235,7 @@ static disk_t* open_disk (const char *disk_path, char *error_str)
     uint32_t i;
     alloc_pool_t *pool = p_new_pool(NULL);
     FILE *f;
+    struct stat st;
     
     disk = p_calloc(pool, disk_t, 1);
     
@@ -205,9 +252,24 @@ static disk_t* open_disk (const char *disk_path, char *error_str)
     
     disk->f = f;
     
+    if ((fseeko(f, 0, SEEK_END) != 0) || (ftello(f) < 0)) {
+        sprintf(error_str, "Can't determine the size of that disk");
+        goto fail;
+    }
+    disk->size = ftello(f);
+    
+    // Map regular files whole. Block devices and the like go through stdio.
+    if ((fstat(fileno(f), &st) == 0) && S_ISREG(st.st_mode) && (disk->size > 0) &&
+        ((uint64_t)(size_t)disk->size == disk->size)) {
+        void *map = mmap(NULL, disk->size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+        if (map != MAP_FAILED)
+            disk->map = map;
+    }
+    
     // Load the driver descriptor record
     
-    disk_get_block(disk, block, 0);
+    if (!disk_get_block(disk, block, 0))
+        goto fail;
     memcpy(&disk->ddr, block, sizeof(disk->ddr));
     
     fix_endian(disk->ddr.sbBlkSize);
@@ -266,6 +328,7 @@ static disk_t* open_disk (const char *disk_path, char *error_str)
     return disk;
     
 fail:
+    if (disk->map) munmap(disk->map, disk->size);
     if (f) fclose(f);
     p_free_pool(pool);
     return NULL;
@@ -401,19 +464,15 @@ typedef struct {
     
 } svfs_t;
 
+/* Read len bytes starting at block blockno */
+static uint8_t svfs_read_data(svfs_t *mount, uint8_t *buf, uint32_t blockno, uint64_t len)
+{
+    return part_read(mount->part, buf, (uint64_t)blockno * mount->blocksize, len);
+}
+
 static uint8_t svfs_read_block(svfs_t *mount, uint8_t *block, uint32_t blockno)
 {
-    const uint32_t sectors_per_block = mount->blocksize / 512;
-    const uint32_t start_sector = blockno * sectors_per_block;
-    uint32_t i;
-    
-    // slog("sectors_per_block = %u, start_sector=%u\n", sectors_per_block, start_sector);
-    
-    for (i=0; i<sectors_per_block; i++) {
-        part_get_block(mount->part, &block[i * 512], start_sector+i);
-    }
-    
-    return 1;
+    return svfs_read_data(mount, block, blockno, mount->blocksize);
 }
 
 static uint8_t svfs_load_inode(svfs_t *mount, svfs_inode_t *inode, uint32_t inum)
@@ -473,16 +532,19 @@ static uint8_t svfs_read_level(svfs_t *mount,
         
         const uint32_t addr = ntohl(indirects[i]);
         
-        if (!svfs_read_block(mount, tmp, addr)) {
-            sprintf(mount->error_str, "couldn't read svfs block num %u at L%u", addr, level);
-            goto fail;
-        }
-        
         if (level == 1) {
-            memcpy(buf + *len, tmp, chunk_size);
+            // Data blocks get read straight into place
+            if (!svfs_read_data(mount, buf + *len, addr, chunk_size)) {
+                sprintf(mount->error_str, "couldn't read svfs block num %u at L%u", addr, level);
+                goto fail;
+            }
             *len += chunk_size;
         }
         else {
+            if (!svfs_read_block(mount, tmp, addr)) {
+                sprintf(mount->error_str, "couldn't read svfs block num %u at L%u", addr, level);
+                goto fail;
+            }
             if (!svfs_read_level(mount, inode, buf, len, (uint32_t*)tmp, level-1))
                 goto fail;
         }
@@ -510,12 +572,11 @@ static uint8_t* svfs_read_inode_data(svfs_t *mount, svfs_inode_t *inode)
         if (chunk_size > mount->blocksize)
             chunk_size = mount->blocksize;
         
-        if (!svfs_read_block(mount, tmp, inode->addr[i])) {
+        if (!svfs_read_data(mount, buf + len, inode->addr[i], chunk_size)) {
             sprintf(mount->error_str, "couldn't read svfs block num %u at L0", inode->addr[i]);
             goto fail;
         }
         
-        memcpy(buf + len, tmp, chunk_size);
         len += chunk_size;
     }
     
@@ -560,7 +621,8 @@ static svfs_t* svfs_mount(partition_t *part)
     mount->error_str = part->error_str;
     mount->part = part;
     
-    part_get_block(part, (uint8_t*)&mount->superblock, 1);
+    if (!part_get_blocks(part, (uint8_t*)&mount->superblock, 1, 1))
+        goto fail;
     
     fix_endian(mount->superblock.isize);
     fix_endian(mount->superblock.fsize);
@@ -799,23 +861,19 @@ typedef struct __attribute__ ((__packed__)) {
     ((mount)->superblock.cgoffset * \
      ((num) & ~(mount)->superblock.cgmask)))
 
+/* Read len bytes starting at fragment fragno */
+static uint8_t ufs_read_data(ufs_t *mount, uint8_t *buf, uint32_t fragno, uint64_t len)
+{
+    return part_read(mount->part, buf, (uint64_t)fragno * mount->frag_size, len);
+}
+
 static uint8_t ufs_read_frag(ufs_t *mount, uint8_t *frag, uint32_t fragno)
 {
-    const uint32_t sectors_per_frag = mount->frag_size / 512;
-    const uint32_t start_sector = fragno * sectors_per_frag;
-    uint32_t i;
-    
-    for (i=0; i<sectors_per_frag; i++) {
-        part_get_block(mount->part, &frag[i * 512], start_sector+i);
-    }
-    
-    return 1;
+    return ufs_read_data(mount, frag, fragno, mount->frag_size);
 }
 
 static uint8_t ufs_read_block(ufs_t *mount, uint8_t *block, uint32_t blockno)
 {
-    uint32_t i;
-    
     /* 
      * block numbers and fragment numbers are identical - they both refer
      * to fragment numbers. But if we're reading a "block", then we're reading
@@ -824,11 +882,7 @@ static uint8_t ufs_read_block(ufs_t *mount, uint8_t *block, uint32_t blockno)
     
     assert((blockno % mount->frag_per_block) == 0); // This had better align to a block boundary
     
-    for (i=0; i<mount->frag_per_block; i++) {
-        if (!ufs_read_frag(mount, block + i * mount->frag_size, blockno + i))
-            return 0;
-    }
-    return 1;
+    return ufs_read_data(mount, block, blockno, mount->block_size);
 }
 
 static uint8_t ufs_load_cylinder_group(ufs_t *mount, uint32_t frag_offset, ufs_cylinder_group_t *group)
@@ -839,8 +893,8 @@ static uint8_t ufs_load_cylinder_group(ufs_t *mount, uint32_t frag_offset, ufs_c
     uint8_t *buf = p_calloc(mount->pool, uint8_t, (numfrags+1) * mount->frag_size);
     uint32_t i;
     
-    for (i=0; i <= numfrags; i++)
-        ufs_read_frag(mount, &buf[i * mount->frag_size], frag_offset + i);
+    if (!ufs_read_data(mount, buf, frag_offset, (numfrags+1) * mount->frag_size))
+        goto fail;
     memcpy(group, buf, sizeof(ufs_cylinder_group_t));
     
     fix_endian(group->link);
@@ -936,7 +990,6 @@ static uint8_t ufs_read_level(ufs_t *mount,
 
     const uint32_t num_pointers = mount->block_size / 4;
     uint32_t *table = p_calloc(mount->pool, uint32_t, num_pointers);
-    uint8_t *block = NULL;
     
     uint32_t i;
     
@@ -948,9 +1001,6 @@ static uint8_t ufs_read_level(ufs_t *mount,
     // for (i=0; i<num_pointers; i++)
         // slog("%u 0x%08x\n", i, ntohl(table[i]));
     
-    if (level == 1)
-        block = p_calloc(mount->pool, uint8_t, mount->block_size);
-    
     for (i=0; (i < num_pointers) && (inode->size > *len); i++) {
         const uint32_t blockno = ntohl(table[i]);
         
@@ -971,10 +1021,9 @@ static uint8_t ufs_read_level(ufs_t *mount,
                 assert(block_offset == 0);
             }
             
-            if (!ufs_read_block(mount, block, block_addr))
+            // The chunk starts at fragment blockno, so read it straight into place
+            if (!ufs_read_data(mount, buf + *len, blockno, chunk_size))
                 goto fail;
-            
-            memcpy(buf + *len, block + block_offset, chunk_size);
             (*len) += chunk_size;
         }
         else {
@@ -984,21 +1033,16 @@ static uint8_t ufs_read_level(ufs_t *mount,
         }
     }
     
-    if (block)
-        p_free(block);
     p_free(table);
     return 1;
 fail:
-    if (block)
-        p_free(block);
     p_free(table);
     return 0;
 }
 
 static uint8_t* ufs_read_inode_data(ufs_t *mount, ufs_inode_t *inode)
 {
-    uint32_t i, j;
-    uint8_t *block = p_calloc(mount->pool, uint8_t, mount->block_size);
+    uint32_t i;
     uint8_t *buf = p_calloc(mount->pool, uint8_t, inode->size);
     size_t len = 0;
     
@@ -1019,10 +1063,8 @@ static uint8_t* ufs_read_inode_data(ufs_t *mount, ufs_inode_t *inode)
         if (chunk_size == mount->block_size)
             assert(block_offset == 0);
         
-        if (!ufs_read_block(mount, block, block_addr))
+        if (!ufs_read_data(mount, buf + len, inode->direct[i], chunk_size))
             goto fail;
-        
-        memcpy(buf + len, block + block_offset, chunk_size);
 
         len += chunk_size;
         // slog("direct block %u = 0x%08x\n", i, inode->direct[i]);
@@ -1035,10 +1077,8 @@ static uint8_t* ufs_read_inode_data(ufs_t *mount, ufs_inode_t *inode)
     }
     
     
-    p_free(block);
     return buf;
 fail:
-    p_free(block);
     p_free(buf);
     return NULL;
 }
@@ -1120,8 +1160,8 @@ static ufs_t* ufs_mount(partition_t *part)
     mount->part = part;
     mount->error_str = part->error_str;
     
-    for (i=0; i<4; i++)
-        part_get_block(part, &buf[i*512], 16 + i);
+    if (!part_get_blocks(part, buf, 16, 4))
+        goto fail;
     memcpy(&mount->superblock, buf, sizeof(ufs_superblock_t));
     
     fix_endian(mount->superblock.link);
@@ -1225,13 +1265,19 @@ fail:
 #pragma mark Public interfaces
 
 
-uint8_t* shoebill_extract_kernel(const char *disk_path, const char *kernel_path, char *error_str, uint32_t *len)
+/*
+ * Find kernel_path on the root partition of disk_path. If id is set, fill it
+ * out with the kernel's identity, and if data is set, read in the kernel.
+ */
+static uint8_t _find_kernel(const char *disk_path, const char *kernel_path, char *error_str,
+                            shoebill_kernel_id_t *id, uint8_t **data, uint32_t *len)
 {
-    uint8_t *pool_data, *kernel_data = NULL;
+    uint8_t *pool_data, found = 0;
     disk_t *disk;
     svfs_t *svfs_mount_obj;
     ufs_t *ufs_mount_obj;
     int32_t apm_part_num;
+    uint32_t i;
     
     strcpy(error_str, "");
     
@@ -1252,13 +1298,24 @@ uint8_t* shoebill_extract_kernel(const char *disk_path, const char *kernel_path,
         if (!inode)
             goto done;
         
-        pool_data = svfs_read_inode_data(svfs_mount_obj, inode);
-        if (!pool_data)
-            goto done;
+        if (id) {
+            id->size = inode->size;
+            id->mtime = inode->mtime;
+            id->ctime = inode->ctime;
+            for (i=0; i<13; i++)
+                id->addrs[i] = inode->addr[i];
+        }
         
-        kernel_data = (uint8_t *)malloc(inode->size);
-        memcpy(kernel_data, pool_data, inode->size);
-        *len = inode->size;
+        if (data) {
+            pool_data = svfs_read_inode_data(svfs_mount_obj, inode);
+            if (!pool_data)
+                goto done;
+            
+            *data = (uint8_t *)malloc(inode->size);
+            memcpy(*data, pool_data, inode->size);
+            *len = inode->size;
+        }
+        found = 1;
         goto done;
     }
     
@@ -1268,13 +1325,26 @@ uint8_t* shoebill_extract_kernel(const char *disk_path, const char *kernel_path,
         if (!inode)
             goto done;
         
-        pool_data = ufs_read_inode_data(ufs_mount_obj, inode);
-        if (!pool_data)
-            goto done;
+        if (id) {
+            id->size = inode->size;
+            id->mtime = inode->mtime;
+            id->ctime = inode->ctime;
+            for (i=0; i<12; i++)
+                id->addrs[i] = inode->direct[i];
+            for (i=0; i<3; i++)
+                id->addrs[12 + i] = inode->indirect[i];
+        }
         
-        kernel_data = (uint8_t *)malloc(inode->size);
-        memcpy(kernel_data, pool_data, inode->size);
-        *len = inode->size;
+        if (data) {
+            pool_data = ufs_read_inode_data(ufs_mount_obj, inode);
+            if (!pool_data)
+                goto done;
+            
+            *data = (uint8_t *)malloc(inode->size);
+            memcpy(*data, pool_data, inode->size);
+            *len = inode->size;
+        }
+        found = 1;
         goto done;
     }
     
@@ -1285,9 +1355,38 @@ done:
         slog("error: [%s]\n", error_str);
     if (disk)
         close_disk(disk);
+    return found;
+}
+
+uint8_t* shoebill_extract_kernel(const char *disk_path, const char *kernel_path, char *error_str, uint32_t *len)
+{
+    uint8_t *kernel_data = NULL;
+    
+    _find_kernel(disk_path, kernel_path, error_str, NULL, &kernel_data, len);
     return kernel_data;
 }
 
+/*
+ * Identify the kernel without reading it: the disk image it lives in, and
+ * its inode (the guest can rewrite the image, so the image's own mtime
+ * tells us nothing).
+ */
+uint8_t shoebill_identify_kernel(const char *disk_path, const char *kernel_path, char *error_str, shoebill_kernel_id_t *id)
+{
+    struct stat st;
+    
+    memset(id, 0, sizeof(*id));
+    
+    if (stat(disk_path, &st) != 0) {
+        sprintf(error_str, "Can't open that path");
+        return 0;
+    }
+    id->dev = st.st_dev;
+    id->ino = st.st_ino;
+    
+    return _find_kernel(disk_path, kernel_path, error_str, id, NULL, NULL);
+}
+
 /*int main (int argc, char **argv)
 {
     uint8_t *buf;
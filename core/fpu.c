@@ -3307,3 +3307,9 @@ void fpu_reset()
     p_free(shoe.fpu_state);
     fpu_initialize();
 }
+
+// fpu_state_t is opaque outside fpu.c, but snapshot.c needs to know how much to copy
+uint32_t fpu_state_size()
+{
+    return sizeof(fpu_state_t);
+}
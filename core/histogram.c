@@ -0,0 +1,202 @@
+/*
+ * Copyright (c) 2014, Peter Rutenbar <pruten@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Opcode/EA-mode execution histogram, for deciding which instruction
+ * handlers are worth specializing. Build the core with
+ * -DSHOEBILL_OP_HISTOGRAM=1 to turn it on. Otherwise cpu_step() and the
+ * ea_read()/ea_write() macros don't count anything, and
+ * shoebill_write_histogram() just says so.
+ *
+ * The report has four sections, each sorted by count:
+ *   instructions by handler (inst_opcode_map index)
+ *   the most common opcode words
+ *   EA reads and writes by addressing mode
+ *   the most common (previous, current) handler pairs
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "shoebill.h"
+
+#if SHOEBILL_OP_HISTOGRAM
+
+#define HISTOGRAM_TOP_OPS 200
+#define HISTOGRAM_TOP_PAIRS 100
+
+// Generated by decoder_gen, defined in cpu.c
+extern const uint32_t inst_num_instructions;
+extern const char *inst_instruction_names[];
+extern const uint8_t inst_opcode_map[0x10000];
+
+typedef struct {
+    uint32_t key;
+    uint64_t count;
+} histogram_entry_t;
+
+static int _by_count (const void *_a, const void *_b)
+{
+    const histogram_entry_t *a = _a, *b = _b;
+    if (a->count != b->count)
+        return (a->count < b->count) ? 1 : -1;
+    return (a->key < b->key) ? -1 : (a->key > b->key);
+}
+
+/* Sort entries, and print the non-zero ones (up to max) */
+static void _print_sorted (FILE *f, histogram_entry_t *entries, uint32_t n, uint32_t max, uint64_t total,
+                           void (*print_key)(FILE*, uint32_t))
+{
+    uint32_t i;
+    
+    qsort(entries, n, sizeof(histogram_entry_t), _by_count);
+    for (i=0; (i < n) && (i < max) && entries[i].count; i++) {
+        fprintf(f, "%14llu %6.2f%%  ", (unsigned long long)entries[i].count,
+                total ? (100.0 * entries[i].count / total) : 0.0);
+        print_key(f, entries[i].key);
+        fprintf(f, "\n");
+    }
+    fprintf(f, "\n");
+}
+
+static void _print_inst (FILE *f, uint32_t index)
+{
+    fprintf(f, "%s", inst_instruction_names[index]);
+}
+
+static void _print_op (FILE *f, uint32_t op)
+{
+    fprintf(f, "0x%04x %s", op, inst_instruction_names[inst_opcode_map[op]]);
+}
+
+static void _print_pair (FILE *f, uint32_t pair)
+{
+    fprintf(f, "%s -> %s", inst_instruction_names[pair >> 8], inst_instruction_names[pair & 0xff]);
+}
+
+static void _print_ea_mode (FILE *f, uint32_t mr)
+{
+    const uint8_t mode = mr >> 3, reg = mr & 7;
+    
+    switch (mode) {
+        case 0: fprintf(f, "d%u", reg); return;
+        case 1: fprintf(f, "a%u", reg); return;
+        case 2: fprintf(f, "(a%u)", reg); return;
+        case 3: fprintf(f, "(a%u)+", reg); return;
+        case 4: fprintf(f, "-(a%u)", reg); return;
+        case 5: fprintf(f, "(d16,a%u)", reg); return;
+        case 6: fprintf(f, "(d8/bd,a%u,xn)", reg); return;
+    }
+    switch (reg) {
+        case 0: fprintf(f, "(xxx).w"); return;
+        case 1: fprintf(f, "(xxx).l"); return;
+        case 2: fprintf(f, "(d16,pc)"); return;
+        case 3: fprintf(f, "(d8/bd,pc,xn)"); return;
+        case 4: fprintf(f, "#imm"); return;
+    }
+    fprintf(f, "mode 7/%u", reg);
+}
+
+static void _write_report (FILE *f, const op_histogram_t *h)
+{
+    histogram_entry_t *entries = malloc(0x10000 * sizeof(histogram_entry_t));
+    uint64_t total = 0, reads = 0, writes = 0;
+    uint32_t i, j;
+    
+    // Instructions by handler
+    for (i=0; i<inst_num_instructions; i++) {
+        entries[i].key = i;
+        entries[i].count = 0;
+    }
+    for (i=0; i<0x10000; i++) {
+        entries[inst_opcode_map[i]].count += h->ops[i];
+        total += h->ops[i];
+    }
+    fprintf(f, "%llu instructions\n\n", (unsigned long long)total);
+    fprintf(f, "-- Instructions by handler --\n");
+    _print_sorted(f, entries, inst_num_instructions, inst_num_instructions, total, _print_inst);
+    
+    // Opcode words
+    for (i=0; i<0x10000; i++) {
+        entries[i].key = i;
+        entries[i].count = h->ops[i];
+    }
+    fprintf(f, "-- Top %u opcode words --\n", HISTOGRAM_TOP_OPS);
+    _print_sorted(f, entries, 0x10000, HISTOGRAM_TOP_OPS, total, _print_op);
+    
+    // EA modes
+    for (i=0; i<64; i++) {
+        entries[i].key = i;
+        entries[i].count = h->ea_reads[i];
+        reads += h->ea_reads[i];
+    }
+    fprintf(f, "-- EA reads by mode (%llu) --\n", (unsigned long long)reads);
+    _print_sorted(f, entries, 64, 64, reads, _print_ea_mode);
+    
+    for (i=0; i<64; i++) {
+        entries[i].key = i;
+        entries[i].count = h->ea_writes[i];
+        writes += h->ea_writes[i];
+    }
+    fprintf(f, "-- EA writes by mode (%llu) --\n", (unsigned long long)writes);
+    _print_sorted(f, entries, 64, 64, writes, _print_ea_mode);
+    
+    // Pairs
+    for (i=0; i<256; i++) {
+        for (j=0; j<256; j++) {
+            entries[(i << 8) | j].key = (i << 8) | j;
+            entries[(i << 8) | j].count = h->pairs[i][j];
+        }
+    }
+    fprintf(f, "-- Top %u instruction pairs --\n", HISTOGRAM_TOP_PAIRS);
+    _print_sorted(f, entries, 0x10000, HISTOGRAM_TOP_PAIRS, total, _print_pair);
+    
+    free(entries);
+}
+
+uint32_t shoebill_write_histogram (const char *path)
+{
+    FILE *f = fopen(path, "w");
+    
+    if (f == NULL) {
+        slog("histogram: can't open %s for writing\n", path);
+        return 0;
+    }
+    
+    // The CPU thread keeps counting while we look, which is fine for a histogram
+    _write_report(f, &shoe.histogram);
+    
+    return fclose(f) == 0;
+}
+
+#else
+
+uint32_t shoebill_write_histogram (const char *path)
+{
+    slog("histogram: this build doesn't have SHOEBILL_OP_HISTOGRAM\n");
+    return 0;
+}
+
+#endif
@@ -32,8 +32,8 @@
 
 #define verify_supervisor() {if (!sr_s()) {throw_privilege_violation(); return;}}
 
-extern struct dis_t dis;
-extern uint16_t dis_op;
+extern __thread struct dis_t dis;
+extern __thread uint16_t dis_op;
 
 void inst_mc68851_prestore() {
     slog("%s: Error, not implemented!\n", __func__);
@@ -80,6 +80,7 @@ void inst_mc68851_pvalid(uint16_t ext){
 void inst_mc68851_pflushr(uint16_t ext){
     verify_supervisor();
     slog("pflushr!");
+    shoe.stats.pflushes++;
     // Just nuke the entire cache
     memset(shoe.pmmu_cache[0].valid_map, 0, PMMU_CACHE_SIZE/8);
     memset(shoe.pmmu_cache[1].valid_map, 0, PMMU_CACHE_SIZE/8);
@@ -91,6 +92,7 @@ void inst_mc68851_pflushr(uint16_t ext){
 void inst_mc68851_pflush(uint16_t ext){
     verify_supervisor();
     slog("pflush!");
+    shoe.stats.pflushes++;
     memset(shoe.pmmu_cache[0].valid_map, 0, PMMU_CACHE_SIZE/8);
     memset(shoe.pmmu_cache[1].valid_map, 0, PMMU_CACHE_SIZE/8);
     // slog("%s: Error, not implemented!\n", __func__);
@@ -220,6 +222,7 @@ static int64_t ptest_search(const uint32_t _logical_addr, const uint64_t rootp)
     //  we or into the physical addr from the virtual addr)
     
     shoe.psr.word = 0;
+    shoe.stats.table_walks++;
     
     desc_addr = -1; // address of the descriptor (-1 -> register)
     
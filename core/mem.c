@@ -26,6 +26,7 @@
 #include <stdio.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
 #include "../core/shoebill.h"
 
 /* --- Physical_get jump table --- */
@@ -92,13 +93,44 @@ void _physical_get_io (void)
     }
 }
 
+/*
+ * Read from a card's direct window (video RAM) without calling read_func.
+ * Returns 0 if the access isn't entirely inside the window.
+ */
+static _Bool _nubus_direct_get (const nubus_card_t *card)
+{
+    const uint32_t offset = shoe.physical_addr & card->direct_mask;
+    const uint8_t *ptr;
+    
+    if ((offset + shoe.physical_size) > card->direct_size)
+        return 0;
+    
+    ptr = &card->direct_buf[offset];
+    switch (shoe.physical_size) {
+        case 1:
+            shoe.physical_dat = *ptr;
+            return 1;
+        case 2:
+            shoe.physical_dat = ntohs(*(uint16_t*)ptr);
+            return 1;
+        case 4:
+            shoe.physical_dat = ntohl(*(uint32_t*)ptr);
+            return 1;
+    }
+    return 0;
+}
+
 void _physical_get_super_slot (void)
 {
     const uint32_t slot = shoe.physical_addr >> 28;
-    if slikely(shoe.slots[slot].connected)
+    shoe.stats.slot_reads[slot]++;
+    if slikely(shoe.slots[slot].connected) {
+        if (_nubus_direct_get(&shoe.slots[slot]))
+            return ;
         shoe.physical_dat = shoe.slots[slot].read_func(shoe.physical_addr,
                                                        shoe.physical_size,
                                                        slot);
+    }
     else
         shoe.abort = 1; // throw a bus error for reads to disconnected slots
         // XXX: Do super slot accesses raise bus errors?
@@ -107,10 +139,14 @@ void _physical_get_super_slot (void)
 void _physical_get_standard_slot (void)
 {
     const uint32_t slot = (shoe.physical_addr >> 24) & 0xf;
-    if slikely(shoe.slots[slot].connected)
+    shoe.stats.slot_reads[slot]++;
+    if slikely(shoe.slots[slot].connected) {
+        if (_nubus_direct_get(&shoe.slots[slot]))
+            return ;
         shoe.physical_dat = shoe.slots[slot].read_func(shoe.physical_addr,
                                                        shoe.physical_size,
                                                        slot);
+    }
     else
         shoe.abort = 1; // throw a bus error for reads to disconnected slots
 }
@@ -145,27 +181,26 @@ void _physical_set_ram (void)
     else
         addr = &shoe.physical_mem_base[shoe.physical_addr];
     
-    if ((shoe.physical_addr >= 0x100) && (shoe.physical_addr < (0x8000))) {
-        slog("LOMEM set: *0x%08x = 0x%x\n", shoe.physical_addr, (uint32_t)chop(shoe.physical_dat, shoe.physical_size));
-    }
+    if ((shoe.physical_addr >= 0x100) && (shoe.physical_addr < (0x8000)))
+        tp(TP_MEM, TP_DEBUG, "LOMEM set: *0x%08x = 0x%x", shoe.physical_addr, (uint32_t)chop(shoe.physical_dat, shoe.physical_size));
     
     const uint32_t sz = shoe.physical_size;
     switch (sz) {
         case 1:
             *addr = (uint8_t)shoe.physical_dat;
-            return ;
+            break;
             
         case 2:
             *((uint16_t*)addr) = htons((uint16_t)shoe.physical_dat);
-            return ;
+            break;
             
         case 4:
             *((uint32_t*)addr) = htonl((uint32_t)shoe.physical_dat);
-            return ;
+            break;
             
         case 8:
             *(uint64_t*)addr = ntohll(shoe.physical_dat);
-            return ;
+            break;
             
         default: {
             uint64_t q = shoe.physical_dat;
@@ -174,9 +209,16 @@ void _physical_set_ram (void)
                 addr[sz-i] = (uint8_t)q;
                 q >>= 8;
             }
-            return ;
+            break;
         }
     }
+    
+    // Mark after the store (see "Dirty page tracking" below)
+    if (shoe.dirty_map) {
+        const uint32_t offset = addr - shoe.physical_mem_base;
+        __atomic_store_n(&shoe.dirty_map[offset >> SHOEBILL_DIRTY_PAGE_SHIFT], 1, __ATOMIC_RELEASE);
+        __atomic_store_n(&shoe.dirty_map[(offset + sz - 1) >> SHOEBILL_DIRTY_PAGE_SHIFT], 1, __ATOMIC_RELEASE);
+    }
 }
 
 void _physical_set_rom (void)
@@ -220,24 +262,66 @@ void _physical_set_io (void)
     }
 }
 
+/*
+ * Write to a card's direct window (video RAM) without calling write_func,
+ * and mark the touched chunk(s) dirty.
+ * Returns 0 if the access isn't entirely inside the window.
+ */
+static _Bool _nubus_direct_set (nubus_card_t *card)
+{
+    const uint32_t offset = shoe.physical_addr & card->direct_mask;
+    const uint32_t sz = shoe.physical_size;
+    uint8_t *ptr;
+    
+    if ((offset + sz) > card->direct_size)
+        return 0;
+    
+    ptr = &card->direct_buf[offset];
+    switch (sz) {
+        case 1:
+            *ptr = (uint8_t)shoe.physical_dat;
+            break;
+        case 2:
+            *((uint16_t*)ptr) = htons((uint16_t)shoe.physical_dat);
+            break;
+        case 4:
+            *((uint32_t*)ptr) = htonl((uint32_t)shoe.physical_dat);
+            break;
+        default:
+            return 0;
+    }
+    
+    card->direct_dirty[offset >> NUBUS_DIRTY_SHIFT] = 1;
+    card->direct_dirty[(offset + sz - 1) >> NUBUS_DIRTY_SHIFT] = 1;
+    return 1;
+}
+
 void _physical_set_super_slot (void)
 {
     const uint32_t slot = shoe.physical_addr >> 28;
-    if (shoe.slots[slot].connected)
+    shoe.stats.slot_writes[slot]++;
+    if (shoe.slots[slot].connected) {
+        if (_nubus_direct_set(&shoe.slots[slot]))
+            return ;
         shoe.slots[slot].write_func(shoe.physical_addr,
                                     shoe.physical_size,
                                     shoe.physical_dat,
                                     slot);
+    }
 }
 
 void _physical_set_standard_slot (void)
 {
     const uint32_t slot = (shoe.physical_addr >> 24) & 0xf;
-    if (shoe.slots[slot].connected)
+    shoe.stats.slot_writes[slot]++;
+    if (shoe.slots[slot].connected) {
+        if (_nubus_direct_set(&shoe.slots[slot]))
+            return ;
         shoe.slots[slot].write_func(shoe.physical_addr,
                                     shoe.physical_size,
                                     shoe.physical_dat,
                                     slot);
+    }
 }
 
 const physical_set_ptr physical_set_jump_table[16] = {
@@ -259,6 +343,306 @@ const physical_set_ptr physical_set_jump_table[16] = {
     _physical_set_standard_slot // 0xf
 };
 
+/*
+ * Let a nubus card expose a flat chunk of memory (video RAM) to the CPU.
+ * Any access to (addr & mask) < size in this slot's address space will
+ * read/write buf directly. Returns the dirty map (initially all dirty),
+ * which has nubus_dirty_len(size) entries.
+ */
+uint8_t* nubus_map_direct_window(uint8_t slotnum, uint8_t *buf, uint32_t mask, uint32_t size)
+{
+    nubus_card_t *card = &shoe.slots[slotnum];
+    const uint32_t dirty_len = nubus_dirty_len(size);
+    
+    card->direct_dirty = p_calloc(shoe.pool, uint8_t, dirty_len);
+    memset(card->direct_dirty, 1, dirty_len);
+    card->direct_buf = buf;
+    card->direct_mask = mask;
+    card->direct_size = size;
+    
+    return card->direct_dirty;
+}
+
+/* --- Bulk physical access --- */
+#pragma mark Bulk physical access
+
+/*
+ * For loaders and DMA-ish device models: RAM ranges turn into memcpy/memset
+ * (wrapping around wherever RAM mirrors), ROM ignores writes, and only I/O
+ * and nubus addresses go through physical_set() a byte at a time.
+ */
+
+/*
+ * How much of [addr, addr+len) is one flat run of physical_mem_base (addr must be RAM).
+ */
+static uint32_t _ram_run (uint32_t addr, uint32_t len, uint8_t **ptr)
+{
+    const uint32_t offset = addr % shoe.physical_mem_size;
+    uint32_t run = shoe.physical_mem_size - offset;
+    
+    if (run > (0x40000000 - addr))
+        run = 0x40000000 - addr;
+    if (run > len)
+        run = len;
+    
+    *ptr = &shoe.physical_mem_base[offset];
+    return run;
+}
+
+/* Mark a run from _ram_run() dirty, once it's been written */
+static void _ram_run_dirty (const uint8_t *ptr, uint32_t run)
+{
+    if (shoe.dirty_map) {
+        const uint32_t offset = ptr - shoe.physical_mem_base;
+        const uint32_t first = offset >> SHOEBILL_DIRTY_PAGE_SHIFT;
+        const uint32_t last = (offset + run - 1) >> SHOEBILL_DIRTY_PAGE_SHIFT;
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        memset(&shoe.dirty_map[first], 1, last - first + 1);
+    }
+}
+
+void physical_write_block (uint32_t addr, const uint8_t *buf, uint32_t len)
+{
+    // Don't clobber an access that might be in progress
+    const uint32_t saved_addr = shoe.physical_addr;
+    const uint32_t saved_size = shoe.physical_size;
+    const uint64_t saved_dat = shoe.physical_dat;
+    
+    while (len > 0) {
+        uint32_t run;
+        if (addr < 0x40000000) {
+            uint8_t *ptr;
+            run = _ram_run(addr, len, &ptr);
+            memcpy(ptr, buf, run);
+            _ram_run_dirty(ptr, run);
+        }
+        else if ((addr >> 28) == 4) {
+            run = 0x50000000 - addr;
+            if (run > len)
+                run = len;
+        }
+        else {
+            pset(addr, 1, *buf);
+            run = 1;
+        }
+        addr += run;
+        buf += run;
+        len -= run;
+    }
+    
+    shoe.physical_addr = saved_addr;
+    shoe.physical_size = saved_size;
+    shoe.physical_dat = saved_dat;
+}
+
+void physical_fill (uint32_t addr, uint8_t val, uint32_t len)
+{
+    const uint32_t saved_addr = shoe.physical_addr;
+    const uint32_t saved_size = shoe.physical_size;
+    const uint64_t saved_dat = shoe.physical_dat;
+    
+    while (len > 0) {
+        uint32_t run;
+        if (addr < 0x40000000) {
+            uint8_t *ptr;
+            run = _ram_run(addr, len, &ptr);
+            memset(ptr, val, run);
+            _ram_run_dirty(ptr, run);
+        }
+        else if ((addr >> 28) == 4) {
+            run = 0x50000000 - addr;
+            if (run > len)
+                run = len;
+        }
+        else {
+            pset(addr, 1, val);
+            run = 1;
+        }
+        addr += run;
+        len -= run;
+    }
+    
+    shoe.physical_addr = saved_addr;
+    shoe.physical_size = saved_size;
+    shoe.physical_dat = saved_dat;
+}
+
+/* --- Dirty page tracking --- */
+#pragma mark Dirty page tracking
+
+/*
+ * Every write to RAM goes through _physical_set_ram() or the bulk writers
+ * above, which mark the page(s) they touch after storing to them. The map is
+ * bytes rather than bits so marking is a plain (release) store, and so
+ * collecting it can clear each entry atomically while the CPU thread keeps
+ * running: a write that lands after its page's entry is cleared marks it
+ * again, and so shows up in the next collection.
+ */
+
+void shoebill_dirty_enable (_Bool enable)
+{
+    pause_cpu_thread();
+    
+    if (enable && !shoe.dirty_map) {
+        // +8 for writes that spill past the end of RAM, rounded up for _collect
+        const uint32_t pages = ((shoe.physical_mem_size + 8 - 1) >> SHOEBILL_DIRTY_PAGE_SHIFT) + 1;
+        shoe.dirty_map_len = (pages + 7) & ~~7;
+        shoe.dirty_map = p_calloc(shoe.pool, uint8_t, shoe.dirty_map_len);
+        memset(shoe.dirty_map, 1, shoe.dirty_map_len); // Nothing has been collected yet
+    }
+    else if (!enable && shoe.dirty_map) {
+        p_free(shoe.dirty_map);
+        shoe.dirty_map = NULL;
+        shoe.dirty_map_len = 0;
+    }
+    
+    resume_cpu_thread();
+}
+
+uint32_t shoebill_dirty_map_len (void)
+{
+    return shoe.dirty_map_len;
+}
+
+uint32_t shoebill_dirty_collect (uint8_t *out)
+{
+    uint64_t *map = (uint64_t*)shoe.dirty_map;
+    uint32_t i, j, count = 0;
+    
+    for (i=0; i < (shoe.dirty_map_len / 8); i++) {
+        uint64_t word = 0;
+        
+        if (map[i])
+            word = __atomic_exchange_n(&map[i], 0, __ATOMIC_ACQ_REL);
+        if (out)
+            memcpy(&out[i * 8], &word, 8);
+        for (j=0; word; j++, word >>= 8)
+            count += ((word & 0xff) != 0);
+    }
+    return count;
+}
+
+/* --- Watchpoints --- */
+#pragma mark Watchpoints
+
+/*
+ * Rather than range-checking every access, translate_logical_addr() marks
+ * ATC entries for pages that overlap a watchpoint as "watched", and the ATC
+ * lookups treat watched entries as misses. So only accesses to watched pages
+ * go through the table walk and the exact check in _watch_check().
+ * With the MMU off there's no ATC, and logical_get/set check watch_count.
+ */
+
+static void _watch_flush_atc (void)
+{
+    memset(shoe.pmmu_cache[0].valid_map, 0, PMMU_CACHE_SIZE/8);
+    memset(shoe.pmmu_cache[1].valid_map, 0, PMMU_CACHE_SIZE/8);
+}
+
+static _Bool _watch_overlaps_page (uint32_t addr)
+{
+    const uint32_t page = addr & ~~shoe.tc_pagemask;
+    const uint32_t page_size = shoe.tc_pagemask + 1;
+    uint32_t i;
+    
+    for (i=0; i<shoe.watch_count; i++) {
+        const watchpoint_t *w = &shoe.watchpoints[i];
+        if (((page - w->addr) < w->size) || ((w->addr - page) < page_size))
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * Called for accesses to watched pages, with physical_addr already translated.
+ * For writes, logical_dat is the value about to be written.
+ */
+static void _watch_check (uint32_t addr, uint32_t size, _Bool is_write)
+{
+    const uint8_t type = is_write ? SHOEBILL_WATCH_WRITE : SHOEBILL_WATCH_READ;
+    const watchpoint_t *w = NULL;
+    watch_hit_t *hit = &shoe.watch_hit;
+    uint32_t i;
+    
+    // Only guest data accesses count, not instruction fetches or the debugger peeking
+    if (((shoe.logical_fc & 3) != 1) || shoe.suppress_exceptions)
+        return ;
+    
+    for (i=0; i<shoe.watch_count; i++) {
+        if (!(shoe.watchpoints[i].type & type))
+            continue;
+        if (((addr - shoe.watchpoints[i].addr) < shoe.watchpoints[i].size) ||
+            ((shoe.watchpoints[i].addr - addr) < size)) {
+            w = &shoe.watchpoints[i];
+            break;
+        }
+    }
+    
+    // Only keep the first hit until the front end acknowledges it
+    if slikely(!w || (shoe.cpu_thread_notifications & SHOEBILL_STATE_WATCH))
+        return ;
+    
+    hit->num = w->num;
+    hit->pc = shoe.orig_pc;
+    hit->addr = addr;
+    hit->size = size;
+    hit->is_write = is_write;
+    hit->new_dat = is_write ? shoe.logical_dat : 0;
+    hit->old_dat = 0;
+    hit->old_valid = (size <= 8) && ((shoe.physical_addr + size) <= shoe.physical_mem_size);
+    if (hit->old_valid) {
+        for (i=0; i<size; i++)
+            hit->old_dat = (hit->old_dat << 8) | shoe.physical_mem_base[shoe.physical_addr + i];
+    }
+    
+    __sync_fetch_and_or(&shoe.cpu_thread_notifications, SHOEBILL_STATE_WATCH);
+}
+
+int32_t shoebill_watch_add (uint32_t addr, uint32_t size, uint8_t type)
+{
+    watchpoint_t *w;
+    
+    type &= SHOEBILL_WATCH_READ | SHOEBILL_WATCH_WRITE;
+    if ((shoe.watch_count >= SHOEBILL_MAX_WATCHPOINTS) || (size == 0) || (type == 0))
+        return -1;
+    
+    pause_cpu_thread();
+    
+    w = &shoe.watchpoints[shoe.watch_count];
+    w->addr = addr;
+    w->size = size;
+    w->type = type;
+    w->num = shoe.watch_counter++;
+    shoe.watch_count++;
+    _watch_flush_atc();
+    
+    resume_cpu_thread();
+    
+    return w->num;
+}
+
+uint32_t shoebill_watch_remove (uint32_t num)
+{
+    uint32_t i;
+    
+    for (i=0; i<shoe.watch_count; i++)
+        if (shoe.watchpoints[i].num == num)
+            break;
+    if (i == shoe.watch_count)
+        return 0;
+    
+    pause_cpu_thread();
+    
+    shoe.watch_count--;
+    memmove(&shoe.watchpoints[i], &shoe.watchpoints[i+1], (shoe.watch_count - i) * sizeof(watchpoint_t));
+    _watch_flush_atc();
+    
+    resume_cpu_thread();
+    
+    return 1;
+}
+
+
 /* --- PMMU logical address translation --- */
 #pragma mark PMMU logical address translation
 
@@ -291,6 +675,8 @@ const physical_set_ptr physical_set_jump_table[16] = {
 
 static _Bool check_pmmu_cache_write(void)
 {
+    shoe.stats.atc_lookups++;
+    
     const _Bool use_srp = (shoe.tc_sre && (shoe.logical_fc >= 5));
     
     // logical addr [is]xxxxxxxxxxxx[ps] -> value xxxxxxxxxxxx
@@ -306,11 +692,13 @@ static _Bool check_pmmu_cache_write(void)
     const uint32_t v_mask = ~~ps_mask;
     
     shoe.physical_addr = ((entry.physical_addr<<8) & v_mask) | (shoe.logical_addr & ps_mask);
-    return is_set && (entry.logical_value == value) && entry.modified && !entry.wp;
+    return is_set && (entry.logical_value == value) && entry.modified && !entry.wp && !entry.watched;
 }
 
 static _Bool check_pmmu_cache_read(void)
 {
+    shoe.stats.atc_lookups++;
+    
     const _Bool use_srp = (shoe.tc_sre && (shoe.logical_fc >= 5));
     
     // logical addr [is]xxxxxxxxxxxx[ps] -> value xxxxxxxxxxxx
@@ -326,7 +714,7 @@ static _Bool check_pmmu_cache_read(void)
     const uint32_t v_mask = ~~ps_mask;
     
     shoe.physical_addr = ((entry.physical_addr<<8) & v_mask) | (shoe.logical_addr & ps_mask);
-    return is_set && (entry.logical_value == value);
+    return is_set && (entry.logical_value == value) && !entry.watched;
 }
 
 
@@ -335,6 +723,9 @@ static void translate_logical_addr()
     const uint8_t use_srp = (shoe.tc_sre && (shoe.logical_fc >= 5));
     assert((0x66 >> shoe.logical_fc) & 1); // we only support these FCs for now
     
+    shoe.stats.atc_misses++;
+    shoe.stats.table_walks++;
+    
     uint64_t *rootp_ptr = (use_srp ? (&shoe.srp) : (&shoe.crp));
     const uint64_t rootp = *rootp_ptr;
     uint8_t desc_did_change = 0;
@@ -473,18 +864,24 @@ search_done:
     entry.wp = wp;
     entry.modified = desc_m(desc, desc_size);
     entry.used_bits = used_bits;
+    entry.watched = shoe.watch_count && _watch_overlaps_page(shoe.logical_addr);
     shoe.pmmu_cache[use_srp].entry[key] = entry;
     
+    // Watched pages never hit in the ATC, so every access to one lands here
+    if sunlikely(entry.watched)
+        _watch_check(shoe.logical_addr, shoe.logical_size, shoe.logical_is_write);
 }
 
 
-void logical_get (void)
+static void _logical_get (void)
 {
     
     // If address translation isn't enabled, this is a physical address
     if sunlikely(!shoe.tc_enable) {
         shoe.physical_addr = shoe.logical_addr;
         shoe.physical_size = shoe.logical_size;
+        if sunlikely(shoe.watch_count)
+            _watch_check(shoe.logical_addr, shoe.logical_size, 0);
         physical_get();
         if sunlikely(shoe.abort) {
             shoe.abort = 0;
@@ -574,13 +971,25 @@ void logical_get (void)
     }
 }
 
-void logical_set (void)
+void logical_get (void)
+{
+    const uint32_t addr = shoe.logical_addr, size = shoe.logical_size;
+    
+    _logical_get();
+    
+    if sunlikely(shoe.trace_mem)
+        trace_mem_access(addr, size, shoe.logical_dat, 0);
+}
+
+static void _logical_set (void)
 {
     // If address translation isn't enabled, this is a physical address
     if sunlikely(!shoe.tc_enable) {
         shoe.physical_addr = shoe.logical_addr;
         shoe.physical_size = shoe.logical_size;
         shoe.physical_dat = shoe.logical_dat;
+        if sunlikely(shoe.watch_count)
+            _watch_check(shoe.logical_addr, shoe.logical_size, 1);
         physical_set();
         return ;
     }
@@ -615,8 +1024,10 @@ void logical_set (void)
         const uint64_t data_a = shoe.logical_dat >> (size_b*8);
         const uint64_t data_b = bitchop_64(shoe.logical_dat, size_b*8);
         
+        // (logical_dat is only split up for the watchpoint check in translate_logical_addr())
         shoe.logical_addr = addr_a;
         shoe.logical_size = size_a;
+        shoe.logical_dat = data_a;
         if sunlikely(!check_pmmu_cache_write()) {
             translate_logical_addr();
             if sunlikely(shoe.abort)
@@ -626,6 +1037,7 @@ void logical_set (void)
         
         shoe.logical_addr = addr_b;
         shoe.logical_size = size_b;
+        shoe.logical_dat = data_b;
         if sunlikely(!check_pmmu_cache_write()) {
             translate_logical_addr();
             if sunlikely(shoe.abort)
@@ -647,6 +1059,60 @@ void logical_set (void)
     }
 }
 
+void logical_set (void)
+{
+    const uint32_t addr = shoe.logical_addr, size = shoe.logical_size;
+    const uint64_t dat = shoe.logical_dat;
+    
+    _logical_set();
+    
+    if sunlikely(shoe.trace_mem)
+        trace_mem_access(addr, size, dat, 1);
+}
+
+/*
+ * For observers that mustn't disturb the guest (the profiler): read size bytes
+ * at a logical address into *out, but only if they're all in RAM. Returns 0,
+ * rather than touch ROM, I/O or nubus space (where reads have side effects),
+ * if any byte translates elsewhere or doesn't translate at all.
+ * Call with suppress_exceptions set.
+ */
+_Bool logical_peek_ram (uint32_t addr, uint32_t size, uint8_t fc, uint64_t *out)
+{
+    uint64_t dat = 0;
+    uint32_t i, paddr = 0;
+    
+    for (i=0; i<size; i++) {
+        const uint32_t laddr = addr + i;
+        
+        if (!shoe.tc_enable)
+            paddr = laddr;
+        else if ((i == 0) || ((laddr & shoe.tc_pagemask) == 0)) {
+            shoe.logical_addr = laddr;
+            shoe.logical_size = 1;
+            shoe.logical_fc = fc;
+            shoe.logical_is_write = 0;
+            if (!check_pmmu_cache_read()) {
+                translate_logical_addr();
+                if (shoe.abort) {
+                    shoe.abort = 0;
+                    return 0;
+                }
+            }
+            paddr = shoe.physical_addr;
+        }
+        else
+            paddr++;
+        
+        if (paddr >= 0x40000000)
+            return 0;
+        dat = (dat << 8) | shoe.physical_mem_base[paddr % shoe.physical_mem_size];
+    }
+    
+    *out = dat;
+    return 1;
+}
+
 /* --- PC cache routines --- */
 #pragma mark PC cache routines
 
@@ -656,6 +1122,8 @@ static uint16_t pccache_miss(const uint32_t pc)
     const uint32_t pageoffset = pc & pagemask;
     uint32_t paddr;
     
+    shoe.stats.pccache_misses++;
+    
     /*
      * I think the instruction decoder uses these
      * these function codes:
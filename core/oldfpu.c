@@ -31,8 +31,8 @@
 #include <math.h>
 #include "../core/shoebill.h"
 
-extern struct dis_t dis;
-extern uint16_t dis_op;
+extern __thread struct dis_t dis;
+extern __thread uint16_t dis_op;
 
 #define FPU_JUMP_EMU 0
 #define FPU_JUMP_DIS 1
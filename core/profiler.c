@@ -0,0 +1,357 @@
+/*
+ * Copyright (c) 2014, Peter Rutenbar <pruten@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * A statistical profiler for the guest. A sampling thread pokes the CPU
+ * thread (SHOEBILL_STATE_PROFILE) every 1/hz seconds, and the CPU thread
+ * records a sample at the next instruction boundary, where the registers
+ * and memory are consistent:
+ *
+ *   the pc, supervisor mode, the current A/UX pid, the last A-trap taken,
+ *   and the return addresses found by walking the a6 (link/unlk) chain
+ *
+ * Identical samples are merged as they come in, and symbolization is put
+ * off until shoebill_profile_write(), which writes "folded stacks" - one
+ * line per unique stack, outermost frame first, with a count at the end:
+ *
+ *   pid:42;kernel;syscall;read;ufs_read;scsi_start 17
+ *
+ * which is what flamegraph.pl (and most other flame graph tools) eat.
+ * Samples taken while the CPU is STOPPED are counted as "idle".
+ *
+ * Kernel frames are named from the A/UX kernel's COFF symbols, ROM frames
+ * from macii_rom_symbols[], and user frames are left as addresses.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "shoebill.h"
+
+#define PROFILE_MAX_DEPTH 48
+#define PROFILE_MAX_FRAME_SIZE 0x10000 // bigger than this, and a6 is probably garbage
+#define PROFILE_NO_PID 0xffffffff
+
+typedef struct _profile_stack_t {
+    struct _profile_stack_t *next_hash; // next stack with the same hash
+    struct _profile_stack_t *next_all;
+    uint64_t count;
+    
+    uint32_t pid;
+    uint16_t atrap; // the last A-trap, or 0
+    uint8_t supervisor;
+    uint8_t depth;
+    uint32_t pcs[PROFILE_MAX_DEPTH]; // pcs[0] is the leaf
+} profile_stack_t;
+
+struct _profiler_t {
+    shoebill_machine_t *machine;
+    pthread_t threadid;
+    pthread_mutex_t lock; // protects stacks/all/samples from the writer
+    volatile _Bool sampling;
+    uint32_t interval_usecs;
+    
+    alloc_pool_t *pool;
+    rb_tree *stacks; // hash -> profile_stack_t*
+    profile_stack_t *all;
+    uint64_t samples, idle_samples, unique;
+};
+
+#pragma mark Sampling
+
+static void* _profile_thread (void *arg)
+{
+    profiler_t *prof = (profiler_t*)arg;
+    shoe_ctx = prof->machine;
+    
+    while (prof->sampling) {
+        usleep(prof->interval_usecs);
+        
+        if (!shoe.running)
+            continue;
+        
+        // A STOPPED cpu won't reach an instruction boundary until the next interrupt
+        if (shoe.cpu_thread_notifications & SHOEBILL_STATE_STOPPED)
+            prof->idle_samples++;
+        else
+            __sync_fetch_and_or(&shoe.cpu_thread_notifications, SHOEBILL_STATE_PROFILE);
+    }
+    return NULL;
+}
+
+static uint32_t _hash_sample (const profile_stack_t *s)
+{
+    uint32_t i, hash = 2166136261u; // fnv-1a
+    
+    #define mix(v) do { hash = (hash ^ (v)) * 16777619u; } while (0)
+    mix(s->pid);
+    mix(s->atrap);
+    mix(s->supervisor);
+    for (i=0; i<s->depth; i++)
+        mix(s->pcs[i]);
+    #undef mix
+    
+    return hash;
+}
+
+static _Bool _same_sample (const profile_stack_t *a, const profile_stack_t *b)
+{
+    return (a->pid == b->pid) &&
+           (a->atrap == b->atrap) &&
+           (a->supervisor == b->supervisor) &&
+           (a->depth == b->depth) &&
+           (memcmp(a->pcs, b->pcs, a->depth * sizeof(uint32_t)) == 0);
+}
+
+/*
+ * Walk the a6 chain like the debugger's backtrace. The frame at a6 is
+ * (saved a6, return address), and callers' frames are at higher addresses.
+ */
+static void _unwind (profile_stack_t *s)
+{
+    const uint8_t fc = s->supervisor ? 5 : 1;
+    uint32_t a6 = shoe.a[6];
+    
+    s->pcs[0] = shoe.pc;
+    s->depth = 1;
+    
+    while (s->depth < PROFILE_MAX_DEPTH) {
+        uint64_t last_a6, last_pc;
+        
+        /*
+         * Only ever read RAM: a6 can point anywhere, including at I/O or
+         * nubus space (or at a logical page mapped there), and reads there
+         * have side effects. Sampling mustn't change what the guest sees.
+         */
+        if ((a6 == 0) || (a6 & 1) ||
+            !logical_peek_ram(a6, 4, fc, &last_a6) ||
+            !logical_peek_ram(a6 + 4, 4, fc, &last_pc) ||
+            (last_pc == 0))
+            break;
+        
+        s->pcs[s->depth++] = last_pc;
+        
+        if ((last_a6 <= a6) || ((last_a6 - a6) > PROFILE_MAX_FRAME_SIZE))
+            break;
+        a6 = last_a6;
+    }
+}
+
+/* The pid of the current A/UX process (out of the u area), if there is one */
+static uint32_t _current_pid (void)
+{
+    if (!shoe.coff || !_tc_enable())
+        return PROFILE_NO_PID;
+    
+    uint64_t u_proc_p, pid;
+    
+    if (!logical_peek_ram(0x1ff01000, 4, 5, &u_proc_p) || (u_proc_p == 0) ||
+        !logical_peek_ram(u_proc_p + 0x26, 2, 5, &pid))
+        return PROFILE_NO_PID;
+    
+    return pid;
+}
+
+/* Called from the CPU thread, between instructions, when SHOEBILL_STATE_PROFILE is set */
+void profile_sample (void)
+{
+    profiler_t *prof = shoe.profiler;
+    profile_stack_t sample, *s, *head = NULL;
+    
+    __sync_fetch_and_and(&shoe.cpu_thread_notifications, ~SHOEBILL_STATE_PROFILE);
+    if (prof == NULL)
+        return ;
+    
+    const _Bool old_abort = shoe.abort;
+    shoe.suppress_exceptions = 1;
+    shoe.abort = 0;
+    
+    sample.supervisor = sr_s();
+    sample.atrap = shoe.last_atrap;
+    sample.pid = _current_pid();
+    shoe.abort = 0;
+    _unwind(&sample);
+    
+    shoe.abort = old_abort;
+    shoe.suppress_exceptions = 0;
+    
+    const uint32_t hash = _hash_sample(&sample);
+    
+    pthread_mutex_lock(&prof->lock);
+    
+    prof->samples++;
+    
+    rb_find(prof->stacks, hash, &head);
+    for (s = head; s; s = s->next_hash) {
+        if (_same_sample(s, &sample)) {
+            s->count++;
+            goto done;
+        }
+    }
+    
+    s = p_alloc(prof->pool, sizeof(profile_stack_t));
+    memcpy(s, &sample, sizeof(profile_stack_t));
+    s->count = 1;
+    s->next_hash = head;
+    s->next_all = prof->all;
+    prof->all = s;
+    prof->unique++;
+    rb_insert(prof->stacks, hash, &s, NULL);
+    
+done:
+    pthread_mutex_unlock(&prof->lock);
+}
+
+#pragma mark Symbolization
+
+/* See symbol_for_pc() */
+static void _write_frame (FILE *f, uint32_t pc, _Bool supervisor)
+{
+    const _Bool in_rom = ((pc >> 28) == 4) || (!supervisor && ((pc >> 28) == 1));
+    uint32_t offset;
+    const char *name = symbol_for_pc(pc, supervisor, &offset);
+    
+    if (in_rom && name)
+        fprintf(f, ";rom:%s", name);
+    else if (in_rom)
+        fprintf(f, ";rom:0x%08x", pc);
+    else if (name)
+        fprintf(f, ";%s", name);
+    else
+        fprintf(f, ";0x%08x", pc);
+}
+
+static void _write_stack (FILE *f, const profile_stack_t *s)
+{
+    const uint32_t leaf = s->pcs[0];
+    const _Bool leaf_in_rom = ((leaf >> 28) == 4) || (!s->supervisor && ((leaf >> 28) == 1));
+    int32_t i;
+    
+    if (s->pid == PROFILE_NO_PID)
+        fprintf(f, "pid:?");
+    else
+        fprintf(f, "pid:%u", s->pid);
+    
+    fprintf(f, ";%s", s->supervisor ? "kernel" : "user");
+    
+    // Toolbox code in the ROM is most likely running on behalf of the last A-trap
+    if (leaf_in_rom && s->atrap) {
+        const char *name = atrap_names[s->atrap & 0xfff];
+        if (name)
+            fprintf(f, ";atrap:%s", name);
+        else
+            fprintf(f, ";atrap:0x%04x", s->atrap);
+    }
+    
+    for (i = s->depth - 1; i >= 0; i--)
+        _write_frame(f, s->pcs[i], s->supervisor);
+    
+    fprintf(f, " %llu\n", (unsigned long long)s->count);
+}
+
+#pragma mark Public interfaces
+
+uint32_t shoebill_profile_start (uint32_t hz)
+{
+    profiler_t *prof = shoe.profiler;
+    
+    if (prof == NULL) {
+        alloc_pool_t *pool = p_new_pool(NULL);
+        prof = p_alloc(pool, sizeof(profiler_t));
+        memset(prof, 0, sizeof(profiler_t));
+        prof->pool = pool;
+        prof->stacks = rb_new(pool, sizeof(profile_stack_t*));
+        prof->machine = shoebill_current_machine();
+        pthread_mutex_init(&prof->lock, NULL);
+        shoe.profiler = prof;
+    }
+    
+    if (prof->sampling)
+        return 1;
+    
+    // Not a round number, so we don't sample in lockstep with the 60hz timer
+    prof->interval_usecs = 1000000 / (hz ? hz : 997);
+    prof->sampling = 1;
+    
+    if (pthread_create(&prof->threadid, NULL, _profile_thread, prof) != 0) {
+        prof->sampling = 0;
+        return 0;
+    }
+    return 1;
+}
+
+void shoebill_profile_stop (void)
+{
+    profiler_t *prof = shoe.profiler;
+    
+    if (!prof || !prof->sampling)
+        return ;
+    
+    prof->sampling = 0;
+    pthread_join(prof->threadid, NULL);
+    __sync_fetch_and_and(&shoe.cpu_thread_notifications, ~SHOEBILL_STATE_PROFILE);
+}
+
+uint32_t shoebill_profile_write (const char *path)
+{
+    profiler_t *prof = shoe.profiler;
+    profile_stack_t *s;
+    FILE *f;
+    
+    if (prof == NULL)
+        return 0;
+    
+    f = fopen(path, "w");
+    if (f == NULL) {
+        slog("profile: can't open %s for writing\n", path);
+        return 0;
+    }
+    
+    pthread_mutex_lock(&prof->lock);
+    for (s = prof->all; s; s = s->next_all)
+        _write_stack(f, s);
+    pthread_mutex_unlock(&prof->lock);
+    
+    if (prof->idle_samples)
+        fprintf(f, "idle %llu\n", (unsigned long long)prof->idle_samples);
+    
+    slog("profile: wrote %llu samples (%llu unique stacks, %llu idle) to %s\n",
+         (unsigned long long)prof->samples, (unsigned long long)prof->unique,
+         (unsigned long long)prof->idle_samples, path);
+    
+    return fclose(f) == 0;
+}
+
+void profile_free (profiler_t *prof)
+{
+    if (prof == NULL)
+        return ;
+    assert(!prof->sampling);
+    pthread_mutex_destroy(&prof->lock);
+    p_free_pool(prof->pool);
+}
@@ -0,0 +1,503 @@
+/*
+ * Copyright (c) 2014, Peter Rutenbar <pruten@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Record/replay of the machine's external inputs. Everything the guest sees
+ * that doesn't follow from its own state comes either from another thread
+ * (the VIA clock thread's timer and VBL interrupts, ADB input from the front
+ * end, the ethernet threads' packets) or from the host's clock (VIA timer 2's
+ * counter, the RTC).
+ *
+ * While recording, those threads hand their events to replay_post() instead
+ * of touching the machine, and the CPU thread applies them between
+ * instructions, in replay_poll(), logging each one with the instruction count
+ * it was applied at. Clock reads are logged with the value they returned.
+ *
+ * While replaying, the threads' events are dropped, and replay_poll() applies
+ * the logged ones at the same instruction counts (and replay_value() returns
+ * the logged clock reads), so instruction counts stand in for time: the guest
+ * runs exactly as it did while recording, and doesn't sit out its idle time.
+ * If the guest ever strays from the log, or the log runs out, the machine
+ * carries on live.
+ *
+ * A recording is a gzip'd replay_header_t followed by replay_event_t's, each
+ * followed by len bytes of data. A replay has to start from the machine the
+ * recording started from: the same ROM, kernel and RAM size (or snapshot,
+ * the header checks RAM), and disk images as they were when recording
+ * started - replaying writes to the disks, so replay against copies.
+ * PRAM comes from the log.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <zlib.h>
+#include "shoebill.h"
+
+#define REPLAY_MAGIC "SHOERPLY"
+#define REPLAY_VERSION 1
+#define REPLAY_MAX_DATA 4096
+
+// When, within an instruction count, an event happened
+enum {
+    REPLAY_PHASE_VALUE, // during the instruction (clock reads)
+    REPLAY_PHASE_STOPPED, // while the CPU sat in STOP after it
+    REPLAY_PHASE_STEP, // just before the next instruction
+};
+
+enum {
+    REPLAY_RECORDING = 1,
+    REPLAY_REPLAYING,
+    REPLAY_DONE,
+};
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t ram_size;
+    uint32_t rom_checksum; // the checksum stored in the ROM's first long
+    uint32_t ram_crc; // RAM when recording started, to catch a replay starting from a different machine
+    uint32_t pc;
+    uint8_t pram[256];
+} replay_header_t;
+
+typedef struct {
+    uint64_t icount; // instructions since recording started
+    int32_t x, y;
+    uint16_t len; // bytes of data after the event
+    uint8_t type, phase;
+    uint8_t a, b;
+    uint8_t unused[2];
+} replay_event_t;
+
+typedef struct {
+    replay_event_t ev;
+    uint8_t *data;
+} replay_queued_t;
+
+struct _replayer_t {
+    volatile uint8_t mode;
+    gzFile f;
+    uint64_t base; // shoe.stats.instructions when recording/replaying started
+    uint64_t events;
+    
+    // Recording: events posted by other threads, for the CPU thread to apply
+    pthread_mutex_t lock;
+    replay_queued_t *queue;
+    volatile uint32_t queue_len;
+    uint32_t queue_max;
+    
+    // Replaying: the next event in the log
+    replay_event_t next;
+    uint8_t next_data[REPLAY_MAX_DATA];
+};
+
+/* Stop recording or replaying, and let the machine run on live. Call from the CPU thread, or with it paused */
+static void _stop (replayer_t *rp)
+{
+    uint32_t i;
+    
+    pthread_mutex_lock(&rp->lock);
+    rp->mode = REPLAY_DONE;
+    for (i=0; i < rp->queue_len; i++)
+        free(rp->queue[i].data);
+    free(rp->queue);
+    rp->queue = NULL;
+    rp->queue_len = rp->queue_max = 0;
+    pthread_mutex_unlock(&rp->lock);
+    
+    gzclose(rp->f);
+    rp->f = NULL;
+    
+    // rp itself stays in the pool, other threads may still be looking at it
+    __sync_fetch_and_and(&shoe.cpu_thread_notifications, ~SHOEBILL_STATE_REPLAY);
+    shoe.replayer = NULL;
+}
+
+static void _diverged (replayer_t *rp, const char *what)
+{
+    tp(TP_CORE, TP_ERROR, "replay: %s at instruction %llu (pc 0x%08x), the log expected event %u at %llu, running live",
+       what, shoe.stats.instructions - rp->base, shoe.pc, rp->next.type, rp->next.icount);
+    _stop(rp);
+}
+
+static void _apply (const replay_event_t *ev, const uint8_t *data)
+{
+    switch (ev->type) {
+        case REPLAY_EV_VIA_IRQ:
+            pthread_mutex_lock(&shoe.via_cpu_lock);
+            via_raise_interrupt(ev->a, ev->b);
+            pthread_mutex_unlock(&shoe.via_cpu_lock);
+            break;
+            
+        case REPLAY_EV_VBL:
+            pthread_mutex_lock(&shoe.via_cpu_lock);
+            nubus_vbl_interrupt(ev->a);
+            pthread_mutex_unlock(&shoe.via_cpu_lock);
+            break;
+            
+        // On the CPU thread, replay_post() lets these through
+        case REPLAY_EV_KEY:
+            shoebill_key(ev->a, ev->b);
+            break;
+            
+        case REPLAY_EV_KEY_MODIFIER:
+            shoebill_key_modifier(ev->a);
+            break;
+            
+        case REPLAY_EV_MOUSE_MOVE:
+            shoebill_mouse_move(ev->x, ev->y);
+            break;
+            
+        case REPLAY_EV_MOUSE_DELTA:
+            shoebill_mouse_move_delta(ev->x, ev->y);
+            break;
+            
+        case REPLAY_EV_MOUSE_CLICK:
+            shoebill_mouse_click(ev->a);
+            break;
+            
+        case REPLAY_EV_ETHERNET_RX:
+            nubus_ethernet_receive(ev->a, data, ev->len);
+            break;
+            
+        case REPLAY_EV_ETHERNET_TX:
+            nubus_ethernet_sent(ev->a);
+            break;
+    }
+}
+
+/* Append an event to the recording */
+static void _log (replayer_t *rp, const replay_event_t *ev, const uint8_t *data)
+{
+    if ((gzwrite(rp->f, ev, sizeof(replay_event_t)) != sizeof(replay_event_t)) ||
+        ((ev->len > 0) && (gzwrite(rp->f, data, ev->len) != ev->len))) {
+        tp(TP_CORE, TP_ERROR, "record: couldn't write the log, stopped at instruction %llu", ev->icount);
+        _stop(rp);
+        return ;
+    }
+    rp->events++;
+}
+
+/* Read the log's next event into rp->next. At the end of the log, replaying is over */
+static _Bool _read_next (replayer_t *rp)
+{
+    if ((gzread(rp->f, &rp->next, sizeof(replay_event_t)) != sizeof(replay_event_t)) ||
+        (rp->next.len > REPLAY_MAX_DATA) ||
+        ((rp->next.len > 0) && (gzread(rp->f, rp->next_data, rp->next.len) != rp->next.len))) {
+        tp(TP_CORE, TP_INFO, "replay: finished after %llu events at instruction %llu, running live",
+           rp->events, shoe.stats.instructions - rp->base);
+        _stop(rp);
+        return 0;
+    }
+    return 1;
+}
+
+#pragma mark Called by the other threads
+
+/*
+ * Hand an external event to the CPU thread. Returns 1 if the event was taken
+ * (recorded, or dropped while replaying), in which case the caller must not
+ * apply it itself. On the CPU thread, which is where events get applied,
+ * and when there's no recording or replay, it returns 0.
+ */
+_Bool replay_post (uint8_t type, uint8_t a, uint8_t b, int32_t x, int32_t y, const uint8_t *data, uint16_t len)
+{
+    replayer_t *rp = shoe.replayer;
+    replay_queued_t *q;
+    _Bool taken = 0, queued = 0;
+    
+    if slikely(rp == NULL)
+        return 0;
+    if (pthread_equal(pthread_self(), shoe.cpu_thread_pid))
+        return 0;
+    
+    pthread_mutex_lock(&rp->lock);
+    
+    if (rp->mode == REPLAY_REPLAYING)
+        taken = 1;
+    else if (rp->mode == REPLAY_RECORDING) {
+        if (rp->queue_len == rp->queue_max) {
+            const uint32_t max = rp->queue_max ? (rp->queue_max * 2) : 64;
+            replay_queued_t *grown = realloc(rp->queue, max * sizeof(replay_queued_t));
+            assert(grown);
+            rp->queue = grown;
+            rp->queue_max = max;
+        }
+        
+        q = &rp->queue[rp->queue_len];
+        memset(q, 0, sizeof(replay_queued_t));
+        q->ev.type = type;
+        q->ev.a = a;
+        q->ev.b = b;
+        q->ev.x = x;
+        q->ev.y = y;
+        q->ev.len = len;
+        if (len) {
+            q->data = malloc(len);
+            assert(q->data);
+            memcpy(q->data, data, len);
+        }
+        rp->queue_len++;
+        taken = queued = 1;
+    }
+    
+    pthread_mutex_unlock(&rp->lock);
+    
+    // The CPU thread picks up events between instructions, or when it wakes from STOP
+    if (queued && (shoe.cpu_thread_notifications & SHOEBILL_STATE_STOPPED))
+        unstop_cpu_thread();
+    
+    return taken;
+}
+
+/* While replaying, the machine's output (ethernet packets) goes nowhere */
+_Bool replay_replaying (void)
+{
+    replayer_t *rp = shoe.replayer;
+    return rp && (rp->mode == REPLAY_REPLAYING);
+}
+
+#pragma mark Called by the CPU thread
+
+/*
+ * A read of the host's clock returned value. While recording, log it, and
+ * while replaying, return the logged one instead.
+ */
+uint32_t replay_value (uint32_t value)
+{
+    replayer_t *rp = shoe.replayer;
+    replay_event_t ev;
+    
+    if (rp->mode == REPLAY_RECORDING) {
+        memset(&ev, 0, sizeof(ev));
+        ev.icount = shoe.stats.instructions - rp->base;
+        ev.type = REPLAY_EV_VALUE;
+        ev.phase = REPLAY_PHASE_VALUE;
+        ev.x = value;
+        _log(rp, &ev, NULL);
+    }
+    else if (rp->mode == REPLAY_REPLAYING) {
+        if ((rp->next.icount != (shoe.stats.instructions - rp->base)) ||
+            (rp->next.phase != REPLAY_PHASE_VALUE) ||
+            (rp->next.type != REPLAY_EV_VALUE)) {
+            _diverged(rp, "unexpected clock read");
+            return value;
+        }
+        value = rp->next.x;
+        rp->events++;
+        _read_next(rp);
+    }
+    
+    return value;
+}
+
+/*
+ * Apply the events due before the next instruction (or, if stopped is set,
+ * the ones that came in while the CPU is STOPped). Returns how many there were.
+ */
+uint32_t replay_poll (_Bool stopped)
+{
+    replayer_t *rp = shoe.replayer;
+    const uint64_t icount = shoe.stats.instructions - rp->base;
+    const uint8_t phase = stopped ? REPLAY_PHASE_STOPPED : REPLAY_PHASE_STEP;
+    replay_queued_t *queue;
+    uint32_t i, n = 0;
+    
+    if (rp->mode == REPLAY_RECORDING) {
+        if slikely(rp->queue_len == 0)
+            return 0;
+        
+        // Take the whole queue, posting threads may be holding locks that applying them needs
+        pthread_mutex_lock(&rp->lock);
+        queue = rp->queue;
+        n = rp->queue_len;
+        rp->queue = NULL;
+        rp->queue_len = rp->queue_max = 0;
+        pthread_mutex_unlock(&rp->lock);
+        
+        for (i=0; i<n; i++) {
+            queue[i].ev.icount = icount;
+            queue[i].ev.phase = phase;
+            if (shoe.replayer)
+                _log(rp, &queue[i].ev, queue[i].data);
+            _apply(&queue[i].ev, queue[i].data);
+            free(queue[i].data);
+        }
+        free(queue);
+        return n;
+    }
+    
+    if (rp->mode != REPLAY_REPLAYING)
+        return 0;
+    
+    while ((rp->next.icount == icount) && (rp->next.phase == phase)) {
+        _apply(&rp->next, rp->next_data);
+        rp->events++;
+        n++;
+        if (!_read_next(rp))
+            return n;
+    }
+    
+    /*
+     * If the log's next event should already have happened, the guest has
+     * strayed from the recording. And while recording, the CPU only left STOP
+     * because of an event, so if none is due now, it never will be.
+     */
+    if ((rp->next.icount < icount) ||
+        ((rp->next.icount == icount) && (rp->next.phase < phase)) ||
+        (stopped && (n == 0)))
+        _diverged(rp, stopped ? "stopped with nothing to wake up for" : "missed an event");
+    
+    return n;
+}
+
+#pragma mark API
+
+static _Bool _can_start (char *error_msg)
+{
+    if (shoe.running) {
+        sprintf(error_msg, "Recording and replaying have to start before shoebill_start()\n");
+        return 0;
+    }
+    if (shoe.config_copy.debug_mode) {
+        sprintf(error_msg, "Can't record or replay in debug mode\n");
+        return 0;
+    }
+    if (shoe.replayer) {
+        sprintf(error_msg, "Already recording or replaying\n");
+        return 0;
+    }
+    return 1;
+}
+
+static void _fill_header (replay_header_t *header)
+{
+    memset(header, 0, sizeof(replay_header_t));
+    memcpy(header->magic, REPLAY_MAGIC, 8);
+    header->version = REPLAY_VERSION;
+    header->ram_size = shoe.physical_mem_size;
+    header->rom_checksum = ntohl(*(uint32_t*)shoe.physical_rom_base);
+    header->ram_crc = crc32(0, shoe.physical_mem_base, shoe.physical_mem_size);
+    header->pc = shoe.pc;
+    memcpy(header->pram, shoe.pram.data, 256);
+}
+
+static void _start (gzFile f, uint8_t mode)
+{
+    replayer_t *rp = p_calloc(shoe.pool, replayer_t, 1);
+    
+    rp->mode = mode;
+    rp->f = f;
+    rp->base = shoe.stats.instructions;
+    pthread_mutex_init(&rp->lock, NULL);
+    
+    shoe.replayer = rp;
+    __sync_fetch_and_or(&shoe.cpu_thread_notifications, SHOEBILL_STATE_REPLAY);
+}
+
+uint32_t shoebill_record_start(const char *path, char *error_msg)
+{
+    replay_header_t header;
+    gzFile f;
+    
+    if (!_can_start(error_msg))
+        return 0;
+    
+    f = gzopen(path, "wb1");
+    if (f == NULL) {
+        sprintf(error_msg, "Couldn't open recording [%s] for writing\n", path);
+        return 0;
+    }
+    
+    _fill_header(&header);
+    if (gzwrite(f, &header, sizeof(header)) != sizeof(header)) {
+        sprintf(error_msg, "Couldn't write recording [%s]\n", path);
+        gzclose(f);
+        return 0;
+    }
+    
+    _start(f, REPLAY_RECORDING);
+    return 1;
+}
+
+uint32_t shoebill_replay_start(const char *path, char *error_msg)
+{
+    replay_header_t header, expected;
+    gzFile f;
+    
+    if (!_can_start(error_msg))
+        return 0;
+    
+    f = gzopen(path, "rb");
+    if (f == NULL) {
+        sprintf(error_msg, "Couldn't open recording [%s]\n", path);
+        return 0;
+    }
+    
+    if ((gzread(f, &header, sizeof(header)) != sizeof(header)) ||
+        (memcmp(header.magic, REPLAY_MAGIC, 8) != 0) ||
+        (header.version != REPLAY_VERSION)) {
+        sprintf(error_msg, "[%s] isn't a shoebill recording\n", path);
+        gzclose(f);
+        return 0;
+    }
+    
+    // The log has its own PRAM, the rest has to match
+    _fill_header(&expected);
+    if ((header.ram_size != expected.ram_size) ||
+        (header.rom_checksum != expected.rom_checksum) ||
+        (header.ram_crc != expected.ram_crc) ||
+        (header.pc != expected.pc)) {
+        sprintf(error_msg, "Recording [%s] started from a different machine (ROM, RAM size, kernel or snapshot)\n", path);
+        gzclose(f);
+        return 0;
+    }
+    memcpy(shoe.pram.data, header.pram, 256);
+    
+    _start(f, REPLAY_REPLAYING);
+    _read_next(shoe.replayer);
+    return 1;
+}
+
+void shoebill_record_stop(void)
+{
+    replayer_t *rp;
+    
+    if (shoe.replayer == NULL)
+        return ;
+    
+    pause_cpu_thread();
+    rp = shoe.replayer;
+    if (rp) {
+        if (rp->mode == REPLAY_RECORDING)
+            tp(TP_CORE, TP_INFO, "record: stopped after %llu events at instruction %llu",
+               rp->events, shoe.stats.instructions - rp->base);
+        _stop(rp);
+    }
+    resume_cpu_thread();
+}
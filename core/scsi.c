@@ -105,6 +105,46 @@ const char *scsi_write_reg_str[8] = {
 static void scsi_raise_irq() {via_raise_interrupt(2, IFR_CB2);}
 static void scsi_raise_drq() {via_raise_interrupt(2, IFR_CA2);}
 
+#define overlay_has(dev, block) ((dev)->overlay_map[(block) >> 3] & (1 << ((block) & 7)))
+
+/*
+ * Read/write count 512-byte blocks. When the device has an overlay (cloned
+ * machines do), writes go to the overlay, and reads pick up whichever blocks
+ * have been written there since.
+ */
+static void _disk_read (scsi_device_t *dev, uint32_t block, uint32_t count, uint8_t *buf)
+{
+    uint32_t i;
+    
+    assert(0 == fseeko(dev->f, 512 * (off_t)block, SEEK_SET));
+    assert(fread(buf, count * 512, 1, dev->f) == 1);
+    
+    if slikely(dev->overlay == NULL)
+        return ;
+    
+    for (i=0; i<count; i++) {
+        if (overlay_has(dev, block + i)) {
+            assert(0 == fseeko(dev->overlay, 512 * (off_t)(block + i), SEEK_SET));
+            assert(fread(&buf[i * 512], 512, 1, dev->overlay) == 1);
+        }
+    }
+}
+
+static void _disk_write (scsi_device_t *dev, uint32_t block, uint32_t count, const uint8_t *buf)
+{
+    FILE *f = dev->overlay ? dev->overlay : dev->f;
+    uint32_t i;
+    
+    assert(0 == fseeko(f, 512 * (off_t)block, SEEK_SET));
+    assert(fwrite(buf, count * 512, 1, f) == 1);
+    fflush(f);
+    
+    if (dev->overlay) {
+        for (i=0; i<count; i++)
+            dev->overlay_map[(block + i) >> 3] |= 1 << ((block + i) & 7);
+    }
+}
+
 static _Bool phase_match (void)
 {
     uint8_t phase_tmp = shoe.scsi.msg;
@@ -115,7 +155,7 @@ static _Bool phase_match (void)
 
 static void switch_status_phase (uint8_t status_byte)
 {
-    slog("scsi_reg_something: switching to STATUS phase\n");
+    tp(TP_SCSI, TP_DEBUG, "scsi: switching to STATUS phase (status 0x%02x)", status_byte);
     
     shoe.scsi.phase = STATUS;
     shoe.scsi.status_byte = status_byte;
@@ -131,7 +171,7 @@ static void switch_status_phase (uint8_t status_byte)
 
 static void switch_command_phase (void)
 {
-    slog("scsi_reg_something: switching to COMMAND phase\n");
+    tp(TP_SCSI, TP_DEBUG, "scsi: switching to COMMAND phase");
     shoe.scsi.phase = COMMAND;
     
     shoe.scsi.msg = 0;
@@ -146,7 +186,7 @@ static void switch_command_phase (void)
 
 static void switch_message_in_phase (uint8_t message_byte)
 {
-    slog("scsi_reg_something: switching to MESSAGE_IN phase\n");
+    tp(TP_SCSI, TP_DEBUG, "scsi: switching to MESSAGE_IN phase (message 0x%02x)", message_byte);
     
     shoe.scsi.phase = MESSAGE_IN;
     shoe.scsi.msg = 1;
@@ -161,7 +201,7 @@ static void switch_message_in_phase (uint8_t message_byte)
 
 static void switch_bus_free_phase (void)
 {
-    slog("scsi_reg_something: switching to BUS_FREE phase\n");
+    tp(TP_SCSI, TP_DEBUG, "scsi: switching to BUS_FREE phase");
     
     shoe.scsi.phase = BUS_FREE;
     
@@ -178,7 +218,7 @@ static void switch_bus_free_phase (void)
 
 static void switch_data_in_phase (void)
 {
-    slog("scsi_reg_something: switching to DATA_IN phase\n");
+    tp(TP_SCSI, TP_DEBUG, "scsi: switching to DATA_IN phase");
     
     shoe.scsi.phase = DATA_IN;
     
@@ -192,7 +232,7 @@ static void switch_data_in_phase (void)
 
 static void switch_data_out_phase (void)
 {
-    slog("scsi_reg_something: switching to DATA_OUT phase\n");
+    tp(TP_SCSI, TP_DEBUG, "scsi: switching to DATA_OUT phase");
     
     shoe.scsi.phase = DATA_OUT;
 
@@ -304,9 +344,12 @@ static void scsi_buf_set (uint8_t byte)
             return ;
         }
         
+        // The data phase may overwrite buf[0]
+        const uint8_t opcode = shoe.scsi.buf[0];
+        
         switch (shoe.scsi.buf[0]) {
             case 0: // test unit ready (6)
-                slog("scsi_buf_set: responding to test-unit-ready\n");
+                tp(TP_SCSI, TP_INFO, "scsi: target %u test-unit-ready", shoe.scsi.target_id);
                 switch_status_phase(0); // switch to the status phase, with a status byte of 0
                 break;
                 
@@ -329,7 +372,7 @@ static void scsi_buf_set (uint8_t byte)
                 
                 assert(dev->f);
                 
-                slog("scsi_buf_set: Responding to read at off=%u len=%u\n", offset, len);
+                tp(TP_SCSI, TP_INFO, "scsi: target %u read off=%u len=%u", shoe.scsi.target_id, offset, len);
                 
                 //assert(len <= 64);
                 
@@ -340,8 +383,7 @@ static void scsi_buf_set (uint8_t byte)
                     break;
                 }
                 
-                assert(0 == fseeko(dev->f, 512 * offset, SEEK_SET));
-                assert(fread(shoe.scsi.buf, len * 512, 1, dev->f) == 1);
+                _disk_read(dev, offset, len, shoe.scsi.buf);
                 
                 
                 shoe.scsi.in_len = len * 512;
@@ -358,7 +400,7 @@ static void scsi_buf_set (uint8_t byte)
                 (shoe.scsi.buf[3]);
                 const uint16_t len = (shoe.scsi.buf[4]==0) ? 0x100 : shoe.scsi.buf[4]; // len==0 -> 256 sectors
                 
-                slog("scsi_buf_set: Responding to write at off=%u len=%u\n", offset, len);
+                tp(TP_SCSI, TP_INFO, "scsi: target %u write off=%u len=%u", shoe.scsi.target_id, offset, len);
                 
                 //assert(len <= 64);
                 
@@ -372,7 +414,7 @@ static void scsi_buf_set (uint8_t byte)
             }
             
             case 0x12: { // inquiry command (6)
-                slog("scsi_buf_set: responding to inquiry\n");
+                tp(TP_SCSI, TP_INFO, "scsi: target %u inquiry", shoe.scsi.target_id);
                 const uint8_t alloc_len = shoe.scsi.buf[4];
                 
                 scsi_handle_inquiry_command(alloc_len);
@@ -380,7 +422,7 @@ static void scsi_buf_set (uint8_t byte)
             }
                 
             case 0x15: // mode select (6)
-                slog("scsi_buf_set: responding to mode-select\n");
+                tp(TP_SCSI, TP_INFO, "scsi: target %u mode-select", shoe.scsi.target_id);
                 switch_status_phase(0);
                 break;
                 
@@ -392,7 +434,7 @@ static void scsi_buf_set (uint8_t byte)
                 const uint8_t alloc_len = shoe.scsi.buf[4];
                 const uint8_t control = shoe.scsi.buf[6];
                 
-                slog("scsi_bug_set: responding to mode-sense\n");
+                tp(TP_SCSI, TP_INFO, "scsi: target %u mode-sense page_code=%u", shoe.scsi.target_id, page_code);
                 slog("dbd=%u pc=%u page_code=%u subpage_code=%u alloc_len=%u control=%u\n",
                      dbd, pc, page_code, subpage_code, alloc_len, control);
                 
@@ -402,7 +444,7 @@ static void scsi_buf_set (uint8_t byte)
             }
                 
             case 0x25: // read capacity (10)
-                slog("scsi_buf_set: responding to read-capacity\n");
+                tp(TP_SCSI, TP_INFO, "scsi: target %u read-capacity", shoe.scsi.target_id);
                 // bytes [0,3] -> BE number of blocks
                 shoe.scsi.buf[0] = (dev->num_blocks >> 24) & 0xff;
                 shoe.scsi.buf[1] = (dev->num_blocks >> 16) & 0xff;
@@ -437,6 +479,9 @@ static void scsi_buf_set (uint8_t byte)
                 break;
         }
         
+        shoe.stats.scsi_commands[opcode]++;
+        shoe.stats.scsi_bytes[opcode] += shoe.scsi.in_len + shoe.scsi.out_len;
+        
         shoe.scsi.bufi = 0;
     }
 }
@@ -584,7 +629,7 @@ void scsi_reg_write ()
                 for (id=0; (id < 8) && !(shoe.scsi.data & (1 << id)); id++) ;
                 assert(id != 8);
                 shoe.scsi.target_id = id;
-                slog("scsi_reg_write: selected target id %u\n", id);
+                tp(TP_SCSI, TP_DEBUG, "scsi: selected target id %u", id);
                 
                 if (shoe.scsi_devices[shoe.scsi.target_id].f == NULL) {
                     shoe.scsi.phase = BUS_FREE;
@@ -598,7 +643,7 @@ void scsi_reg_write ()
             
             // SELECTION ends when SEL gets unset
             if (!shoe.scsi.sel && shoe.scsi.phase == SELECTION) {
-                slog("scsi_reg_write: switch to COMMAND phase\n"); // what's next?
+                tp(TP_SCSI, TP_DEBUG, "scsi: switching to COMMAND phase"); // what's next?
                 
                 shoe.scsi.req = 1; // target asserts REQ after initiator deasserts SEL
                 
@@ -643,7 +688,7 @@ void scsi_reg_write ()
             shoe.scsi.mode = dat;
             
             if (shoe.scsi.mode & MODE_ARBITRATE) {
-                slog("scsi_reg_write: arbitration phase\n");
+                tp(TP_SCSI, TP_DEBUG, "scsi: arbitration phase");
                 shoe.scsi.phase = ARBITRATION;
                 shoe.scsi.initiator_command |= INIT_COMM_ARBITRATION_IN_PROGRESS;
             }
@@ -674,7 +719,7 @@ void scsi_reg_write ()
             break;
     }
     
-    slog("\nscsi_reg_write: writing to register %s(%u) (0x%x)\n\n", scsi_write_reg_str[reg], reg, dat);
+    tp(TP_SCSI, TP_DEBUG, "scsi: wrote register %s(%u) = 0x%x", scsi_write_reg_str[reg], reg, dat);
 }
 
 void scsi_dma_write_long(const uint32_t dat)
@@ -688,7 +733,7 @@ void scsi_dma_write_long(const uint32_t dat)
 void scsi_dma_write (const uint8_t byte)
 {
     if (shoe.scsi.phase == COMMAND) {
-        slog("scsi_reg_dma_write: writing COMMAND byte 0x%02x\n", byte);
+        tp(TP_SCSI, TP_DEBUG, "scsi: dma wrote COMMAND byte 0x%02x", byte);
         scsi_buf_set(byte);
     }
     else if (shoe.scsi.phase == DATA_OUT && shoe.scsi.dma_send_written) {
@@ -701,9 +746,7 @@ void scsi_dma_write (const uint8_t byte)
             scsi_device_t *dev = &shoe.scsi_devices[shoe.scsi.target_id];
             assert(dev->f);
             
-            assert(0 == fseeko(dev->f, 512 * shoe.scsi.write_offset, SEEK_SET));
-            assert(fwrite(shoe.scsi.buf, shoe.scsi.out_len, 1, dev->f) == 1);
-            fflush(dev->f);
+            _disk_write(dev, shoe.scsi.write_offset, shoe.scsi.out_len / 512, shoe.scsi.buf);
             
             shoe.scsi.out_i = 0;
             shoe.scsi.out_len = 0;
@@ -711,10 +754,11 @@ void scsi_dma_write (const uint8_t byte)
         }
     }
     else if (shoe.scsi.phase == DATA_OUT) {
-        slog("scsi_reg_dma_write: writing DATA_OUT byte (without shoe.scsi.dma_send_written) 0x%02x\n", byte);
+        // A/UX 1.1.1 always writes one of these, so it isn't an error
+        tp(TP_SCSI, TP_DEBUG, "scsi: dma wrote DATA_OUT byte 0x%02x before start_dma_send", byte);
     }
     else {
-        slog("scsi_reg_dma_write: writing 0x%02x in UNKNOWN PHASE!\n", byte);
+        tp(TP_SCSI, TP_ERROR, "scsi: dma wrote 0x%02x in unexpected phase %u", byte, shoe.scsi.phase);
     }
     
 }
@@ -30,6 +30,7 @@
 #include <time.h>
 #include <stdint.h> 
 #include <sys/time.h>
+#include <sys/types.h>
 #include <pthread.h>
 
 
@@ -138,7 +139,48 @@ typedef struct {
     uint16_t width, height, scan_width, depth;
 } shoebill_video_frame_info_t;
 
-/* Take a shoebill_config_t structure and configure the global emulator context */
+/*
+ * Running counters, cheap enough to always keep. Most have a single writer
+ * thread (usually the CPU thread), so they're just plain integers. The ones
+ * bumped from several threads (ethernet_packets_in, ethernet_drops and
+ * frames_converted) are incremented with relaxed atomics.
+ */
+typedef struct {
+    uint64_t instructions; // instructions started by cpu_step()
+    uint64_t stopped_usecs; // wall time the CPU thread spent STOPPED, waiting for an interrupt
+    uint64_t exceptions[256]; // exceptions taken, by vector number (not including interrupts)
+    uint64_t interrupts[8]; // interrupts taken, by priority level
+    uint64_t atc_lookups, atc_misses; // pmmu_cache probes by logical_get/set/pccache, and misses
+    uint64_t table_walks; // page table searches (atc_misses, plus ptest)
+    uint64_t pccache_misses;
+    uint64_t pflushes;
+    uint64_t scsi_commands[256], scsi_bytes[256]; // by SCSI opcode
+    uint64_t via_reads, via_writes; // VIA1 and VIA2 register accesses
+    uint64_t slot_reads[16], slot_writes[16]; // NuBus accesses, by slot
+    uint64_t ethernet_packets_in, ethernet_packets_out, ethernet_drops;
+    uint64_t frames_converted; // get_video_frame() calls that had to translate anything
+} shoebill_stats_t;
+
+/*
+ * Each emulated machine lives in its own context. Every shoebill_* call below
+ * operates on the calling thread's current machine, and the threads a machine
+ * starts inherit it. A default machine is current on every thread until
+ * shoebill_set_machine() is called, so single-machine front ends can ignore this.
+ */
+typedef struct _shoebill_machine_t shoebill_machine_t;
+
+/* Allocate a new, empty machine (doesn't make it current) */
+shoebill_machine_t* shoebill_new_machine(void);
+
+/* Make machine current for the calling thread (NULL selects the default machine) */
+void shoebill_set_machine(shoebill_machine_t *machine);
+
+shoebill_machine_t* shoebill_current_machine(void);
+
+/* Free a machine allocated by shoebill_new_machine(). Call shoebill_stop() on it first. */
+void shoebill_free_machine(shoebill_machine_t *machine);
+
+/* Take a shoebill_config_t structure and configure the current machine */
 uint32_t shoebill_initialize(shoebill_config_t *params);
 
 void shoebill_restart (void);
@@ -152,11 +194,102 @@ uint32_t shoebill_install_tfb_card(shoebill_config_t *config, uint8_t slotnum);
 /* Call this after shoebill_initialize() to add an ethernet card */
 uint32_t shoebill_install_ethernet_card(shoebill_config_t *config, uint8_t slotnum, uint8_t ethernet_addr[6], int tap_fd);
 
-/* Get a video frame from a particular video card */
+/* Write the whole machine to a snapshot file (see snapshot.c) */
+uint32_t shoebill_save_state(const char *path, char *error_msg);
+
+/* Call instead of shoebill_initialize() and shoebill_install_*_card() to resume from a snapshot */
+uint32_t shoebill_load_state(shoebill_config_t *config, const char *path);
+
+/*
+ * Write incremental checkpoints to a log at path every interval_secs seconds
+ * (0 for the default) on a background thread, and resume from the last
+ * complete one like shoebill_load_state() (see snapshot.c)
+ */
+uint32_t shoebill_checkpoint_start(const char *path, uint32_t interval_secs, char *error_msg);
+void shoebill_checkpoint_stop(void);
+uint32_t shoebill_load_checkpoint(shoebill_config_t *config, const char *path);
+
+/*
+ * Fork the running machine into n copy-on-write children (see clone.c).
+ * Returns 0 in the parent, 1 through n in the children, -1 on failure.
+ * Children don't inherit checkpointing, they have to start their own.
+ */
+int32_t shoebill_clone(uint32_t n, const char *overlay_dir, pid_t *pids);
+
+/*
+ * Get a video frame from a particular video card.
+ * VBL interrupts are generated by the core at the card's refresh rate,
+ * so front ends are free to call this as often (or rarely) as they like.
+ */
 shoebill_video_frame_info_t shoebill_get_video_frame(uint8_t slotnum, _Bool just_params);
 
-/* Call this after rendering a video frame to send a VBL interrupt */
-void shoebill_send_vbl_interrupt(uint8_t slotnum);
+/*
+ * Deprecated, and does nothing: the core sends VBL interrupts itself now.
+ * Front ends that used to call it after every frame can just stop.
+ */
+void shoebill_send_vbl_interrupt(uint8_t slotnum) __attribute__((deprecated));
+
+/* Serve changed tiles of slotnum's frames on "unix:<path>" or "tcp:<port>" (see fb_server.c) */
+uint32_t shoebill_start_fb_server(uint8_t slotnum, const char *address, uint32_t fps);
+
+/* Copy out the current machine's counters */
+void shoebill_get_stats(shoebill_stats_t *stats);
+
+/*
+ * Sample the guest's pc/stack hz times a second (0 for the default), and write
+ * the samples out as folded stacks for flame graphs (see profiler.c).
+ * Samples accumulate across start/stop.
+ */
+uint32_t shoebill_profile_start(uint32_t hz);
+void shoebill_profile_stop(void);
+uint32_t shoebill_profile_write(const char *path);
+
+/* Write the opcode/EA-mode histogram, if built with SHOEBILL_OP_HISTOGRAM (see histogram.c) */
+uint32_t shoebill_write_histogram(const char *path);
+
+/* Stream a binary execution trace to path, optionally gzip'd (see trace.c) */
+uint32_t shoebill_trace_start(const char *path, _Bool compress, _Bool memory);
+void shoebill_trace_stop(void);
+
+/* Write every thread's tracepoint ring, oldest record first, to path (stderr if NULL) (see tracepoint.c) */
+uint32_t shoebill_tracepoint_dump(const char *path);
+
+/*
+ * Record the machine's external inputs (timer interrupts, ADB input, ethernet
+ * packets, clock reads) to path, or replay a recording, which reproduces the
+ * recorded run instruction for instruction (see replay.c). Call either between
+ * shoebill_initialize() (or shoebill_load_state()) and shoebill_start(). A
+ * replay has to start from the same machine and disk images the recording did.
+ * shoebill_record_stop() ends recording or replaying, and the machine runs on live.
+ */
+uint32_t shoebill_record_start(const char *path, char *error_msg);
+uint32_t shoebill_replay_start(const char *path, char *error_msg);
+void shoebill_record_stop(void);
+
+/*
+ * Watch guest (logical) accesses to [addr, addr+size) (see mem.c).
+ * When one hits, SHOEBILL_STATE_WATCH is raised after the instruction
+ * finishes, and the details are left in the machine's watch_hit.
+ * shoebill_watch_add() returns the watchpoint's number, or -1 if full.
+ */
+#define SHOEBILL_WATCH_READ 1
+#define SHOEBILL_WATCH_WRITE 2
+int32_t shoebill_watch_add(uint32_t addr, uint32_t size, uint8_t type);
+uint32_t shoebill_watch_remove(uint32_t num);
+
+/*
+ * Track which pages of guest RAM get written (see mem.c). The dirty map has
+ * one byte per SHOEBILL_DIRTY_PAGE_SIZE page of physical RAM, starting at 0.
+ * shoebill_dirty_collect() copies the map into out (shoebill_dirty_map_len()
+ * bytes, may be NULL), clears it, and returns how many pages were dirty.
+ * It works while the machine runs: copy the pages after collecting, and
+ * anything written since shows up dirty in the next collection.
+ */
+#define SHOEBILL_DIRTY_PAGE_SHIFT 12
+#define SHOEBILL_DIRTY_PAGE_SIZE (1 << SHOEBILL_DIRTY_PAGE_SHIFT)
+void shoebill_dirty_enable(_Bool enable);
+uint32_t shoebill_dirty_map_len(void);
+uint32_t shoebill_dirty_collect(uint8_t *out);
 
 /* Call to validate input pram and zap if invalid */
 void shoebill_validate_or_zap_pram(uint8_t *pram, _Bool forcezap);
@@ -182,10 +315,66 @@ void shoebill_mouse_click(uint8_t down);
 void shoebill_start();
 void shoebill_stop();
 
-void slog(const char *fmt, ...);
+/*
+ * slog() is the old printf-style debug log. It compiles to nothing unless
+ * built with SHOEBILL_SLOG=1, so its callers don't pay for their arguments.
+ */
+#ifndef SHOEBILL_SLOG
+#define SHOEBILL_SLOG 0
+#endif
+void _slog(const char *fmt, ...);
+#define slog(...) do { if (SHOEBILL_SLOG) _slog(__VA_ARGS__); } while (0)
+
+/*
+ * Tracepoints (see tracepoint.c)
+ * tp(category, level, fmt, ...) appends a fixed-size record (the time, fmt,
+ * and up to TP_MAX_ARGS integer or static-string arguments) to the calling
+ * thread's ring. fmt is only formatted when the rings are dumped.
+ * Tracepoints above SHOEBILL_TP_LEVEL, or outside SHOEBILL_TP_CATEGORIES,
+ * compile to nothing, arguments and all.
+ */
+#define TP_CORE (1 << 0)
+#define TP_CPU (1 << 1)
+#define TP_MEM (1 << 2)
+#define TP_INTERRUPT (1 << 3)
+#define TP_SCSI (1 << 4)
+#define TP_ETHERNET (1 << 5)
+#define TP_ADB (1 << 6)
+#define TP_VIDEO (1 << 7)
+
+#define TP_ERROR 1
+#define TP_INFO 2
+#define TP_DEBUG 3
+
+#ifndef SHOEBILL_TP_LEVEL
+#define SHOEBILL_TP_LEVEL TP_ERROR
+#endif
+#ifndef SHOEBILL_TP_CATEGORIES
+#define SHOEBILL_TP_CATEGORIES 0xffffffff
+#endif
+
+#define TP_MAX_ARGS 5
+void tp_record(uint32_t category, uint32_t level, const char *fmt,
+               uint64_t a, uint64_t b, uint64_t c, uint64_t d, uint64_t e);
+void tp_lock_rings(void);
+void tp_unlock_rings(void);
+#define tp(category, level, ...) do { \
+    if (((level) <= SHOEBILL_TP_LEVEL) && ((category) & SHOEBILL_TP_CATEGORIES)) \
+        _tp_args((category), (level), __VA_ARGS__, 0, 0, 0, 0, 0, 0); \
+} while (0)
+#define _tp_args(category, level, fmt, a, b, c, d, e, ...) \
+    tp_record((category), (level), (fmt), (uint64_t)(a), (uint64_t)(b), (uint64_t)(c), (uint64_t)(d), (uint64_t)(e))
 
 uint8_t* shoebill_extract_kernel(const char *disk_path, const char *kernel_path, char *error_str, uint32_t *len);
 
+/* Identifies an A/UX kernel on a disk image without reading it in */
+typedef struct {
+    uint64_t dev, ino; // the disk image on the host
+    uint32_t size, mtime, ctime; // the kernel's inode in the guest filesystem
+    uint32_t addrs[15]; // and its block list
+} shoebill_kernel_id_t;
+uint8_t shoebill_identify_kernel(const char *disk_path, const char *kernel_path, char *error_str, shoebill_kernel_id_t *id);
+
 
 
 /*
@@ -299,26 +488,23 @@ uint8_t* shoebill_extract_kernel(const char *disk_path, const char *kernel_path,
  */
 #define POOL_START_MAGIC 0x231eb4af
 #define POOL_END_MAGIC 0xb09f39f1
-#define POOL_ALLOC_TYPE 0
-#define POOL_CHILD_LINK 1
-#define POOL_HEAD 2
+#define POOL_SIZE_CLASSES 36 // 16-byte steps up to 512, then powers of two up to POOL_MAX_SMALL
+#define POOL_MAX_SMALL 8192 // bigger allocations come straight from calloc()
+
+struct _pool_chunk_t;
+struct _pool_large_t;
+
 typedef struct _alloc_pool_t {
     uint32_t start_magic;
-    struct _alloc_pool_t *prev, *next;
-
-    union {
-        struct {
-            size_t size;
-        } alloc;
-        struct {
-            struct _alloc_pool_t *child; // pointer to the child's HEAD
-        } child_link;
-        struct {
-            struct _alloc_pool_t *parent_link; // pointer to the parent's CHILD_LINK
-        } head;
-    } t;
+    struct _alloc_pool_t *parent, *children, *prev_sibling, *next_sibling;
+    
+    struct _pool_chunk_t *chunks; // the arena, newest chunk first
+    uint8_t *bump, *bump_end; // unused space in the newest chunk
+    uint32_t next_chunk_size;
+    
+    void *free_lists[POOL_SIZE_CLASSES]; // p_free()'d small allocations, by size class
+    struct _pool_large_t *large; // allocations bigger than POOL_MAX_SMALL
     
-    uint32_t type;
     uint32_t end_magic;
 } alloc_pool_t;
 
@@ -358,6 +544,44 @@ uint8_t rb_find (rb_tree *tree, rb_key_t key, void *value);
 uint8_t rb_index (rb_tree *tree, uint32_t index, rb_key_t *key, void *value);
 uint32_t rb_count (rb_tree *tree);
 
+/*
+ * symbols.c
+ */
+
+#define SYMBOL_ADDR 1 // findable by address
+#define SYMBOL_NAME 2 // findable by name
+
+typedef struct {
+    uint32_t addr;
+    uint32_t payload; // whatever the index's owner wants (e.g. an index into its own table)
+    const char *name; // not copied, must outlive the index
+} symbol_entry_t;
+
+typedef struct {
+    alloc_pool_t *pool;
+    uint32_t count, max;
+    symbol_entry_t *entries;
+    uint8_t *flags;
+    
+    // Built by symbol_index_finish()
+    uint32_t num_addrs;
+    uint32_t *addrs; // sorted, one per address (the last one added wins)
+    uint32_t *addr_entries; // the entry for each addrs[i]
+    uint32_t *name_slots; // open-addressed hash of names, entry index + 1 (the first one added wins)
+    uint32_t name_mask;
+} symbol_index_t;
+
+symbol_index_t* symbol_index_new(alloc_pool_t *parent_pool, uint32_t max);
+void symbol_index_add(symbol_index_t *idx, uint32_t addr, const char *name, uint32_t payload, uint8_t flags);
+void symbol_index_finish(symbol_index_t *idx);
+void symbol_index_free(symbol_index_t *idx);
+const symbol_entry_t* symbol_find_addr(const symbol_index_t *idx, uint32_t addr);
+const symbol_entry_t* symbol_find_name(const symbol_index_t *idx, const char *name);
+
+const char* symbol_rom(uint32_t pc, uint32_t *offset);
+const char* symbol_kernel(uint32_t pc, uint32_t *offset);
+const char* symbol_for_pc(uint32_t pc, _Bool supervisor, uint32_t *offset);
+_Bool symbol_lookup(const char *name, uint32_t *value);
 
 /*
  * coff.c
@@ -402,7 +626,7 @@ typedef struct {
     uint16_t flags;
     uint8_t *opt_header;
     coff_section *sections;
-    rb_tree *func_tree;
+    symbol_index_t *index; // functions by address, and all symbols by name
     coff_symbol *symbols;
     alloc_pool_t *pool;
 } coff_file;
@@ -413,6 +637,10 @@ coff_symbol* coff_find_symbol(coff_file *coff, const char *name);
 coff_file* coff_parse(uint8_t *buf, uint32_t buflen, alloc_pool_t *parent_pool);
 coff_file* coff_parse_from_path(const char *path, alloc_pool_t *parent_pool);
 void coff_free(coff_file *coff);
+coff_file* coff_load_kernel(const char *disk_path, const char *kernel_path, char *error_str);
+void coff_release_kernel(coff_file *coff);
+void coff_kernel_cache_lock(void);
+void coff_kernel_cache_unlock(void);
 uint32_t be2native (uint8_t **dat, uint32_t bytes);
 void print_coff_info(coff_file *coff);
 
@@ -521,6 +749,10 @@ typedef struct {
     uint32_t num_blocks, block_size;
     FILE *f;
     const char *image_path;
+    
+    // Cloned machines write to a private overlay instead of f (see clone.c)
+    FILE *overlay;
+    uint8_t *overlay_map; // one bit per block, set if the block lives in overlay
 } scsi_device_t;
 
 #define KEYBOARD_STATE_MAX_KEYS 128
@@ -621,6 +853,8 @@ typedef struct {
 typedef struct {
     video_ctx_color_t *temp_buf, *clut;
     uint8_t *rom, *direct_buf;
+    uint8_t *dirty; // the slot's direct_dirty map (see nubus_card_t)
+    uint32_t dirty_len;
     
     uint32_t pixels;
     
@@ -631,6 +865,8 @@ typedef struct {
 
 typedef struct {
     uint8_t *direct_buf, *temp_buf, *clut, *rom;
+    uint8_t *dirty; // the slot's direct_dirty map (see nubus_card_t)
+    uint32_t dirty_len;
     uint16_t depth, clut_idx, line_offset;
     uint8_t vsync;
 } shoebill_card_tfb_t;
@@ -649,6 +885,7 @@ typedef struct {
     uint8_t slotnum;
     
     // -- thread state --
+    struct _shoebill_machine_t *machine; // the sender/receiver threads' shoe_ctx
     uint8_t recv_buf[4096], send_buf[4096];
     uint16_t recv_len, send_len;
     _Bool teardown, send_ready;
@@ -704,20 +941,54 @@ typedef struct {
     _Bool connected;
     _Bool interrupts_enabled;
     
+    // Video cards: via_clock_thread raises this slot's VBL interrupt vbl_hz times a second (0 = never)
+    double vbl_hz;
+    
+    /*
+     * Optional directly-mapped memory window (video RAM).
+     * Reads/writes where (addr & direct_mask) + size <= direct_size
+     * go straight to direct_buf, bypassing read_func/write_func.
+     * Writes set direct_dirty[offset >> NUBUS_DIRTY_SHIFT].
+     */
+    uint8_t *direct_buf;
+    uint8_t *direct_dirty;
+    uint32_t direct_mask, direct_size;
+    
     void *ctx;
     card_names_t card_type;
 } nubus_card_t;
 
+#define NUBUS_DIRTY_SHIFT 10 // one dirty byte per 1kb of direct_buf
+#define nubus_dirty_len(size) ((((size) - 1) >> NUBUS_DIRTY_SHIFT) + 1)
+
 typedef struct {
     uint32_t logical_value : 24; // At most the high 24 bits of the logical address
     uint32_t used_bits : 5;
     uint32_t wp : 1; // whether the page is write protected
     uint32_t modified : 1; // whether the page has been modified
-    uint32_t unused1 : 1;
+    uint32_t watched : 1; // whether the page overlaps a watchpoint (never hits)
     uint32_t unused2 : 8;
     uint32_t physical_addr : 24;
 } pmmu_cache_entry_t;
 
+#define SHOEBILL_MAX_WATCHPOINTS 16
+
+typedef struct {
+    uint32_t addr, size;
+    uint32_t num;
+    uint8_t type; // SHOEBILL_WATCH_READ | SHOEBILL_WATCH_WRITE
+} watchpoint_t;
+
+typedef struct {
+    uint32_t num; // which watchpoint
+    uint32_t pc; // the instruction that made the access
+    uint32_t addr, size;
+    uint64_t old_dat; // the value in memory before the access
+    uint64_t new_dat; // the value written (writes only)
+    _Bool is_write;
+    _Bool old_valid; // old_dat is only known for RAM
+} watch_hit_t;
+
 typedef struct {
     uint64_t emu_start_time;
     struct timeval last_60hz_tick; // for via1 ca1
@@ -730,12 +1001,26 @@ typedef struct {
     assert(pthread_mutex_unlock(&shoe.cpu_stop_mutex) == 0); \
 } while (0)
 
+#if SHOEBILL_OP_HISTOGRAM
 typedef struct {
+    uint64_t ops[0x10000]; // by opcode word
+    uint64_t pairs[256][256]; // by (previous, current) inst_opcode_map index
+    uint64_t ea_reads[64], ea_writes[64]; // by mode/reg
+    uint8_t last_index;
+} op_histogram_t;
+#endif
+
+typedef struct _shoebill_machine_t {
     
     _Bool running;
     
 #define SHOEBILL_STATE_STOPPED (1 << 8)
 #define SHOEBILL_STATE_RETURN (1 << 9)
+#define SHOEBILL_STATE_PAUSE (1 << 10)
+#define SHOEBILL_STATE_PROFILE (1 << 11)
+#define SHOEBILL_STATE_TRACE (1 << 12)
+#define SHOEBILL_STATE_WATCH (1 << 13)
+#define SHOEBILL_STATE_REPLAY (1 << 14)
     
     // bits 0-6 are CPU interrupt priorities
     // bit 8 indicates that STOP was called
@@ -750,6 +1035,17 @@ typedef struct {
     pthread_mutex_t cpu_stop_mutex;
     pthread_cond_t cpu_stop_cond;
     
+    // Signalled (with cpu_stop_mutex) when the CPU thread parks or is released (see pause_cpu_thread())
+    pthread_cond_t cpu_pause_cond;
+    volatile _Bool cpu_paused;
+    uint32_t cpu_pausers; // threads inside pause_cpu_thread()/resume_cpu_thread(), protected by cpu_stop_mutex
+    
+    shoebill_stats_t stats; // never reset
+    
+#if SHOEBILL_OP_HISTOGRAM
+    op_histogram_t histogram;
+#endif
+    
     // -- Assorted CPU state variables --
     uint16_t op; // the first word of the instruction we're currently running
     uint16_t orig_sr; // the sr before we began executing the instruction
@@ -761,6 +1057,10 @@ typedef struct {
     // -- Physical memory --
     uint8_t *physical_mem_base;
     uint32_t physical_mem_size;
+    void *physical_mem_map; // the whole mapping around physical_mem_base, guard pages included
+    size_t physical_mem_map_size;
+    uint8_t *dirty_map; // one byte per page of RAM, NULL unless dirty tracking is on
+    uint32_t dirty_map_len;
     uint8_t *physical_rom_base;
     uint32_t physical_rom_size;
     
@@ -867,6 +1167,19 @@ typedef struct {
     
     coff_file *coff; // Data/symbols from the unix kernel
     
+    struct _profiler_t *profiler; // see profiler.c
+    uint16_t last_atrap; // the last A-line opcode trapped on, for the profiler
+    
+    struct _tracer_t *tracer; // see trace.c
+    struct _checkpointer_t *checkpointer; // see snapshot.c
+    struct _replayer_t *replayer; // see replay.c
+    _Bool trace_mem; // log logical_get()/logical_set() to the tracer
+    uint16_t last_vector; // the last exception vector taken, for the tracer
+    
+    watchpoint_t watchpoints[SHOEBILL_MAX_WATCHPOINTS]; // see mem.c
+    uint32_t watch_count, watch_counter;
+    watch_hit_t watch_hit; // valid while SHOEBILL_STATE_WATCH is set
+    
     pthread_t cpu_thread_pid, via_thread_pid;
     
     debugger_state_t dbg;
@@ -875,7 +1188,12 @@ typedef struct {
     shoebill_config_t config_copy; // copy of the config structure passed to shoebill_initialize()
 } global_shoebill_context_t;
 
-extern global_shoebill_context_t shoe; // declared in cpu.c
+/*
+ * The current thread's machine (defined in cpu.c). Threads started on behalf
+ * of a machine get its context as their argument and set shoe_ctx first thing.
+ */
+extern __thread global_shoebill_context_t *shoe_ctx;
+#define shoe (*shoe_ctx)
 
 // fpu.c functions
 void inst_fscc();
@@ -899,11 +1217,66 @@ void dis_fmath (uint16_t op, uint16_t ext, char *output);
 
 void fpu_initialize();
 void fpu_reset();
+uint32_t fpu_state_size();
 
 // cpu.c fuctions
 void cpu_step (void);
 void inst_decode (void);
 
+// core_api.c functions
+void pause_cpu_thread (void);
+void resume_cpu_thread (void);
+void *_cpu_thread (void *arg);
+
+// profiler.c functions
+typedef struct _profiler_t profiler_t;
+void profile_sample (void);
+void profile_free (profiler_t *prof);
+
+// trace.c functions
+void trace_step (void);
+void trace_mem_access (uint32_t addr, uint32_t size, uint64_t dat, _Bool is_write);
+
+/*
+ * Execution trace format. A header (magic, u32 version, u32 byte order
+ * marker, u32 flags), a TRACE_REC_START record, then a stream of records,
+ * each a one-byte tag followed by its fields, in host byte order.
+ */
+#define TRACE_MAGIC "SHOETRAC"
+#define TRACE_VERSION 1
+#define TRACE_BYTE_ORDER 0x01020304
+#define TRACE_FLAG_MEMORY 1
+
+#define TRACE_REC_START 0x10 // u32 pc, u16 sr, u32 d[8], u32 a[8]
+#define TRACE_REC_INST 0x01 // u8 num_words, u16 words[] (pc follows the last instruction)
+#define TRACE_REC_INST_PC 0x02 // u32 pc, u8 num_words, u16 words[]
+#define TRACE_REC_REGS 0x03 // u32 mask (d0-7, a0-7, sr), then the new value of each changed register
+#define TRACE_REC_MEM 0x04 // u8 flags (1=write, 2=faulted), u8 size, u32 addr, u64 data
+#define TRACE_REC_EXCEPTION 0x05 // u16 vector, u32 handler pc
+#define TRACE_REC_DROPPED 0x06 // u32 number of memory records dropped for this instruction
+
+#define TRACE_MAX_INST_WORDS 11 // the longest 68020 instruction is 22 bytes
+#define TRACE_NO_VECTOR 0xffff
+
+// replay.c functions
+enum {
+    REPLAY_EV_VALUE = 1, // a clock read returned x
+    REPLAY_EV_VIA_IRQ, // via_raise_interrupt(a, b)
+    REPLAY_EV_VBL, // nubus_vbl_interrupt(a)
+    REPLAY_EV_KEY, // shoebill_key(a, b)
+    REPLAY_EV_KEY_MODIFIER, // shoebill_key_modifier(a)
+    REPLAY_EV_MOUSE_MOVE, // shoebill_mouse_move(x, y)
+    REPLAY_EV_MOUSE_DELTA, // shoebill_mouse_move_delta(x, y)
+    REPLAY_EV_MOUSE_CLICK, // shoebill_mouse_click(a)
+    REPLAY_EV_ETHERNET_RX, // nubus_ethernet_receive(a, data, len)
+    REPLAY_EV_ETHERNET_TX, // nubus_ethernet_sent(a)
+};
+typedef struct _replayer_t replayer_t;
+_Bool replay_post (uint8_t type, uint8_t a, uint8_t b, int32_t x, int32_t y, const uint8_t *data, uint16_t len);
+_Bool replay_replaying (void);
+uint32_t replay_value (uint32_t value);
+uint32_t replay_poll (_Bool stopped);
+
 // exception.c functions
 
 void throw_bus_error(uint32_t addr, uint8_t is_write);
@@ -935,6 +1308,11 @@ extern const physical_set_ptr physical_set_jump_table[16];
     physical_set(); \
 } while (0)
 
+uint8_t* nubus_map_direct_window(uint8_t slotnum, uint8_t *buf, uint32_t mask, uint32_t size);
+void physical_write_block(uint32_t addr, const uint8_t *buf, uint32_t len);
+void physical_fill(uint32_t addr, uint8_t val, uint32_t len);
+void zero_ram(void);
+
 #define physical_get() physical_get_jump_table[shoe.physical_addr >> 28]()
 #define pget(addr, s) ({shoe.physical_addr=(addr); shoe.physical_size=(s); physical_get(); shoe.physical_dat;})
 
@@ -947,6 +1325,7 @@ void logical_get (void);
     shoe.logical_dat; \
 })
 #define lget(addr, s) lget_fc((addr), (s), (sr_s() ? 5 : 1))
+_Bool logical_peek_ram(uint32_t addr, uint32_t size, uint8_t fc, uint64_t *out);
 
 void logical_set (void);
 #define lset_fc(addr, s, val, fc) do { \
@@ -964,9 +1343,20 @@ extern const _ea_func ea_read_commit_jump_table[64];
 extern const _ea_func ea_write_jump_table[64];
 extern const _ea_func ea_addr_jump_table[64];
     
+#if SHOEBILL_OP_HISTOGRAM
+#define ea_read() do {shoe.histogram.ea_reads[shoe.mr]++; ea_read_jump_table[shoe.mr]();} while (0)
+#define ea_write() do {shoe.histogram.ea_writes[shoe.mr]++; ea_write_jump_table[shoe.mr]();} while (0)
+#else
 #define ea_read() ea_read_jump_table[shoe.mr]()
-#define ea_read_commit() ea_read_commit_jump_table[shoe.mr]()
 #define ea_write() ea_write_jump_table[shoe.mr]()
+#endif
+#define ea_read_commit() ea_read_commit_jump_table[shoe.mr]()
+
+// Count an exception, and remember its vector for the tracer
+#define note_exception(v) do { \
+    shoe.stats.exceptions[(v) & 0xff]++; \
+    shoe.last_vector = (v) & 0xff; \
+} while (0)
 #define ea_addr() ea_addr_jump_table[shoe.mr]()
 
 
@@ -1035,6 +1425,7 @@ void process_pending_interrupt();
 void via_read_raw();
 void via_write_raw();
 void *via_clock_thread(void *arg);
+void nubus_vbl_interrupt(uint8_t slotnum);
 
 // VIA registers
 #define VIA_ORB 0
@@ -1100,6 +1491,8 @@ void nubus_ethernet_init(void *_ctx, uint8_t slotnum, uint8_t ethernet_addr[6],
 uint32_t nubus_ethernet_read_func(uint32_t, uint32_t, uint8_t);
 void nubus_ethernet_write_func(uint32_t, uint32_t, uint32_t, uint8_t);
 void nubus_ethernet_destroy_func(uint8_t);
+void nubus_ethernet_receive(uint8_t slotnum, const uint8_t *packet, uint16_t len);
+void nubus_ethernet_sent(uint8_t slotnum);
 
 #ifdef __cplusplus
     }
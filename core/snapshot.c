@@ -0,0 +1,885 @@
+/*
+ * Copyright (c) 2014, Peter Rutenbar <pruten@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Machine snapshots. A snapshot is a gzip'd stream of
+ *
+ *   snapshot_header_t
+ *   global_shoebill_context_t, verbatim (host pointers and all - see _merge_context())
+ *   fpu_state_t, verbatim
+ *   RAM, as (u32 page number, 4kb page) records for every non-zero page, then 0xffffffff
+ *   For each nubus card, (u8 slotnum, u8 card_type, card-specific payload), then 0xff
+ *
+ * Since the context is written verbatim, a snapshot can only be loaded by the
+ * same build of shoebill that wrote it (the header checks this). The disk images
+ * also have to be in the same state they were in when the snapshot was taken.
+ *
+ * Checkpoint logs (see the Checkpoints section) are built out of the same stream.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <zlib.h>
+#include "shoebill.h"
+
+#define SNAPSHOT_MAGIC "SHOESNAP"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_PAGE_SIZE SHOEBILL_DIRTY_PAGE_SIZE // so checkpoints can go by the dirty map
+#define SNAPSHOT_END_OF_RAM 0xffffffff
+#define SNAPSHOT_END_OF_CARDS 0xff
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t context_size; // sizeof(global_shoebill_context_t), as a cheap "same build?" check
+    uint32_t fpu_size;
+    uint32_t ram_size;
+    uint32_t rom_checksum; // the checksum stored in the ROM's first long
+    long double saved_at; // wall-clock seconds, to rebase the VIA timers on load
+} snapshot_header_t;
+
+static long double _now (void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (long double)tv.tv_sec + ((long double)tv.tv_usec / 1000000.0);
+}
+
+/* A snapshot stream is either a gzip file, or (for checkpoints) a memory buffer */
+typedef struct {
+    gzFile f;
+    uint8_t *buf;
+    size_t len, pos, max;
+} snap_stream_t;
+
+static _Bool _write (snap_stream_t *s, const void *buf, uint32_t len)
+{
+    if (len == 0)
+        return 1;
+    if (s->f)
+        return gzwrite(s->f, buf, len) == (int)len;
+    
+    if ((s->len + len) > s->max) {
+        size_t max = s->max ? s->max : (1024 * 1024);
+        uint8_t *grown;
+        while (max < (s->len + len))
+            max *= 2;
+        if ((grown = realloc(s->buf, max)) == NULL)
+            return 0;
+        s->buf = grown;
+        s->max = max;
+    }
+    memcpy(&s->buf[s->len], buf, len);
+    s->len += len;
+    return 1;
+}
+
+static _Bool _read (snap_stream_t *s, void *buf, uint32_t len)
+{
+    if (len == 0)
+        return 1;
+    if (s->f)
+        return gzread(s->f, buf, len) == (int)len;
+    
+    if (len > (s->len - s->pos))
+        return 0;
+    memcpy(buf, &s->buf[s->pos], len);
+    s->pos += len;
+    return 1;
+}
+
+static _Bool _page_is_zero (const uint8_t *page)
+{
+    const uint64_t *words = (const uint64_t*)page;
+    uint32_t i;
+    for (i=0; i < SNAPSHOT_PAGE_SIZE / 8; i++)
+        if (words[i])
+            return 0;
+    return 1;
+}
+
+#pragma mark Saving
+
+static _Bool _save_cards (snap_stream_t *f)
+{
+    uint8_t i;
+
+    for (i=0; i<16; i++) {
+        const uint8_t type = shoe.slots[i].card_type;
+
+        if (type == card_none)
+            continue;
+
+        if (!_write(f, &i, 1) || !_write(f, &type, 1))
+            return 0;
+
+        if (type == card_shoebill_video) {
+            shoebill_card_video_t *ctx = (shoebill_card_video_t*)shoe.slots[i].ctx;
+            const uint16_t regs[6] = {
+                ctx->width, ctx->height, ctx->scanline_width,
+                ctx->depth, ctx->clut_idx, ctx->line_offset
+            };
+            if (!_write(f, regs, sizeof(regs)) ||
+                !_write(f, ctx->clut, 256 * sizeof(video_ctx_color_t)) ||
+                !_write(f, ctx->direct_buf, ctx->pixels * 4))
+                return 0;
+        }
+        else if (type == card_toby_frame_buffer) {
+            shoebill_card_tfb_t *ctx = (shoebill_card_tfb_t*)shoe.slots[i].ctx;
+            const uint16_t regs[4] = {ctx->depth, ctx->clut_idx, ctx->line_offset, ctx->vsync};
+            if (!_write(f, regs, sizeof(regs)) ||
+                !_write(f, ctx->clut, 256 * 3) ||
+                !_write(f, ctx->direct_buf, 512 * 1024))
+                return 0;
+        }
+    }
+
+    i = SNAPSHOT_END_OF_CARDS;
+    return _write(f, &i, 1);
+}
+
+/* Write the machine to f. If dirty is set, only write the RAM pages it marks (zero or not) */
+static _Bool _save (snap_stream_t *f, const uint8_t *dirty)
+{
+    snapshot_header_t header;
+    uint32_t page;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, 8);
+    header.version = SNAPSHOT_VERSION;
+    header.context_size = sizeof(global_shoebill_context_t);
+    header.fpu_size = fpu_state_size();
+    header.ram_size = shoe.physical_mem_size;
+    header.rom_checksum = ntohl(*(uint32_t*)shoe.physical_rom_base);
+    header.saved_at = _now();
+
+    if (!_write(f, &header, sizeof(header)) ||
+        !_write(f, &shoe, sizeof(global_shoebill_context_t)) ||
+        !_write(f, shoe.fpu_state, header.fpu_size))
+        return 0;
+
+    // Most of a freshly booted machine's RAM is still zero, so only write the pages that aren't
+    for (page=0; page < (shoe.physical_mem_size / SNAPSHOT_PAGE_SIZE); page++) {
+        const uint8_t *data = &shoe.physical_mem_base[page * SNAPSHOT_PAGE_SIZE];
+        if (dirty ? !dirty[page] : _page_is_zero(data))
+            continue;
+        if (!_write(f, &page, 4) || !_write(f, data, SNAPSHOT_PAGE_SIZE))
+            return 0;
+    }
+    page = SNAPSHOT_END_OF_RAM;
+    if (!_write(f, &page, 4))
+        return 0;
+
+    return _save_cards(f);
+}
+
+/* Whether every installed card can be saved and restored, error_msg says why not */
+static _Bool _can_snapshot (char *error_msg)
+{
+    uint32_t i;
+
+    for (i=0; i<16; i++) {
+        if (shoe.slots[i].card_type == card_shoebill_ethernet) {
+            sprintf(error_msg, "Can't snapshot the ethernet card in slot %u (its tap device can't be restored)\n", i);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Write the whole machine to path. Call any time after shoebill_initialize()
+ * (and after installing the cards). The CPU is paused while the state is written.
+ */
+uint32_t shoebill_save_state(const char *path, char *error_msg)
+{
+    snap_stream_t s;
+    _Bool result;
+    gzFile f;
+
+    if (!_can_snapshot(error_msg))
+        return 0;
+
+    f = gzopen(path, "wb1");
+    if (f == NULL) {
+        sprintf(error_msg, "Couldn't open snapshot [%s] for writing\n", path);
+        return 0;
+    }
+
+    // Park the CPU, then hold off the VIA timer thread and ADB input while we look
+    pause_cpu_thread();
+    pthread_mutex_lock(&shoe.via_cpu_lock);
+    pthread_mutex_lock(&shoe.adb.lock);
+
+    memset(&s, 0, sizeof(s));
+    s.f = f;
+    result = _save(&s, NULL);
+
+    pthread_mutex_unlock(&shoe.adb.lock);
+    pthread_mutex_unlock(&shoe.via_cpu_lock);
+    resume_cpu_thread();
+
+    if ((gzclose(f) != Z_OK) || !result) {
+        sprintf(error_msg, "Couldn't write snapshot [%s]\n", path);
+        return 0;
+    }
+
+    return 1;
+}
+
+#pragma mark Loading
+
+static _Bool _load_cards (snap_stream_t *f, shoebill_config_t *config)
+{
+    while (1) {
+        uint8_t slotnum, type;
+
+        if (!_read(f, &slotnum, 1))
+            return 0;
+        if (slotnum == SNAPSHOT_END_OF_CARDS)
+            return 1;
+        if ((slotnum >= 16) || !_read(f, &type, 1))
+            return 0;
+
+        if (type == card_shoebill_video) {
+            shoebill_card_video_t *ctx;
+            uint16_t regs[6];
+
+            if (!_read(f, regs, sizeof(regs)) ||
+                !shoebill_install_video_card(config, slotnum, regs[0], regs[1]))
+                return 0;
+
+            ctx = (shoebill_card_video_t*)shoe.slots[slotnum].ctx;
+            if (ctx->scanline_width != regs[2])
+                return 0;
+            ctx->depth = regs[3];
+            ctx->clut_idx = regs[4];
+            ctx->line_offset = regs[5];
+
+            if (!_read(f, ctx->clut, 256 * sizeof(video_ctx_color_t)) ||
+                !_read(f, ctx->direct_buf, ctx->pixels * 4))
+                return 0;
+            memset(ctx->dirty, 1, ctx->dirty_len);
+        }
+        else if (type == card_toby_frame_buffer) {
+            shoebill_card_tfb_t *ctx;
+            uint16_t regs[4];
+
+            if (!_read(f, regs, sizeof(regs)) ||
+                !shoebill_install_tfb_card(config, slotnum))
+                return 0;
+
+            ctx = (shoebill_card_tfb_t*)shoe.slots[slotnum].ctx;
+            ctx->depth = regs[0];
+            ctx->clut_idx = regs[1];
+            ctx->line_offset = regs[2];
+            ctx->vsync = regs[3];
+
+            if (!_read(f, ctx->clut, 256 * 3) ||
+                !_read(f, ctx->direct_buf, 512 * 1024))
+                return 0;
+            memset(ctx->dirty, 1, ctx->dirty_len);
+        }
+        else
+            return 0;
+    }
+}
+
+/*
+ * Install the guest-visible state from a snapshot's context into shoe,
+ * keeping everything that belongs to this process: pointers into our
+ * pool, locks, threads, open files, callbacks, and the cards that
+ * _load_cards() just installed.
+ */
+static void _merge_context (const global_shoebill_context_t *saved, long double time_shift)
+{
+    global_shoebill_context_t *live = malloc(sizeof(global_shoebill_context_t));
+    uint32_t i;
+
+    memcpy(live, &shoe, sizeof(global_shoebill_context_t));
+    memcpy(&shoe, saved, sizeof(global_shoebill_context_t));
+
+    shoe.running = live->running;
+    shoe.cpu_thread_notifications = (saved->cpu_thread_notifications & (0xff | SHOEBILL_STATE_STOPPED)) |
+        (live->cpu_thread_notifications & SHOEBILL_STATE_TRACE);
+    shoe.via_thread_notifications = live->via_thread_notifications;
+
+    shoe.cpu_thread_lock = live->cpu_thread_lock;
+    shoe.via_clock_thread_lock = live->via_clock_thread_lock;
+    shoe.via_cpu_lock = live->via_cpu_lock;
+    shoe.cpu_stop_mutex = live->cpu_stop_mutex;
+    shoe.cpu_stop_cond = live->cpu_stop_cond;
+    shoe.cpu_pause_cond = live->cpu_pause_cond;
+    shoe.cpu_paused = 0;
+    shoe.cpu_pausers = live->cpu_pausers;
+
+    shoe.physical_mem_base = live->physical_mem_base;
+    shoe.physical_mem_map = live->physical_mem_map;
+    shoe.physical_mem_map_size = live->physical_mem_map_size;
+    shoe.dirty_map = live->dirty_map;
+    shoe.dirty_map_len = live->dirty_map_len;
+    shoe.physical_rom_base = live->physical_rom_base;
+    shoe.pccache_ptr = NULL;
+    invalidate_pccache();
+
+    shoe.fpu_state = live->fpu_state;
+    shoe.adb.lock = live->adb.lock;
+    shoe.pram.callback = live->pram.callback;
+    shoe.pram.callback_param = live->pram.callback_param;
+    memcpy(shoe.scsi_devices, live->scsi_devices, sizeof(shoe.scsi_devices));
+
+    // The cards were reinstalled by _load_cards(), only the guest's interrupt enable survives
+    for (i=0; i<16; i++) {
+        const _Bool interrupts_enabled = saved->slots[i].interrupts_enabled;
+        shoe.slots[i] = live->slots[i];
+        if (shoe.slots[i].connected)
+            shoe.slots[i].interrupts_enabled = interrupts_enabled;
+    }
+
+    // The VIA timers are based on wall-clock time, so move them up to "now"
+    for (i=0; i<2; i++) {
+        shoe.via[i].t1_last_set += time_shift;
+        shoe.via[i].t2_last_set += time_shift;
+    }
+
+    shoe.coff = live->coff;
+    shoe.profiler = live->profiler;
+    shoe.tracer = live->tracer;
+    shoe.checkpointer = live->checkpointer;
+    shoe.replayer = live->replayer;
+    shoe.trace_mem = live->trace_mem;
+    shoe.last_vector = TRACE_NO_VECTOR;
+    memcpy(shoe.watchpoints, live->watchpoints, sizeof(shoe.watchpoints));
+    shoe.watch_count = live->watch_count;
+    shoe.watch_counter = live->watch_counter;
+    memset(shoe.pmmu_cache[0].valid_map, 0, PMMU_CACHE_SIZE/8); // drop stale "watched" bits
+    memset(shoe.pmmu_cache[1].valid_map, 0, PMMU_CACHE_SIZE/8);
+    shoe.cpu_thread_pid = live->cpu_thread_pid;
+    shoe.via_thread_pid = live->via_thread_pid;
+    shoe.dbg = live->dbg;
+    shoe.pool = live->pool;
+    shoe.config_copy = live->config_copy;
+
+    free(live);
+}
+
+/* Can this build, with config's ROM, load a snapshot with this header? */
+static _Bool _check_header (const snapshot_header_t *header, shoebill_config_t *config, const char *path)
+{
+    uint8_t rom_head[4];
+    FILE *rom;
+
+    if ((memcmp(header->magic, SNAPSHOT_MAGIC, 8) != 0) ||
+        (header->version != SNAPSHOT_VERSION)) {
+        sprintf(config->error_msg, "[%s] isn't a shoebill snapshot\n", path);
+        return 0;
+    }
+
+    if ((header->context_size != sizeof(global_shoebill_context_t)) ||
+        (header->fpu_size != fpu_state_size())) {
+        sprintf(config->error_msg, "Snapshot [%s] was written by a different build of shoebill\n", path);
+        return 0;
+    }
+
+    // Check the ROM before going to the trouble of initializing anything
+    if (config->rom_path == NULL) {
+        sprintf(config->error_msg, "No rom file specified\n");
+        return 0;
+    }
+    rom = fopen(config->rom_path, "rb");
+    if ((rom == NULL) || (fread(rom_head, 4, 1, rom) != 1)) {
+        sprintf(config->error_msg, "Couldn't open rom path [%s]\n", config->rom_path);
+        if (rom)
+            fclose(rom);
+        return 0;
+    }
+    fclose(rom);
+
+    if (ntohl(*(uint32_t*)rom_head) != header->rom_checksum) {
+        sprintf(config->error_msg, "Snapshot [%s] was taken with a different ROM\n", path);
+        return 0;
+    }
+    return 1;
+}
+
+/* Write RAM pages from f until SNAPSHOT_END_OF_RAM */
+static _Bool _load_ram (snap_stream_t *f)
+{
+    while (1) {
+        uint8_t data[SNAPSHOT_PAGE_SIZE];
+        uint32_t page;
+        if (!_read(f, &page, 4))
+            return 0;
+        if (page == SNAPSHOT_END_OF_RAM)
+            return 1;
+        if ((page >= (shoe.physical_mem_size / SNAPSHOT_PAGE_SIZE)) ||
+            !_read(f, data, SNAPSHOT_PAGE_SIZE))
+            return 0;
+        physical_write_block(page * SNAPSHOT_PAGE_SIZE, data, SNAPSHOT_PAGE_SIZE);
+    }
+}
+
+/*
+ * Tear down a machine that shoebill_initialize() set up, but that was never started
+ */
+static void _abandon_machine (void)
+{
+    shoe.cpu_thread_notifications |= SHOEBILL_STATE_RETURN;
+    shoe.via_thread_notifications = SHOEBILL_STATE_RETURN;
+    shoebill_start();
+    shoebill_stop();
+}
+
+/*
+ * Call this instead of shoebill_initialize() (and don't install any cards,
+ * the snapshot has them). config still supplies the rom, disks, kernel path,
+ * pram callback, etc. - but ram_size comes from the snapshot.
+ * Call shoebill_start() afterwards, as usual.
+ */
+uint32_t shoebill_load_state(shoebill_config_t *config, const char *path)
+{
+    global_shoebill_context_t *saved = NULL;
+    snapshot_header_t header;
+    snap_stream_t s;
+    gzFile f;
+
+    f = gzopen(path, "rb");
+    if (f == NULL) {
+        sprintf(config->error_msg, "Couldn't open snapshot [%s]\n", path);
+        return 0;
+    }
+    memset(&s, 0, sizeof(s));
+    s.f = f;
+
+    if (!_read(&s, &header, sizeof(header)))
+        memset(&header, 0, sizeof(header)); // fails the magic check
+    if (!_check_header(&header, config, path))
+        goto fail;
+
+    config->ram_size = header.ram_size;
+    if (!shoebill_initialize(config))
+        goto fail;
+
+    /*
+     * Past this point, the machine exists (with its threads waiting for shoebill_start()),
+     * so failures have to tear it back down.
+     */
+    saved = malloc(sizeof(global_shoebill_context_t));
+    if (!_read(&s, saved, sizeof(global_shoebill_context_t)) ||
+        !_read(&s, shoe.fpu_state, header.fpu_size))
+        goto fail_initialized;
+
+    // shoebill_initialize() loaded the kernel, but RAM gets replaced wholesale
+    zero_ram();
+    if (!_load_ram(&s))
+        goto fail_initialized;
+
+    if (!_load_cards(&s, config))
+        goto fail_initialized;
+
+    _merge_context(saved, _now() - header.saved_at);
+
+    free(saved);
+    gzclose(f);
+    return 1;
+
+fail_initialized:
+    sprintf(config->error_msg, "Snapshot [%s] is truncated or corrupt\n", path);
+    _abandon_machine();
+fail:
+    if (saved)
+        free(saved);
+    gzclose(f);
+    return 0;
+}
+
+#pragma mark Checkpoints
+
+/*
+ * A checkpoint log is a sequence of records, each a checkpoint_record_t
+ * followed by a zlib'd snapshot stream. The first record is a full snapshot,
+ * the rest only carry the RAM pages dirtied since the record before them
+ * (plus the whole context and the cards, which are small next to RAM).
+ *
+ * The CPU is only paused while a checkpoint is copied into memory, the
+ * checkpoint thread compresses and writes it afterwards. A torn record at
+ * the end of the log fails its crc and is ignored, so loading resumes from
+ * the last complete checkpoint. Every CHECKPOINT_REBASE records, the log
+ * is replaced by a fresh one starting with a full checkpoint.
+ *
+ * As with snapshots, the disk images need to be in step with the
+ * checkpoint, and they keep being written after it, so each checkpoint
+ * at least flushes them.
+ */
+
+#define CHECKPOINT_MAGIC "SHOECKPT"
+#define CHECKPOINT_REBASE 64
+
+typedef struct {
+    char magic[8];
+    uint32_t seq; // the record's index in the log
+    uint32_t raw_len; // length of the snapshot stream
+    uint32_t len; // length of the compressed stream that follows
+    uint32_t crc; // crc32 of the compressed stream
+} checkpoint_record_t;
+
+typedef struct _checkpointer_t checkpointer_t;
+
+struct _checkpointer_t {
+    shoebill_machine_t *machine;
+    pthread_t threadid;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    _Bool running; // protected by lock
+    uint32_t interval_secs;
+    char *path;
+    FILE *f;
+    uint32_t seq; // records in the current log
+};
+
+/* Copy the machine into s with the CPU paused. full=0 only copies dirty RAM pages */
+static _Bool _checkpoint_capture (snap_stream_t *s, _Bool full)
+{
+    uint8_t *dirty = malloc(shoebill_dirty_map_len());
+    _Bool result;
+    uint32_t i;
+
+    if (dirty == NULL)
+        return 0;
+
+    pause_cpu_thread();
+    pthread_mutex_lock(&shoe.via_cpu_lock);
+    pthread_mutex_lock(&shoe.adb.lock);
+
+    shoebill_dirty_collect(dirty);
+    for (i=0; i<8; i++) {
+        if (shoe.scsi_devices[i].f)
+            fflush(shoe.scsi_devices[i].f);
+        if (shoe.scsi_devices[i].overlay)
+            fflush(shoe.scsi_devices[i].overlay);
+    }
+    result = _save(s, full ? NULL : dirty);
+
+    pthread_mutex_unlock(&shoe.adb.lock);
+    pthread_mutex_unlock(&shoe.via_cpu_lock);
+    resume_cpu_thread();
+
+    free(dirty);
+    return result;
+}
+
+static _Bool _checkpoint_append (FILE *f, uint32_t seq, const snap_stream_t *s)
+{
+    uLongf len = compressBound(s->len);
+    uint8_t *buf = malloc(len);
+    checkpoint_record_t rec;
+    _Bool result;
+
+    if (buf == NULL)
+        return 0;
+
+    result = (compress2(buf, &len, s->buf, s->len, 1) == Z_OK);
+
+    memcpy(rec.magic, CHECKPOINT_MAGIC, 8);
+    rec.seq = seq;
+    rec.raw_len = s->len;
+    rec.len = len;
+    rec.crc = crc32(0, buf, len);
+
+    result = result &&
+        (fwrite(&rec, sizeof(rec), 1, f) == 1) &&
+        (fwrite(buf, len, 1, f) == 1) &&
+        (fflush(f) == 0) &&
+        (fsync(fileno(f)) == 0);
+
+    free(buf);
+    return result;
+}
+
+/* Take one checkpoint, starting a new log when it's time to rebase */
+static _Bool _checkpoint (checkpointer_t *ck)
+{
+    const _Bool rebase = (ck->f == NULL) || (ck->seq >= CHECKPOINT_REBASE);
+    char *tmp_path = NULL;
+    snap_stream_t s;
+    _Bool result;
+    FILE *f = ck->f;
+
+    memset(&s, 0, sizeof(s));
+    if (!_checkpoint_capture(&s, rebase)) {
+        // The dirty map was collected anyway, so only a full checkpoint can cover those pages now
+        ck->seq = CHECKPOINT_REBASE;
+        free(s.buf);
+        slog("checkpoint: couldn't capture a checkpoint for %s\n", ck->path);
+        return 0;
+    }
+
+    if (rebase) {
+        // Write the new log beside the old one, and only replace it once the base is safely down
+        tmp_path = malloc(strlen(ck->path) + 8);
+        sprintf(tmp_path, "%s.new", ck->path);
+        f = fopen(tmp_path, "wb");
+        result = (f != NULL) && _checkpoint_append(f, 0, &s) && (rename(tmp_path, ck->path) == 0);
+        if (result) {
+            if (ck->f)
+                fclose(ck->f);
+            ck->f = f;
+            ck->seq = 1;
+        }
+        else if (f) {
+            fclose(f);
+            unlink(tmp_path);
+        }
+        free(tmp_path);
+    }
+    else {
+        result = _checkpoint_append(f, ck->seq, &s);
+        if (result)
+            ck->seq++;
+    }
+
+    free(s.buf);
+    if (!result) {
+        /*
+         * This checkpoint's pages are gone from the dirty map, and a torn
+         * record may be sitting at the end of the log (hiding anything
+         * appended after it), so start over with a fresh log next time
+         */
+        ck->seq = CHECKPOINT_REBASE;
+        slog("checkpoint: couldn't write a checkpoint to %s (errno=%d)\n", ck->path, errno);
+    }
+    return result;
+}
+
+static void* _checkpoint_thread (void *arg)
+{
+    checkpointer_t *ck = (checkpointer_t*)arg;
+    shoe_ctx = ck->machine;
+
+    pthread_mutex_lock(&ck->lock);
+    while (ck->running) {
+        struct timeval now;
+        struct timespec deadline;
+
+        if (shoe.running) {
+            pthread_mutex_unlock(&ck->lock);
+            _checkpoint(ck);
+            pthread_mutex_lock(&ck->lock);
+        }
+
+        gettimeofday(&now, NULL);
+        deadline.tv_sec = now.tv_sec + ck->interval_secs;
+        deadline.tv_nsec = now.tv_usec * 1000;
+        while (ck->running && (pthread_cond_timedwait(&ck->cond, &ck->lock, &deadline) != ETIMEDOUT))
+            ;
+    }
+    pthread_mutex_unlock(&ck->lock);
+    return NULL;
+}
+
+/*
+ * Checkpoint the machine to path every interval_secs seconds, starting now.
+ * Call after shoebill_initialize() and installing the cards.
+ */
+uint32_t shoebill_checkpoint_start(const char *path, uint32_t interval_secs, char *error_msg)
+{
+    checkpointer_t *ck;
+
+    if (shoe.checkpointer) {
+        sprintf(error_msg, "Already checkpointing\n");
+        return 0;
+    }
+    if (!_can_snapshot(error_msg))
+        return 0;
+
+    ck = calloc(1, sizeof(checkpointer_t));
+    ck->machine = shoebill_current_machine();
+    ck->interval_secs = interval_secs ? interval_secs : 60;
+    ck->path = strdup(path);
+    ck->running = 1;
+    pthread_mutex_init(&ck->lock, NULL);
+    pthread_cond_init(&ck->cond, NULL);
+
+    shoebill_dirty_enable(1);
+
+    if (pthread_create(&ck->threadid, NULL, _checkpoint_thread, ck) != 0) {
+        sprintf(error_msg, "Couldn't start the checkpoint thread\n");
+        pthread_mutex_destroy(&ck->lock);
+        pthread_cond_destroy(&ck->cond);
+        free(ck->path);
+        free(ck);
+        return 0;
+    }
+
+    shoe.checkpointer = ck;
+    return 1;
+}
+
+void shoebill_checkpoint_stop(void)
+{
+    checkpointer_t *ck = shoe.checkpointer;
+
+    if (ck == NULL)
+        return ;
+
+    pthread_mutex_lock(&ck->lock);
+    ck->running = 0;
+    pthread_cond_signal(&ck->cond);
+    pthread_mutex_unlock(&ck->lock);
+    pthread_join(ck->threadid, NULL);
+
+    if (ck->f)
+        fclose(ck->f);
+    pthread_mutex_destroy(&ck->lock);
+    pthread_cond_destroy(&ck->cond);
+    free(ck->path);
+    free(ck);
+    shoe.checkpointer = NULL;
+}
+
+/* Read and check the next record in the log, and decompress it into s */
+static _Bool _checkpoint_read_record (FILE *f, uint32_t seq, snap_stream_t *s)
+{
+    checkpoint_record_t rec;
+    uint8_t *buf = NULL;
+    uLongf raw_len;
+
+    memset(s, 0, sizeof(*s));
+
+    if ((fread(&rec, sizeof(rec), 1, f) != 1) ||
+        (memcmp(rec.magic, CHECKPOINT_MAGIC, 8) != 0) ||
+        (rec.seq != seq))
+        return 0;
+
+    buf = malloc(rec.len);
+    s->buf = malloc(rec.raw_len);
+    if (!buf || !s->buf || (fread(buf, rec.len, 1, f) != 1) ||
+        (crc32(0, buf, rec.len) != rec.crc))
+        goto fail;
+
+    raw_len = rec.raw_len;
+    if ((uncompress(s->buf, &raw_len, buf, rec.len) != Z_OK) || (raw_len != rec.raw_len))
+        goto fail;
+
+    s->len = s->max = raw_len;
+    free(buf);
+    return 1;
+
+fail:
+    free(buf);
+    free(s->buf);
+    s->buf = NULL;
+    return 0;
+}
+
+/*
+ * Like shoebill_load_state(), but resume from the last complete checkpoint
+ * in the log at path.
+ */
+uint32_t shoebill_load_checkpoint(shoebill_config_t *config, const char *path)
+{
+    global_shoebill_context_t *saved = NULL;
+    snapshot_header_t header;
+    snap_stream_t cur, last;
+    long double saved_at = 0;
+    uint32_t count = 0;
+    FILE *f;
+
+    memset(&last, 0, sizeof(last));
+
+    f = fopen(path, "rb");
+    if (f == NULL) {
+        sprintf(config->error_msg, "Couldn't open checkpoint log [%s]\n", path);
+        return 0;
+    }
+
+    // Each record's RAM pages land on top of the last's, and the final record supplies the rest
+    while (_checkpoint_read_record(f, count, &cur)) {
+        if (!_read(&cur, &header, sizeof(header))) {
+            free(cur.buf);
+            goto corrupt;
+        }
+
+        if (count == 0) {
+            if (!_check_header(&header, config, path)) {
+                free(cur.buf);
+                goto fail;
+            }
+            config->ram_size = header.ram_size;
+            if (!shoebill_initialize(config)) {
+                free(cur.buf);
+                goto fail;
+            }
+            saved = malloc(sizeof(global_shoebill_context_t));
+            zero_ram();
+        }
+
+        if ((header.ram_size != shoe.physical_mem_size) ||
+            !_read(&cur, saved, sizeof(global_shoebill_context_t)) ||
+            !_read(&cur, shoe.fpu_state, header.fpu_size) ||
+            !_load_ram(&cur)) {
+            free(cur.buf);
+            goto corrupt;
+        }
+
+        saved_at = header.saved_at;
+        free(last.buf);
+        last = cur; // positioned at its cards
+        count++;
+    }
+
+    if (count == 0) {
+        sprintf(config->error_msg, "[%s] has no complete checkpoints\n", path);
+        goto fail;
+    }
+
+    if (!_load_cards(&last, config))
+        goto corrupt;
+
+    _merge_context(saved, _now() - saved_at);
+
+    slog("shoebill_load_checkpoint: resumed from checkpoint %u\n", count - 1);
+    free(last.buf);
+    free(saved);
+    fclose(f);
+    return 1;
+
+corrupt:
+    sprintf(config->error_msg, "Checkpoint log [%s] is corrupt\n", path);
+    if (saved) // shoebill_initialize() went through
+        _abandon_machine();
+fail:
+    free(last.buf);
+    if (saved)
+        free(saved);
+    fclose(f);
+    return 0;
+}
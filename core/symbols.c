@@ -0,0 +1,286 @@
+/*
+ * Copyright (c) 2014, Peter Rutenbar <pruten@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Symbol lookup for the kernel's COFF symbols, the Mac II ROM map, and
+ * the A-trap names. Address lookups binary-search a flat sorted array of
+ * addresses, name lookups go through an open-addressed hash table.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include "../core/shoebill.h"
+
+symbol_index_t* symbol_index_new(alloc_pool_t *parent_pool, uint32_t max)
+{
+    alloc_pool_t *pool = p_new_pool(parent_pool);
+    symbol_index_t *idx = p_calloc(pool, symbol_index_t, 1);
+    
+    idx->pool = pool;
+    idx->max = max;
+    idx->entries = p_calloc(pool, symbol_entry_t, max);
+    idx->flags = p_calloc(pool, uint8_t, max);
+    
+    return idx;
+}
+
+void symbol_index_free(symbol_index_t *idx)
+{
+    p_free_pool(idx->pool);
+}
+
+void symbol_index_add(symbol_index_t *idx, uint32_t addr, const char *name, uint32_t payload, uint8_t flags)
+{
+    assert(idx->count < idx->max);
+    
+    if ((flags & SYMBOL_NAME) && ((name == NULL) || (name[0] == 0)))
+        flags &= ~SYMBOL_NAME;
+    
+    idx->entries[idx->count].addr = addr;
+    idx->entries[idx->count].payload = payload;
+    idx->entries[idx->count].name = name;
+    idx->flags[idx->count] = flags;
+    idx->count++;
+}
+
+static uint32_t _name_hash(const char *name)
+{
+    uint32_t hash = 2166136261u; // FNV-1a
+    for (; *name; name++)
+        hash = (hash ^ (uint8_t)*name) * 16777619u;
+    return hash;
+}
+
+typedef struct {
+    uint32_t addr, entry;
+} _addr_pair_t;
+
+static int _addr_pair_cmp(const void *_a, const void *_b)
+{
+    const _addr_pair_t *a = (const _addr_pair_t*)_a, *b = (const _addr_pair_t*)_b;
+    
+    if (a->addr != b->addr)
+        return (a->addr < b->addr) ? -1 : 1;
+    return (a->entry < b->entry) ? -1 : (a->entry > b->entry);
+}
+
+void symbol_index_finish(symbol_index_t *idx)
+{
+    _addr_pair_t *pairs = p_calloc(idx->pool, _addr_pair_t, idx->count + 1);
+    uint32_t i, n = 0, size = 16;
+    
+    // --- Sorted addresses ---
+    
+    for (i=0; i < idx->count; i++) {
+        if (idx->flags[i] & SYMBOL_ADDR) {
+            pairs[n].addr = idx->entries[i].addr;
+            pairs[n].entry = i;
+            n++;
+        }
+    }
+    qsort(pairs, n, sizeof(_addr_pair_t), _addr_pair_cmp);
+    
+    idx->addrs = p_calloc(idx->pool, uint32_t, n + 1);
+    idx->addr_entries = p_calloc(idx->pool, uint32_t, n + 1);
+    idx->num_addrs = 0;
+    for (i=0; i<n; i++) {
+        // For duplicate addresses, keep the last one added (like rb_insert() did)
+        if ((i + 1 < n) && (pairs[i + 1].addr == pairs[i].addr))
+            continue;
+        idx->addrs[idx->num_addrs] = pairs[i].addr;
+        idx->addr_entries[idx->num_addrs] = pairs[i].entry;
+        idx->num_addrs++;
+    }
+    p_free(pairs);
+    
+    // --- Name hash (at most half full) ---
+    
+    while (size < (idx->count * 2))
+        size *= 2;
+    idx->name_slots = p_calloc(idx->pool, uint32_t, size);
+    idx->name_mask = size - 1;
+    
+    for (i=0; i < idx->count; i++) {
+        if (!(idx->flags[i] & SYMBOL_NAME))
+            continue;
+        
+        const char *name = idx->entries[i].name;
+        uint32_t slot = _name_hash(name) & idx->name_mask;
+        
+        for (; idx->name_slots[slot]; slot = (slot + 1) & idx->name_mask) {
+            if (strcmp(idx->entries[idx->name_slots[slot] - 1].name, name) == 0)
+                break;
+        }
+        // For duplicate names, keep the first one added (like the old linear search)
+        if (idx->name_slots[slot] == 0)
+            idx->name_slots[slot] = i + 1;
+    }
+}
+
+/*
+ * Find the entry with the highest address <= addr
+ */
+const symbol_entry_t* symbol_find_addr(const symbol_index_t *idx, uint32_t addr)
+{
+    const uint32_t *base = idx->addrs;
+    uint32_t n = idx->num_addrs;
+    
+    if ((n == 0) || (addr < base[0]))
+        return NULL;
+    
+    // Branch-free binary search: base[0] <= addr stays true throughout
+    while (n > 1) {
+        const uint32_t half = n >> 1;
+        base = (base[half] <= addr) ? (base + half) : base;
+        n -= half;
+    }
+    
+    return &idx->entries[idx->addr_entries[base - idx->addrs]];
+}
+
+const symbol_entry_t* symbol_find_name(const symbol_index_t *idx, const char *name)
+{
+    uint32_t slot;
+    
+    if (idx->name_slots == NULL)
+        return NULL;
+    
+    for (slot = _name_hash(name) & idx->name_mask; idx->name_slots[slot]; slot = (slot + 1) & idx->name_mask) {
+        const symbol_entry_t *entry = &idx->entries[idx->name_slots[slot] - 1];
+        if (strcmp(entry->name, name) == 0)
+            return entry;
+    }
+    return NULL;
+}
+
+#pragma mark ROM and A-trap symbols
+
+/*
+ * The ROM map and A-trap names never change, so they share one index,
+ * built the first time it's needed. ROM entries' addresses are offsets
+ * into the ROM, A-trap entries (name-only) carry their trap word.
+ */
+
+#define SYMBOL_PAYLOAD_ROM 0
+#define SYMBOL_PAYLOAD_ATRAP 1
+
+static pthread_once_t rom_index_once = PTHREAD_ONCE_INIT;
+static symbol_index_t *rom_index;
+
+static void _build_rom_index (void)
+{
+    uint32_t i, count = 0;
+    
+    while (macii_rom_symbols[count].name)
+        count++;
+    
+    rom_index = symbol_index_new(NULL, count + 4096);
+    
+    for (i=0; i<count; i++)
+        symbol_index_add(rom_index, macii_rom_symbols[i].addr, macii_rom_symbols[i].name,
+                         SYMBOL_PAYLOAD_ROM, SYMBOL_ADDR | SYMBOL_NAME);
+    for (i=0; i<4096; i++) {
+        if (atrap_names[i])
+            symbol_index_add(rom_index, 0xa000 | i, atrap_names[i], SYMBOL_PAYLOAD_ATRAP, SYMBOL_NAME);
+    }
+    
+    symbol_index_finish(rom_index);
+}
+
+/* pc is any address the ROM is mapped at */
+const char* symbol_rom(uint32_t pc, uint32_t *offset)
+{
+    const symbol_entry_t *entry;
+    uint32_t addr;
+    
+    if (shoe.physical_rom_size == 0)
+        return NULL;
+    
+    pthread_once(&rom_index_once, _build_rom_index);
+    
+    addr = pc % shoe.physical_rom_size;
+    if ((entry = symbol_find_addr(rom_index, addr)) == NULL)
+        return NULL;
+    
+    *offset = addr - entry->addr;
+    return entry->name;
+}
+
+#pragma mark Unified lookups
+
+const char* symbol_kernel(uint32_t pc, uint32_t *offset)
+{
+    coff_symbol *symb;
+    
+    if ((shoe.coff == NULL) || ((symb = coff_find_func(shoe.coff, pc)) == NULL))
+        return NULL;
+    if (strlen(symb->name) == 0)
+        return NULL;
+    
+    *offset = pc - symb->value;
+    return symb->name;
+}
+
+/*
+ * ROM symbols apply to the ROM's physical address in either mode, and to its
+ * user-mode mapping at 0x1xxxxxxx. Kernel symbols only mean anything in supervisor mode.
+ */
+const char* symbol_for_pc(uint32_t pc, _Bool supervisor, uint32_t *offset)
+{
+    if (((pc >> 28) == 4) || (!supervisor && ((pc >> 28) == 1)))
+        return symbol_rom(pc, offset);
+    if (supervisor)
+        return symbol_kernel(pc, offset);
+    return NULL;
+}
+
+/*
+ * Look up a name in the kernel's symbols, then the ROM's (giving its
+ * address at 0x40000000), then the A-traps (giving the trap word).
+ */
+_Bool symbol_lookup(const char *name, uint32_t *value)
+{
+    const symbol_entry_t *entry;
+    coff_symbol *symb;
+    
+    if (shoe.coff && (symb = coff_find_symbol(shoe.coff, name))) {
+        *value = symb->value;
+        return 1;
+    }
+    
+    pthread_once(&rom_index_once, _build_rom_index);
+    
+    if ((entry = symbol_find_name(rom_index, name)) == NULL)
+        return 0;
+    
+    if (entry->payload == SYMBOL_PAYLOAD_ATRAP)
+        *value = entry->addr;
+    else
+        *value = 0x40000000 + entry->addr;
+    return 1;
+}
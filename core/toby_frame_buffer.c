@@ -40,6 +40,12 @@ uint8_t macii_video_rom[ROM_SIZE] = {
      */
 };
 
+// Force the next nubus_tfb_get_frame() to redraw the whole screen
+static void _mark_all_dirty(shoebill_card_tfb_t *ctx)
+{
+    memset(ctx->dirty, 1, ctx->dirty_len);
+}
+
 static void nubus_tfb_clut_translate(shoebill_card_tfb_t *ctx)
 {
     uint32_t i, gli = 0;
@@ -93,6 +99,10 @@ void nubus_tfb_init(void *_ctx, uint8_t slotnum)
     ctx->rom = p_calloc(shoe.pool, uint8_t, 4096);
     ctx->clut = p_calloc(shoe.pool, uint8_t, 256 * 3);
     
+    // Let the CPU read/write the frame buffer (0x00000-0x7ffff) directly
+    ctx->dirty = nubus_map_direct_window(slotnum, ctx->direct_buf, 0x000fffff, 512 * 1024);
+    ctx->dirty_len = nubus_dirty_len(512 * 1024);
+    
     ctx->clut_idx = 786;
     ctx->line_offset = 0;
     
@@ -195,6 +205,7 @@ void nubus_tfb_write_func(const uint32_t rawaddr, const uint32_t size,
             for (i=0; i<size; i++) {
                 ctx->direct_buf[addr + size - (i+1)] = (data >> (8*i)) & 0xFF;
             }
+            ctx->dirty[addr >> NUBUS_DIRTY_SHIFT] = 1;
             return ;
         }
             
@@ -212,11 +223,13 @@ void nubus_tfb_write_func(const uint32_t rawaddr, const uint32_t size,
                     ctx->depth = 8;
                 else
                     assert(!"Can't figure out the color depth!");
+                _mark_all_dirty(ctx);
                 return ;
             }
             
             if (addr == 0x8000c) { // horizontal offset
                 ctx->line_offset = 4 * ((~data) & 0xff);
+                _mark_all_dirty(ctx);
                 return ;
             }
             else {
@@ -232,6 +245,7 @@ void nubus_tfb_write_func(const uint32_t rawaddr, const uint32_t size,
                 clut[ctx->clut_idx] = 255 - (data & 0xff);
             
                 ctx->clut_idx = (ctx->clut_idx == 0) ? 767 : ctx->clut_idx-1;
+                _mark_all_dirty(ctx);
                 
                 return ;
             }
@@ -273,7 +287,14 @@ shoebill_video_frame_info_t nubus_tfb_get_frame(shoebill_card_tfb_t *ctx,
     if (just_params)
         return result;
     
-    nubus_tfb_clut_translate(ctx);
+    // line_offset scrolls the whole frame, so any write means a full translation
+    uint32_t i;
+    for (i=0; (i < ctx->dirty_len) && !ctx->dirty[i]; i++) ;
+    if (i < ctx->dirty_len) {
+        memset(ctx->dirty, 0, ctx->dirty_len);
+        nubus_tfb_clut_translate(ctx);
+        __atomic_fetch_add(&shoe.stats.frames_converted, 1, __ATOMIC_RELAXED);
+    }
     
     result.buf = ctx->temp_buf;
     return result;
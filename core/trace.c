@@ -0,0 +1,436 @@
+/*
+ * Copyright (c) 2014, Peter Rutenbar <pruten@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Binary execution traces. While a trace is running, the CPU thread calls
+ * trace_step() instead of cpu_step(), which wraps each instruction in
+ * records (see TRACE_REC_* in shoebill.h):
+ *
+ *   INST or INST_PC   the instruction's words (the pc only when it didn't
+ *                     just fall through from the last instruction)
+ *   MEM               each logical_get()/logical_set() it made (optional)
+ *   REGS              the d/a registers and sr that it changed
+ *   EXCEPTION         if it (or an interrupt before it) took an exception
+ *
+ * Records are appended to a 1MB chunk that only the CPU thread touches.
+ * Full chunks are handed off through a ring to a writer thread, which
+ * gzwrite()s them, so the CPU thread never waits on the disk unless the
+ * ring fills up. The trace/ directory has a decoder that disassembles
+ * traces with disassemble_inst().
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <zlib.h>
+#include "shoebill.h"
+
+#define TRACE_CHUNK_SIZE (1024 * 1024)
+#define TRACE_CHUNKS 16
+#define TRACE_MAX_MEM 64 // memory records kept per instruction
+#define TRACE_SLACK 4096 // more than one instruction's worth of records
+
+typedef struct {
+    uint32_t addr;
+    uint8_t flags, size;
+    uint64_t dat;
+} trace_mem_t;
+
+struct _tracer_t {
+    shoebill_machine_t *machine;
+    gzFile f;
+    pthread_t threadid;
+    
+    // The ring of chunks. head is only advanced by the CPU thread, tail only by the writer
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint8_t *chunks[TRACE_CHUNKS];
+    uint32_t lens[TRACE_CHUNKS];
+    volatile uint32_t head, tail;
+    volatile _Bool tear_down, write_failed;
+    
+    // The chunk the CPU thread is filling
+    uint8_t *cur;
+    uint32_t used;
+    
+    // Registers as of the last record, and where the next instruction would be if nothing jumps
+    uint32_t regs[16];
+    uint16_t sr;
+    uint32_t seq_pc;
+    
+    trace_mem_t mem[TRACE_MAX_MEM];
+    uint32_t num_mem, dropped;
+    
+    uint64_t instructions, bytes;
+};
+
+typedef struct _tracer_t tracer_t;
+
+#pragma mark Writer thread
+
+static void* _trace_writer_thread (void *arg)
+{
+    tracer_t *tr = (tracer_t*)arg;
+    
+    pthread_mutex_lock(&tr->lock);
+    while (1) {
+        while ((tr->head == tr->tail) && !tr->tear_down)
+            pthread_cond_wait(&tr->cond, &tr->lock);
+        
+        if (tr->head == tr->tail)
+            break; // torn down, and nothing left to write
+        
+        const uint32_t i = tr->tail % TRACE_CHUNKS;
+        pthread_mutex_unlock(&tr->lock);
+        
+        if (gzwrite(tr->f, tr->chunks[i], tr->lens[i]) != (int)tr->lens[i])
+            tr->write_failed = 1;
+        
+        pthread_mutex_lock(&tr->lock);
+        tr->tail++;
+        pthread_cond_signal(&tr->cond); // the CPU thread may be waiting for a free chunk
+    }
+    pthread_mutex_unlock(&tr->lock);
+    return NULL;
+}
+
+/* Hand the current chunk to the writer, and start filling the next free one */
+static void _flush_chunk (tracer_t *tr)
+{
+    if (tr->used == 0)
+        return ;
+    
+    pthread_mutex_lock(&tr->lock);
+    tr->lens[tr->head % TRACE_CHUNKS] = tr->used;
+    tr->head++;
+    pthread_cond_signal(&tr->cond);
+    
+    while ((tr->head - tr->tail) >= TRACE_CHUNKS)
+        pthread_cond_wait(&tr->cond, &tr->lock);
+    pthread_mutex_unlock(&tr->lock);
+    
+    tr->bytes += tr->used;
+    tr->cur = tr->chunks[tr->head % TRACE_CHUNKS];
+    tr->used = 0;
+}
+
+#pragma mark Recording
+
+/*
+ * Records are built through a local cursor (out) rather than tr->used, so
+ * the compiler doesn't have to assume every byte stored might alias shoe
+ */
+#define put(type, v) do { \
+    const type _v = (v); \
+    memcpy(out, &_v, sizeof(type)); \
+    out += sizeof(type); \
+} while (0)
+
+static uint8_t* _put_start (tracer_t *tr, uint8_t *out)
+{
+    uint32_t i;
+    
+    memcpy(&tr->regs[0], shoe.d, 8 * sizeof(uint32_t));
+    memcpy(&tr->regs[8], shoe.a, 8 * sizeof(uint32_t));
+    tr->sr = shoe.sr;
+    tr->seq_pc = shoe.pc;
+    
+    put(uint8_t, TRACE_REC_START);
+    put(uint32_t, shoe.pc);
+    put(uint16_t, tr->sr);
+    for (i=0; i<16; i++)
+        put(uint32_t, tr->regs[i]);
+    return out;
+}
+
+static uint8_t* _put_regs (tracer_t *tr, uint8_t *out)
+{
+    uint32_t i, mask = 0, regs[16];
+    const uint16_t sr = shoe.sr;
+    
+    memcpy(&regs[0], shoe.d, 8 * sizeof(uint32_t));
+    memcpy(&regs[8], shoe.a, 8 * sizeof(uint32_t));
+    
+    for (i=0; i<16; i++)
+        mask |= (regs[i] != tr->regs[i]) << i;
+    mask |= (sr != tr->sr) << 16;
+    
+    if (mask == 0)
+        return out;
+    
+    put(uint8_t, TRACE_REC_REGS);
+    put(uint32_t, mask);
+    
+    // Only visit the registers that changed (usually one or two)
+    uint32_t remaining = mask & 0xffff;
+    while (remaining) {
+        i = __builtin_ctz(remaining);
+        remaining &= remaining - 1;
+        put(uint32_t, regs[i]);
+    }
+    if (mask & (1 << 16))
+        put(uint16_t, sr);
+    
+    memcpy(tr->regs, regs, sizeof(regs));
+    tr->sr = sr;
+    return out;
+}
+
+static uint8_t* _put_exception (tracer_t *tr, uint8_t *out)
+{
+    put(uint8_t, TRACE_REC_EXCEPTION);
+    put(uint16_t, shoe.last_vector);
+    put(uint32_t, shoe.pc);
+    shoe.last_vector = TRACE_NO_VECTOR;
+    tr->seq_pc = 0xffffffff;
+    return out;
+}
+
+/*
+ * Read words [first, max) of the instruction at pc without faulting, and
+ * without wandering off the page the first of them is on (the next page
+ * could be unmapped, or worse, I/O). Returns how far it got.
+ */
+static uint32_t _fetch_words (uint32_t pc, uint16_t *words, uint32_t first, uint32_t max)
+{
+    const uint32_t pagemask = shoe.tc_enable ? shoe.tc_pagemask : 0xfff;
+    const uint32_t addr = pc + 2 * first;
+    const _Bool old_abort = shoe.abort;
+    uint32_t i, avail;
+    
+    // pccache_nextword() asserts on these, rather than faulting
+    if ((pc & 1) || (!shoe.tc_enable && (addr >= 0x50000000)))
+        return first;
+    
+    shoe.suppress_exceptions = 1;
+    shoe.abort = 0;
+    words[first] = pccache_nextword(addr);
+    if (shoe.abort) {
+        avail = first;
+        goto done;
+    }
+    
+    avail = first + ((pagemask + 1) - (addr & pagemask)) / 2;
+    if (avail > max)
+        avail = max;
+    
+    // The rest of the page is right there in the pc cache
+    if (shoe.tc_enable) {
+        const uint8_t *ptr = shoe.pccache_ptr + (addr & pagemask);
+        for (i = first + 1; i < avail; i++)
+            words[i] = ntohs(*(uint16_t*)(ptr + 2 * (i - first)));
+    }
+    else {
+        for (i = first + 1; i < avail; i++)
+            words[i] = pccache_nextword(pc + 2 * i);
+    }
+    
+done:
+    shoe.abort = old_abort;
+    shoe.suppress_exceptions = 0;
+    return avail;
+}
+
+/* Called by logical_get()/logical_set() while shoe.trace_mem is set */
+void trace_mem_access (uint32_t addr, uint32_t size, uint64_t dat, _Bool is_write)
+{
+    tracer_t *tr = shoe.tracer;
+    
+    // Skip the debugger's (and profiler's) peeking
+    if (shoe.suppress_exceptions || (tr == NULL))
+        return ;
+    
+    if (tr->num_mem >= TRACE_MAX_MEM) {
+        tr->dropped++;
+        return ;
+    }
+    
+    trace_mem_t *m = &tr->mem[tr->num_mem++];
+    m->addr = addr;
+    m->size = size;
+    m->dat = dat;
+    m->flags = (is_write ? 1 : 0) | (shoe.abort ? 2 : 0);
+}
+
+/* Called by the CPU thread instead of cpu_step() while SHOEBILL_STATE_TRACE is set */
+void trace_step (void)
+{
+    tracer_t *tr = shoe.tracer;
+    uint16_t words[TRACE_MAX_INST_WORDS];
+    uint32_t i, num_words;
+    uint8_t *out;
+    
+    if (tr->used > (TRACE_CHUNK_SIZE - TRACE_SLACK))
+        _flush_chunk(tr);
+    out = tr->cur + tr->used;
+    
+    // An interrupt (or anything else) that happened since the last instruction
+    if (shoe.last_vector != TRACE_NO_VECTOR) {
+        out = _put_regs(tr, out);
+        out = _put_exception(tr, out);
+    }
+    
+    const uint32_t pc = shoe.pc;
+    const uint32_t fetched = _fetch_words(pc, words, 0, TRACE_MAX_INST_WORDS);
+    
+    tr->num_mem = 0;
+    tr->dropped = 0;
+    
+    cpu_step();
+    tr->instructions++;
+    
+    // If it fell through without an exception, we know exactly how long it was
+    const uint32_t len = shoe.pc - pc;
+    if ((shoe.last_vector == TRACE_NO_VECTOR) && (len >= 2) && (len <= (2 * TRACE_MAX_INST_WORDS))) {
+        num_words = len / 2;
+        if (fetched < num_words) // it crossed a page
+            num_words = _fetch_words(pc, words, fetched, num_words);
+    }
+    else
+        num_words = fetched;
+    
+    if (pc == tr->seq_pc)
+        put(uint8_t, TRACE_REC_INST);
+    else {
+        put(uint8_t, TRACE_REC_INST_PC);
+        put(uint32_t, pc);
+    }
+    put(uint8_t, num_words);
+    for (i=0; i<num_words; i++)
+        put(uint16_t, words[i]);
+    tr->seq_pc = pc + 2 * num_words;
+    
+    for (i=0; i<tr->num_mem; i++) {
+        put(uint8_t, TRACE_REC_MEM);
+        put(uint8_t, tr->mem[i].flags);
+        put(uint8_t, tr->mem[i].size);
+        put(uint32_t, tr->mem[i].addr);
+        put(uint64_t, tr->mem[i].dat);
+    }
+    if (tr->dropped) {
+        put(uint8_t, TRACE_REC_DROPPED);
+        put(uint32_t, tr->dropped);
+    }
+    
+    out = _put_regs(tr, out);
+    
+    if (shoe.last_vector != TRACE_NO_VECTOR)
+        out = _put_exception(tr, out);
+    
+    tr->used = out - tr->cur;
+}
+
+#undef put
+
+#pragma mark Public interfaces
+
+uint32_t shoebill_trace_start (const char *path, _Bool compress, _Bool memory)
+{
+    const uint32_t byte_order = TRACE_BYTE_ORDER;
+    const uint32_t version = TRACE_VERSION;
+    const uint32_t flags = memory ? TRACE_FLAG_MEMORY : 0;
+    tracer_t *tr;
+    uint32_t i;
+    
+    if (shoe.tracer)
+        return 0;
+    
+    tr = calloc(1, sizeof(tracer_t));
+    tr->machine = shoebill_current_machine();
+    
+    // "T" is zlib for "don't actually compress"
+    tr->f = gzopen(path, compress ? "wb1" : "wbT");
+    if (tr->f == NULL) {
+        slog("trace: can't open %s for writing\n", path);
+        free(tr);
+        return 0;
+    }
+    
+    if ((gzwrite(tr->f, TRACE_MAGIC, 8) != 8) ||
+        (gzwrite(tr->f, &version, 4) != 4) ||
+        (gzwrite(tr->f, &byte_order, 4) != 4) ||
+        (gzwrite(tr->f, &flags, 4) != 4)) {
+        gzclose(tr->f);
+        free(tr);
+        return 0;
+    }
+    
+    for (i=0; i<TRACE_CHUNKS; i++)
+        tr->chunks[i] = malloc(TRACE_CHUNK_SIZE);
+    tr->cur = tr->chunks[0];
+    
+    pthread_mutex_init(&tr->lock, NULL);
+    pthread_cond_init(&tr->cond, NULL);
+    pthread_create(&tr->threadid, NULL, _trace_writer_thread, tr);
+    
+    // Start at an instruction boundary
+    pause_cpu_thread();
+    
+    shoe.tracer = tr;
+    shoe.last_vector = TRACE_NO_VECTOR;
+    tr->used = _put_start(tr, tr->cur) - tr->cur;
+    shoe.trace_mem = memory;
+    __sync_fetch_and_or(&shoe.cpu_thread_notifications, SHOEBILL_STATE_TRACE);
+    
+    resume_cpu_thread();
+    return 1;
+}
+
+void shoebill_trace_stop (void)
+{
+    tracer_t *tr = shoe.tracer;
+    uint32_t i;
+    
+    if (tr == NULL)
+        return ;
+    
+    pause_cpu_thread();
+    __sync_fetch_and_and(&shoe.cpu_thread_notifications, ~SHOEBILL_STATE_TRACE);
+    shoe.trace_mem = 0;
+    shoe.tracer = NULL;
+    resume_cpu_thread();
+    
+    _flush_chunk(tr);
+    
+    pthread_mutex_lock(&tr->lock);
+    tr->tear_down = 1;
+    pthread_cond_signal(&tr->cond);
+    pthread_mutex_unlock(&tr->lock);
+    pthread_join(tr->threadid, NULL);
+    
+    if ((gzclose(tr->f) != Z_OK) || tr->write_failed)
+        slog("trace: write failed, the trace is truncated\n");
+    
+    slog("trace: %llu instructions, %llu bytes before compression\n",
+         (unsigned long long)tr->instructions, (unsigned long long)tr->bytes);
+    
+    pthread_mutex_destroy(&tr->lock);
+    pthread_cond_destroy(&tr->cond);
+    for (i=0; i<TRACE_CHUNKS; i++)
+        free(tr->chunks[i]);
+    free(tr);
+}
@@ -0,0 +1,336 @@
+/*
+ * Copyright (c) 2014, Peter Rutenbar <pruten@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * A flight recorder for tp() tracepoints. Each thread that hits a compiled-in
+ * tracepoint gets its own ring of fixed-size records, so recording is just a
+ * gettimeofday() and a few stores, with no locking and no formatting.
+ * The rings are merged by time and formatted when they're dumped, either by
+ * shoebill_tracepoint_dump(), or from a SIGABRT handler when an assert fails.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include "../core/shoebill.h"
+
+#define TP_RING_SIZE 4096 // records per thread, a power of two
+#define TP_MAX_RINGS 64 // rings beyond this aren't dumped
+
+typedef struct {
+    uint64_t usecs;
+    const char *fmt;
+    uint32_t category, level;
+    uint64_t args[TP_MAX_ARGS];
+} tp_record_t;
+
+typedef struct _tp_ring_t {
+    struct _tp_ring_t *next;
+    uint32_t index; // the order in which threads first recorded something
+    _Bool in_use; // false once the owning thread exits, then the ring can be reused
+    volatile uint64_t head; // the number of records ever written
+    tp_record_t records[TP_RING_SIZE];
+} tp_ring_t;
+
+static const char *category_names[] = {
+    "core", "cpu", "mem", "interrupt", "scsi", "ethernet", "adb", "video"
+};
+
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t tp_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ring_key;
+static struct sigaction old_abort_action;
+static tp_ring_t *rings;
+static uint32_t ring_count;
+
+static __thread tp_ring_t *thread_ring;
+
+static uint32_t _dump (FILE *f);
+
+static void _abort_handler (int sig)
+{
+    // Not async-signal-safe, but the process is going down anyway
+    fprintf(stderr, "shoebill: abort, dumping tracepoints\n");
+    _dump(stderr);
+    fflush(stderr);
+    
+    sigaction(SIGABRT, &old_abort_action, NULL);
+    raise(SIGABRT);
+}
+
+static void _release_ring (void *ring)
+{
+    ((tp_ring_t*)ring)->in_use = 0;
+}
+
+static void _init (void)
+{
+    struct sigaction sa;
+    
+    pthread_key_create(&ring_key, _release_ring);
+    
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = _abort_handler;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGABRT, &sa, &old_abort_action);
+}
+
+static tp_ring_t* _claim_ring (void)
+{
+    tp_ring_t *ring;
+    
+    pthread_once(&tp_once, _init);
+    
+    // Reuse an exited thread's ring, if there is one (its old records stay dumpable)
+    assert(pthread_mutex_lock(&rings_lock) == 0);
+    for (ring = rings; ring && ring->in_use; ring = ring->next) ;
+    if (ring == NULL) {
+        ring = calloc(1, sizeof(tp_ring_t));
+        if (ring) {
+            ring->index = ring_count++;
+            ring->next = rings;
+            rings = ring;
+        }
+    }
+    if (ring)
+        ring->in_use = 1;
+    assert(pthread_mutex_unlock(&rings_lock) == 0);
+    
+    if (ring)
+        pthread_setspecific(ring_key, ring);
+    return ring;
+}
+
+void tp_record (uint32_t category, uint32_t level, const char *fmt,
+                uint64_t a, uint64_t b, uint64_t c, uint64_t d, uint64_t e)
+{
+    tp_ring_t *ring = thread_ring;
+    struct timeval now;
+    
+    if sunlikely(ring == NULL) {
+        if ((ring = thread_ring = _claim_ring()) == NULL)
+            return ;
+    }
+    
+    tp_record_t *rec = &ring->records[ring->head & (TP_RING_SIZE - 1)];
+    
+    gettimeofday(&now, NULL);
+    rec->usecs = (((uint64_t)now.tv_sec) * 1000000) + now.tv_usec;
+    rec->fmt = fmt;
+    rec->category = category;
+    rec->level = level;
+    rec->args[0] = a;
+    rec->args[1] = b;
+    rec->args[2] = c;
+    rec->args[3] = d;
+    rec->args[4] = e;
+    
+    ring->head++;
+}
+
+#pragma mark Dumping
+
+/*
+ * Format a record's fmt with its stored arguments. The arguments lost their
+ * types when they were recorded, so each conversion is redone with a type
+ * that fits it (length modifiers in fmt just say whether it was 64 bits).
+ */
+static void _print_message (FILE *f, const tp_record_t *rec)
+{
+    const char *c = rec->fmt;
+    uint32_t arg = 0;
+    
+    while (*c) {
+        char spec[32];
+        uint32_t len = 0, longs = 0;
+        
+        if (*c != '%') {
+            fputc(*c++, f);
+            continue;
+        }
+        if (c[1] == '%') {
+            fputc('%', f);
+            c += 2;
+            continue;
+        }
+        
+        // Keep the flags, width and precision
+        spec[len++] = *c++;
+        while (*c && strchr("-+ #0123456789.", *c) && (len < (sizeof(spec) - 4)))
+            spec[len++] = *c++;
+        for (; *c && strchr("hlLqjzt", *c); c++)
+            longs += (*c != 'h');
+        if (*c == 0)
+            break;
+        
+        const char conv = *c++;
+        const uint64_t v = (arg < TP_MAX_ARGS) ? rec->args[arg++] : 0;
+        
+        switch (conv) {
+            case 'd':
+            case 'i':
+                spec[len++] = 'l';
+                spec[len++] = 'l';
+                spec[len++] = conv;
+                spec[len] = 0;
+                fprintf(f, spec, longs ? (long long)v : (long long)(int32_t)v);
+                break;
+            case 'u':
+            case 'x':
+            case 'X':
+            case 'o':
+                spec[len++] = 'l';
+                spec[len++] = 'l';
+                spec[len++] = conv;
+                spec[len] = 0;
+                fprintf(f, spec, longs ? (unsigned long long)v : (unsigned long long)(uint32_t)v);
+                break;
+            case 'c':
+                spec[len++] = 'c';
+                spec[len] = 0;
+                fprintf(f, spec, (int)v);
+                break;
+            case 's':
+                spec[len++] = 's';
+                spec[len] = 0;
+                fprintf(f, spec, v ? (const char*)(uintptr_t)v : "(null)");
+                break;
+            case 'p':
+                fprintf(f, "%p", (void*)(uintptr_t)v);
+                break;
+            default:
+                fputc('?', f);
+                break;
+        }
+    }
+    
+    if ((c == rec->fmt) || (c[-1] != '\n'))
+        fputc('\n', f);
+}
+
+static void _print_record (FILE *f, const tp_record_t *rec, uint32_t thread, uint64_t start)
+{
+    const char *category = "?";
+    const uint64_t usecs = rec->usecs - start;
+    uint32_t i;
+    
+    for (i=0; i < (sizeof(category_names) / sizeof(category_names[0])); i++) {
+        if (rec->category & (1 << i)) {
+            category = category_names[i];
+            break;
+        }
+    }
+    
+    fprintf(f, "%4llu.%06llu t%u %c %-9s ",
+            (unsigned long long)(usecs / 1000000), (unsigned long long)(usecs % 1000000),
+            thread, "?EID"[rec->level & 3], category);
+    _print_message(f, rec);
+}
+
+/*
+ * Merge the rings by time. This doesn't allocate, so it's usable from the
+ * abort handler. Threads keep recording while this runs, so the oldest
+ * records of a busy ring might get overwritten mid-dump.
+ */
+static uint32_t _dump (FILE *f)
+{
+    tp_ring_t *ring_ptrs[TP_MAX_RINGS], *ring;
+    uint64_t pos[TP_MAX_RINGS], end[TP_MAX_RINGS];
+    uint64_t start = ~0ULL;
+    uint32_t i, n = 0, count = 0;
+    
+    // If an assert fired while holding the lock, dump anyway
+    const _Bool locked = (pthread_mutex_trylock(&rings_lock) == 0);
+    
+    for (ring = rings; ring && (n < TP_MAX_RINGS); ring = ring->next) {
+        ring_ptrs[n] = ring;
+        end[n] = ring->head;
+        pos[n] = (end[n] > TP_RING_SIZE) ? (end[n] - TP_RING_SIZE) : 0;
+        if ((pos[n] < end[n]) && (ring->records[pos[n] & (TP_RING_SIZE - 1)].usecs < start))
+            start = ring->records[pos[n] & (TP_RING_SIZE - 1)].usecs;
+        n++;
+    }
+    
+    while (1) {
+        const tp_record_t *oldest = NULL;
+        uint32_t oldest_i = 0;
+        
+        for (i=0; i<n; i++) {
+            if (pos[i] >= end[i])
+                continue;
+            const tp_record_t *rec = &ring_ptrs[i]->records[pos[i] & (TP_RING_SIZE - 1)];
+            if ((oldest == NULL) || (rec->usecs < oldest->usecs)) {
+                oldest = rec;
+                oldest_i = i;
+            }
+        }
+        if (oldest == NULL)
+            break;
+        
+        _print_record(f, oldest, ring_ptrs[oldest_i]->index, start);
+        pos[oldest_i]++;
+        count++;
+    }
+    
+    if (locked)
+        pthread_mutex_unlock(&rings_lock);
+    
+    return count;
+}
+
+uint32_t shoebill_tracepoint_dump (const char *path)
+{
+    FILE *f = stderr;
+    
+    if (path && ((f = fopen(path, "w")) == NULL)) {
+        slog("shoebill_tracepoint_dump: couldn't open %s\n", path);
+        return 0;
+    }
+    
+    const uint32_t count = _dump(f);
+    slog("shoebill_tracepoint_dump: wrote %u records\n", count);
+    
+    if (f != stderr)
+        fclose(f);
+    else
+        fflush(f);
+    
+    return 1;
+}
+
+/* Held across fork() by shoebill_clone(), like coff_kernel_cache_lock() */
+void tp_lock_rings (void)
+{
+    pthread_mutex_lock(&rings_lock);
+}
+
+void tp_unlock_rings (void)
+{
+    pthread_mutex_unlock(&rings_lock);
+}
@@ -103,10 +103,12 @@ void process_pending_interrupt ()
     }
     
     shoe.cpu_thread_notifications &= ~~SHOEBILL_STATE_STOPPED;
+    shoe.stats.interrupts[priority]++;
+    shoe.last_vector = priority + 24;
     
     const uint16_t vector_offset = (priority + 24) * 4;
     
-    slog("Interrupt pri %u! mask=%u vector_offset=0x%08x\n", priority, sr_mask(), vector_offset);
+    tp(TP_INTERRUPT, TP_DEBUG, "interrupt: pri %u mask=%u pc=0x%08x sr=0x%04x", priority, sr_mask(), shoe.pc, shoe.sr);
     
     // Save the old SR, and switch to supervisor mode
     const uint16_t old_sr = shoe.sr;
@@ -114,15 +116,12 @@ void process_pending_interrupt ()
     
     // Write a "format 0" exception frame to ISP or MSP
     push_a7(0x0000 | vector_offset, 2);
-    slog("interrupt: pushed format 0x%04x to 0x%08x\n", 0x0000 | vector_offset, shoe.a[7]);
         assert(!shoe.abort);
     
     push_a7(shoe.pc, 4);
-    slog("interrupt: pushed pc 0x%08x to 0x%08x\n", shoe.pc, shoe.a[7]);
         assert(!shoe.abort);
     
     push_a7(old_sr, 2);
-    slog("interrupt: pushed sr 0x%04x to 0x%08x\n", old_sr, shoe.a[7]);
         assert(!shoe.abort);
     
     if (sr_m()) {
@@ -152,7 +151,7 @@ void process_pending_interrupt ()
     
     // Fetch the autovector handler address
     const uint32_t newpc = lget(shoe.vbr + vector_offset, 4);
-    slog("autovector handler = *0x%08x = 0x%08x\n", shoe.vbr + vector_offset, newpc);
+    tp(TP_INTERRUPT, TP_DEBUG, "interrupt: frame at 0x%08x, handler *0x%08x = 0x%08x", shoe.a[7], shoe.vbr + vector_offset, newpc);
     assert(!shoe.abort);
     
     shoe.pc = newpc;
@@ -272,8 +271,10 @@ static void handle_pram_read_byte (void)
             return ;
         }
         else if ((pram->command_i == 1) && isget) { // complete get command
-            const uint32_t now = time(NULL) + 0x7c25b080;
+            uint32_t now = time(NULL) + 0x7c25b080;
             //uint32_t now = 0xafd56d80; // Tue, 24 Jun 1997 12:26:40 GMT
+            if sunlikely(shoe.replayer)
+                now = replay_value(now);
             const uint8_t now_byte = now >> (8*addr);
             
             pram->mode = PRAM_WRITE;
@@ -610,11 +611,17 @@ static uint8_t via_read_reg(const uint8_t vianum, const uint8_t reg, const long
                 }
             }
             
+            // The counter comes from the host's clock, so it's part of a recording
+            if sunlikely(shoe.replayer)
+                counter = replay_value(counter);
+            
             return counter >> 8;
         }
         case VIA_T2C_LO: {
-            const uint16_t counter = via->t2c - (uint16_t)_via_get_delta_counter(via->t2_last_set);
+            uint16_t counter = via->t2c - (uint16_t)_via_get_delta_counter(via->t2_last_set);
             via->ifr &= ~~VIA_IFR_T2; // Read from T2C_LOW clears TIMER 2 interrupt
+            if sunlikely(shoe.replayer)
+                counter = replay_value(counter);
             return (uint8_t)counter;
         }
             
@@ -746,6 +753,7 @@ void via_write_raw (void)
     const uint8_t vianum = ((shoe.physical_addr >> 13) & 1) + 1;
     const uint8_t reg = (shoe.physical_addr >> 9) & 15;
     
+    shoe.stats.via_writes++;
     pthread_mutex_lock(&shoe.via_cpu_lock);
     
     if (shoe.physical_size == 1) {
@@ -776,6 +784,7 @@ void via_read_raw (void)
     const uint8_t vianum = ((shoe.physical_addr >> 13) & 1) + 1;
     const uint8_t reg = (shoe.physical_addr >> 9) & 15;
     
+    shoe.stats.via_reads++;
     pthread_mutex_lock(&shoe.via_cpu_lock);
     
     if (shoe.physical_size == 1) {
@@ -804,16 +813,39 @@ void via_read_raw (void)
     pthread_mutex_unlock(&shoe.via_cpu_lock);
 }
 
+/* Assert slotnum's nubus interrupt and raise VIA2 CA1. Call with via_cpu_lock held */
+void nubus_vbl_interrupt(uint8_t slotnum)
+{
+    if (shoe.slots[slotnum].interrupts_enabled) {
+        shoe.via[1].rega_input &= ~b(00111111) & ~~(1 << (slotnum - 9));
+        via_raise_interrupt(2, IFR_CA1);
+    }
+}
+
+/*
+ * Raise an interrupt from the clock thread. While recording, the CPU thread
+ * raises it instead (and while replaying, the log does). Call with via_cpu_lock held
+ */
+static void _clock_interrupt(uint8_t vianum, uint8_t ifr_bit)
+{
+    if (!replay_post(REPLAY_EV_VIA_IRQ, vianum, ifr_bit, 0, 0, NULL, 0))
+        via_raise_interrupt(vianum, ifr_bit);
+}
+
 #define fire(s) ({assert((s) >= 0); if (earliest_next_timer > (s)) earliest_next_timer = (s);})
 void *via_clock_thread(void *arg)
 {
+    shoe_ctx = arg;
     pthread_mutex_lock(&shoe.via_clock_thread_lock);
     // const long double multiplier = 1.0 / 60.0;
     const long double multiplier = 1.0;
     const long double start_time = multiplier * _now();
     uint64_t ca1_ticks = 0, ca2_ticks = 0;
+    uint64_t vbl_ticks[16];
     uint32_t i;
     
+    memset(vbl_ticks, 0, sizeof(vbl_ticks));
+    
     while (1) {
         pthread_mutex_lock(&shoe.via_cpu_lock);
         
@@ -839,7 +871,7 @@ void *via_clock_thread(void *arg)
             ca1_ticks = expected_ca1_ticks;
             
             // Raise VIA1 CA1
-            via_raise_interrupt(1, IFR_CA1);
+            _clock_interrupt(1, IFR_CA1);
         }
         
         // Check whether the 1hz timer should fire (via1 CA2)
@@ -850,7 +882,7 @@ void *via_clock_thread(void *arg)
             
             ca2_ticks = expected_ca2_ticks;
             
-            via_raise_interrupt(1, IFR_CA2);
+            _clock_interrupt(1, IFR_CA2);
             
             /*via_raise_interrupt(1, IFR_TIMER1);
             via_raise_interrupt(1, IFR_TIMER2);
@@ -858,11 +890,30 @@ void *via_clock_thread(void *arg)
             via_raise_interrupt(2, IFR_TIMER2);*/
         }
         
+        /*
+         * VBLs for each video card, at the card's own refresh rate.
+         * (These used to be sent by the GUI after each redraw, which
+         * tied guest timing to the host's swap interval.)
+         */
+        for (i=9; i<15; i++) {
+            const long double hz = shoe.slots[i].vbl_hz;
+            if (!shoe.slots[i].connected || (hz <= 0.0L))
+                continue;
+            
+            const uint64_t expected_vbl_ticks = ((now - start_time) * hz);
+            if (expected_vbl_ticks > vbl_ticks[i]) {
+                vbl_ticks[i] = expected_vbl_ticks;
+                if (!replay_post(REPLAY_EV_VBL, i, 0, 0, 0, NULL, 0))
+                    nubus_vbl_interrupt(i);
+            }
+            fire((1.0L/hz) - fmodl(now - start_time, 1.0L/hz));
+        }
+        
         // I'm only checking VIA1 T2, since the time manager only seems to use/care about that timer
         if (shoe.via[0].t2_interrupt_enabled) {
             if (via1_t2_delta >= shoe.via[0].t2c) {
                 shoe.via[0].t2_interrupt_enabled = 0;
-                via_raise_interrupt(1, IFR_TIMER2);
+                _clock_interrupt(1, IFR_TIMER2);
             }
             else {
                 fire((long double)(shoe.via[0].t2c - via1_t2_delta) / (E_CLOCK / 2.0));
@@ -75,9 +75,16 @@ static uint32_t compute_nubus_crc(uint8_t *rom, uint32_t len)
     return sum;
 }
 
+// Force the next nubus_video_get_frame() to redraw the whole screen
+static void _mark_all_dirty(shoebill_card_video_t *ctx)
+{
+    memset(ctx->dirty, 1, ctx->dirty_len);
+}
+
 static void _switch_depth(shoebill_card_video_t *ctx, uint32_t depth)
 {
     ctx->depth = depth;
+    _mark_all_dirty(ctx);
 }
 
 void nubus_video_init(void *_ctx, uint8_t slotnum,
@@ -96,6 +103,10 @@ void nubus_video_init(void *_ctx, uint8_t slotnum,
     ctx->clut = p_calloc(shoe.pool, video_ctx_color_t, 256);
     ctx->rom = p_calloc(shoe.pool, uint8_t, 4096);
     
+    // Let the CPU read/write video RAM directly (0xsxxxxxxx / 0xFsxxxxxx)
+    ctx->dirty = nubus_map_direct_window(slotnum, ctx->direct_buf, 0x00ffffff, ctx->pixels * 4);
+    ctx->dirty_len = nubus_dirty_len(ctx->pixels * 4);
+    
     // Set the depth and clut for B&W
     _switch_depth(ctx, 1);
     memset(ctx->clut, 0, 256 * 4);
@@ -170,6 +181,7 @@ uint32_t nubus_video_read_func(const uint32_t rawaddr, const uint32_t size,
     }
     
     // Else, this is video ram
+    // (Only reached for accesses that straddle the end of the direct window in mem.c)
     
     uint32_t i, result = 0;
     if slikely(addr < (ctx->pixels * 4)) {
@@ -282,6 +294,7 @@ void nubus_video_write_func(const uint32_t rawaddr, const uint32_t size,
                 case 2: { // Gray out screen buffer
                     
                     _gray_page(ctx);
+                    _mark_all_dirty(ctx);
                     
                     slog("nubus_magic: grey screen\n");
                     break;
@@ -294,16 +307,19 @@ void nubus_video_write_func(const uint32_t rawaddr, const uint32_t size,
                 }
                 case 4: { // Set red component of clut
                     ctx->clut[ctx->clut_idx].r = (data >> 8) & 0xff;
+                    _mark_all_dirty(ctx);
                     slog("nubus_magic: set %u.red = 0x%04x\n", ctx->clut_idx, data);
                     break;
                 }
                 case 5: { // Set green component of clut
                     ctx->clut[ctx->clut_idx].g = (data >> 8) & 0xff;
+                    _mark_all_dirty(ctx);
                     slog("nubus_magic: set %u.green = 0x%04x\n", ctx->clut_idx, data);
                     break;
                 }
                 case 6: { // Set blue component of clut
                     ctx->clut[ctx->clut_idx].b = (data >> 8) & 0xff;
+                    _mark_all_dirty(ctx);
                     slog("nubus_magic: set %u.blue = 0x%04x\n", ctx->clut_idx, data);
                     break;
                 }
@@ -324,6 +340,7 @@ void nubus_video_write_func(const uint32_t rawaddr, const uint32_t size,
                         ctx->clut[i].g = 0x80;
                         ctx->clut[i].b = 0x80;
                     }
+                    _mark_all_dirty(ctx);
                     break;
                 }
                 case 10: { // Use luminance (a.k.a. setGray)
@@ -339,6 +356,7 @@ void nubus_video_write_func(const uint32_t rawaddr, const uint32_t size,
     }
     
     // Else, this is video ram
+    // (Only reached for accesses that straddle the end of the direct window in mem.c)
     
     if slikely(addr < (ctx->pixels * 4)) {
         uint32_t mydata, myaddr;
@@ -346,17 +364,26 @@ void nubus_video_write_func(const uint32_t rawaddr, const uint32_t size,
             ((uint8_t*)ctx->direct_buf)[--myaddr] = mydata & 0xff;
             mydata >>= 8;
         }
+        ctx->dirty[addr >> NUBUS_DIRTY_SHIFT] = 1;
     }
 }
 
 
-static void _do_clut_translation(shoebill_card_video_t *ctx)
+/*
+ * Translate direct_buf bytes [start, end) into temp_buf pixels
+ * (start must be a multiple of 4)
+ */
+static void _do_clut_translation(shoebill_card_video_t *ctx, uint32_t start, uint32_t end)
 {
+    const uint32_t used = (ctx->pixels * ctx->depth) / 8;
     uint32_t i;
     
+    if (end > used)
+        end = used;
+    
     switch (ctx->depth) {
         case 1: {
-            for (i=0; i < ctx->pixels/8; i++) {
+            for (i=start; i < end; i++) {
                 const uint8_t byte = ctx->direct_buf[i];
                 ctx->temp_buf[i * 8 + 0] = ctx->clut[(byte >> 7) & 1];
                 ctx->temp_buf[i * 8 + 1] = ctx->clut[(byte >> 6) & 1];
@@ -370,7 +397,7 @@ static void _do_clut_translation(shoebill_card_video_t *ctx)
             break;
         }
         case 2: {
-            for (i=0; i < ctx->pixels/4; i++) {
+            for (i=start; i < end; i++) {
                 const uint8_t byte = ctx->direct_buf[i];
                 ctx->temp_buf[i * 4 + 0] = ctx->clut[(byte >> 6) & 3];
                 ctx->temp_buf[i * 4 + 1] = ctx->clut[(byte >> 4) & 3];
@@ -380,7 +407,7 @@ static void _do_clut_translation(shoebill_card_video_t *ctx)
             break;
         }
         case 4: {
-            for (i=0; i < ctx->pixels/2; i++) {
+            for (i=start; i < end; i++) {
                 const uint8_t byte = ctx->direct_buf[i];
                 ctx->temp_buf[i * 2 + 0] = ctx->clut[(byte >> 4) & 0xf];
                 ctx->temp_buf[i * 2 + 1] = ctx->clut[(byte >> 0) & 0xf];
@@ -388,13 +415,13 @@ static void _do_clut_translation(shoebill_card_video_t *ctx)
             break;
         }
         case 8: {
-            for (i=0; i < ctx->pixels; i++)
+            for (i=start; i < end; i++)
                 ctx->temp_buf[i] = ctx->clut[ctx->direct_buf[i]];
             break;
         }
         case 16: {
             uint16_t *direct = (uint16_t*)ctx->direct_buf;
-            for (i=0; i < ctx->pixels; i++) {
+            for (i=start/2; i < end/2; i++) {
                 const uint16_t p = ntohs(direct[i]);
                 video_ctx_color_t tmp;
                 tmp.r = ((p >> 10) & 31);
@@ -411,7 +438,7 @@ static void _do_clut_translation(shoebill_card_video_t *ctx)
             
         case 32: {
             uint32_t *direct = (uint32_t*)ctx->direct_buf, *tmp = (uint32_t*)ctx->temp_buf;
-            for (i=0; i < ctx->pixels; i++)
+            for (i=start/4; i < end/4; i++)
                 tmp[i] = direct[i] >> 8;
             
             
@@ -440,7 +467,23 @@ shoebill_video_frame_info_t nubus_video_get_frame(shoebill_card_video_t *ctx,
     if (just_params)
         return result;
     
-    _do_clut_translation(ctx);
+    // Only translate the runs of video RAM that were written since the last frame
+    uint32_t i, j;
+    _Bool converted = 0;
+    for (i=0; i < ctx->dirty_len; i = j) {
+        if (!ctx->dirty[i]) {
+            j = i + 1;
+            continue;
+        }
+        for (j=i; (j < ctx->dirty_len) && ctx->dirty[j]; j++)
+            ctx->dirty[j] = 0;
+        _do_clut_translation(ctx, i << NUBUS_DIRTY_SHIFT, j << NUBUS_DIRTY_SHIFT);
+        converted = 1;
+    }
+    
+    if (converted)
+        __atomic_fetch_add(&shoe.stats.frames_converted, 1, __ATOMIC_RELAXED);
+    
     result.buf = (uint8_t*)ctx->temp_buf;
     return result;
 }
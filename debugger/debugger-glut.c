@@ -121,8 +121,6 @@ void _display_func (void)
 {
     shoebill_video_frame_info_t frame = shoebill_get_video_frame(9, 0);
     
-    shoebill_send_vbl_interrupt(9);
-    
     glDrawBuffer(GL_BACK);
     glClear(GL_COLOR_BUFFER_BIT);
     
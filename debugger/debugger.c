@@ -36,7 +36,7 @@
 
 struct dbg_state_t {
     EditLine *el;
-    uint8_t running;
+    volatile uint8_t running;
     uint64_t breakpoint_counter;
     dbg_breakpoint_t *breakpoints;
     _Bool trace;
@@ -48,6 +48,116 @@ struct dbg_state_t {
 
 struct dbg_state_t dbg_state;
 
+#pragma mark Breakpoint set
+
+/*
+ * dbg_state.breakpoints stays the authoritative (numbered, ordered) list.
+ * For the run loop, it's mirrored into an open-addressed hash set keyed on
+ * address, plus a bitmap with one bit per 4kb page of the address space.
+ * After each instruction, the run loop only tests pc's page bit, and only
+ * probes the hash set if that page actually contains a breakpoint.
+ * Both are rebuilt from the list whenever a breakpoint is added or deleted.
+ */
+
+#define BRK_PAGE_SHIFT 12
+
+static struct {
+    uint8_t pages[(1 << (32 - BRK_PAGE_SHIFT)) / 8];
+    dbg_breakpoint_t **slots;
+    uint32_t mask; // number of slots - 1
+} brk_set;
+
+#define brk_page_set(addr) (brk_set.pages[(addr) >> (BRK_PAGE_SHIFT + 3)] & (1 << (((addr) >> BRK_PAGE_SHIFT) & 7)))
+
+static uint32_t _brk_hash(uint32_t addr)
+{
+    // Instructions are word aligned, so fold the low bit away before mixing
+    return (addr >> 1) * 2654435761u;
+}
+
+static void _brk_rebuild(void)
+{
+    dbg_breakpoint_t *cur;
+    uint32_t count = 0, size = 16;
+    
+    for (cur = dbg_state.breakpoints; cur; cur = cur->next)
+        count++;
+    while (size < (count * 2))
+        size *= 2;
+    
+    if (brk_set.slots)
+        free(brk_set.slots);
+    brk_set.slots = calloc(size, sizeof(dbg_breakpoint_t*));
+    brk_set.mask = size - 1;
+    memset(brk_set.pages, 0, sizeof(brk_set.pages));
+    
+    for (cur = dbg_state.breakpoints; cur; cur = cur->next) {
+        uint32_t i = _brk_hash(cur->addr) & brk_set.mask;
+        
+        brk_set.pages[cur->addr >> (BRK_PAGE_SHIFT + 3)] |= 1 << ((cur->addr >> BRK_PAGE_SHIFT) & 7);
+        
+        // Keep the lowest-numbered breakpoint for a duplicated address
+        while (brk_set.slots[i] && (brk_set.slots[i]->addr != cur->addr))
+            i = (i + 1) & brk_set.mask;
+        if (!brk_set.slots[i])
+            brk_set.slots[i] = cur;
+    }
+}
+
+static dbg_breakpoint_t *_brk_lookup(uint32_t addr)
+{
+    uint32_t i = _brk_hash(addr) & brk_set.mask;
+    
+    for (; brk_set.slots[i]; i = (i + 1) & brk_set.mask) {
+        if (brk_set.slots[i]->addr == addr)
+            return brk_set.slots[i];
+    }
+    return NULL;
+}
+
+/*
+ * Returns 1 (and stops the run loop) if pc sits on a breakpoint.
+ */
+static _Bool _brk_check(void)
+{
+    const uint32_t pc = shoe.pc;
+    dbg_breakpoint_t *brk;
+    
+    if slikely(!brk_page_set(pc))
+        return 0;
+    
+    if ((brk = _brk_lookup(pc)) == NULL)
+        return 0;
+    
+    printf("Hit breakpoint %llu *0x%08x\n", (unsigned long long)brk->num, pc);
+    dbg_state.running = 0;
+    return 1;
+}
+
+/*
+ * Returns 1 (and stops the run loop) if a watchpoint fired during the last instruction.
+ */
+static _Bool _watch_check(void)
+{
+    const watch_hit_t *hit = &shoe.watch_hit;
+    
+    if slikely(!(shoe.cpu_thread_notifications & SHOEBILL_STATE_WATCH))
+        return 0;
+    
+    printf("Hit watchpoint %u: *0x%08x %s %u bytes at 0x%08x\n",
+           hit->num, hit->pc, hit->is_write ? "wrote" : "read", hit->size, hit->addr);
+    if (hit->old_valid)
+        printf("    old = 0x%llx\n", (unsigned long long)hit->old_dat);
+    if (hit->is_write)
+        printf("    new = 0x%llx\n", (unsigned long long)hit->new_dat);
+    
+    __sync_fetch_and_and(&shoe.cpu_thread_notifications, ~SHOEBILL_STATE_WATCH);
+    dbg_state.running = 0;
+    return 1;
+}
+
+#pragma mark -
+
 
 void print_mmu_rp(uint64_t rp)
 {
@@ -91,36 +201,8 @@ void print_pc()
     uint8_t binary[32];
     uint32_t i;
     uint32_t len;
-    const char *name = NULL;
-    
-    if ((shoe.pc >= 0x40000000) && (shoe.pc < 0x50000000)) {
-        uint32_t i, addr = shoe.pc % (shoe.physical_rom_size);
-        for (i=0; macii_rom_symbols[i].name; i++) {
-            if (macii_rom_symbols[i].addr > addr) {
-                break;
-            }
-            name = macii_rom_symbols[i].name;
-        }
-    }
-    else if (sr_s()) { // these symbols are only meaningful in supervisor mode
-        coff_symbol *symb = coff_find_func(shoe.coff, shoe.pc);
-        if (symb && strlen(symb->name))
-            name = symb->name;
-    }
-    else {
-        if ((shoe.pc >= 0x10000000) && (shoe.pc < 0x20000000)) {
-            uint32_t i, addr = shoe.pc % (shoe.physical_rom_size);
-            for (i=0; macii_rom_symbols[i].name; i++) {
-                if (macii_rom_symbols[i].addr > addr) {
-                    break;
-                }
-                name = macii_rom_symbols[i].name;
-            }
-        }
-        else {
-            name = "";
-        }
-    }
+    uint32_t offset;
+    const char *name = symbol_for_pc(shoe.pc, sr_s(), &offset);
     
     const uint16_t old_abort = shoe.abort;
     shoe.suppress_exceptions = 1;
@@ -269,8 +351,9 @@ void verb_break_handler (const char *line)
     while (*cur)
         cur = &(*cur)->next;
     *cur = brk;
+    _brk_rebuild();
     
-    printf("Set breakpoint %llu = *0x%08x\n", brk->num, brk->addr);
+    printf("Set breakpoint %llu = *0x%08x\n", (unsigned long long)brk->num, brk->addr);
 }
 
 void verb_delete_handler (const char *line)
@@ -289,15 +372,61 @@ void verb_delete_handler (const char *line)
             dbg_breakpoint_t *victim = *cur;
             *cur = (*cur)->next;
             free(victim);
+            _brk_rebuild();
             return ;
         }
         cur = &(*cur)->next;
     }
     
-    printf("No such breakpoint (#%llu)\n", num);
+    printf("No such breakpoint (#%llu)\n", (unsigned long long)num);
 }
 
  
+void verb_watch_handler (const char *line)
+{
+    char mode[8] = "w";
+    char *end, *end2;
+    uint32_t addr, size;
+    uint8_t type = 0;
+    int32_t num;
+    
+    addr = (uint32_t) strtoul(line, &end, 0);
+    if (end == line) {
+        printf("watch <addr> [size] [r|w|rw]\n");
+        return ;
+    }
+    size = (uint32_t) strtoul(end, &end2, 0);
+    if (end2 == end)
+        size = 4;
+    sscanf(end2, "%7s", mode);
+    
+    if (strchr(mode, 'r'))
+        type |= SHOEBILL_WATCH_READ;
+    if (strchr(mode, 'w'))
+        type |= SHOEBILL_WATCH_WRITE;
+    
+    num = shoebill_watch_add(addr, size, type);
+    if (num < 0) {
+        printf("Couldn't set watchpoint\n");
+        return ;
+    }
+    printf("Set watchpoint %d = 0x%08x-0x%08x (%s)\n", num, addr, addr + size - 1, mode);
+}
+
+void verb_unwatch_handler (const char *line)
+{
+    errno = 0;
+    const uint32_t num = (uint32_t) strtoul(line, NULL, 0);
+    
+    if (errno) {
+        printf("errno: %d\n", errno);
+        return ;
+    }
+    
+    if (!shoebill_watch_remove(num))
+        printf("No such watchpoint (#%u)\n", num);
+}
+
 void verb_help_handler (const char *line)
 {
     printf("Help help help\n");
@@ -308,6 +437,7 @@ void verb_stepi_handler (const char *line)
 {
     dbg_state.running = 1;
     cpu_step();
+    _watch_check();
     dbg_state.running = 0;
     print_pc();
 }
@@ -336,25 +466,23 @@ void verb_examine_handler (const char *line)
 void verb_lookup_handler (const char *line)
 {
     char *sym_name = malloc(strlen(line)+1);
+    uint32_t value;
     
-    sscanf(line, "%s", sym_name);
-    coff_symbol *symb = coff_find_symbol(shoe.coff, sym_name);
-    
-    free(sym_name);
+    if (sscanf(line, "%s", sym_name) != 1)
+        sym_name[0] = 0;
     
-    if (symb == NULL) {
+    // Kernel symbols, then ROM symbols, then A-trap names
+    if (symbol_lookup(sym_name, &value))
+        printf("%s = *0x%08x\n", sym_name, value);
+    else
         printf("Couldn't find \"%s\"\n", sym_name);
-        return ;
-    }
     
-    printf("%s = *0x%08x\n", symb->name, symb->value);
+    free(sym_name);
 }
 
 
 void stepper()
 {
-    dbg_breakpoint_t *cur;
-    
     if (shoe.cpu_thread_notifications) {
         
         // If there's an interrupt pending
@@ -377,18 +505,39 @@ void stepper()
         printregs();
     }
     
-    for (cur = dbg_state.breakpoints; cur != NULL; cur = cur->next) {
-        if (shoe.pc == cur->addr) {
-            printf("Hit breakpoint %llu *0x%08x\n", cur->num, shoe.pc);
-            dbg_state.running = 0;
-            return ;
+    if (!_watch_check())
+        _brk_check();
+}
+
+/*
+ * The common case for "continue": no tracing, no slow factor. This is the
+ * same loop as _cpu_thread(), with one page-bitmap test per instruction.
+ */
+static void _run_fast(void)
+{
+    while (dbg_state.running) {
+        if sunlikely(shoe.cpu_thread_notifications) {
+            if (shoe.cpu_thread_notifications & 0xff)
+                process_pending_interrupt();
         }
+        
+        cpu_step();
+        
+        if sunlikely(shoe.cpu_thread_notifications & SHOEBILL_STATE_WATCH)
+            _watch_check();
+        else if sunlikely(brk_page_set(shoe.pc))
+            _brk_check();
     }
 }
 
 void verb_continue_handler (const char *line)
 {
     dbg_state.running = 1;
+    if (!dbg_state.trace && !dbg_state.slow_factor) {
+        _run_fast();
+        print_pc();
+        return ;
+    }
     while (dbg_state.running) {
         if (dbg_state.slow_factor)
             usleep(dbg_state.slow_factor);
@@ -431,6 +580,8 @@ struct verb_handler_table_t {
     {"bt", verb_backtrace_handler},
     {"break", verb_break_handler},
     {"delete", verb_delete_handler},
+    {"watch", verb_watch_handler},
+    {"unwatch", verb_unwatch_handler},
     {"lookup", verb_lookup_handler},
     {"trace", verb_trace_toggle_handler},
     {"x", verb_examine_handler},
@@ -524,6 +675,9 @@ void *cpu_debugger_thread (void *arg)
 	const char *buf;
 	int num;
 	
+	if (arg)
+	    shoe_ctx = arg; // started by shoebill_initialize() for a particular machine
+	
 	hist = history_init();
 	history(hist, &histev, H_SETSIZE, 10000); // Remember 10000 previous user inputs
     
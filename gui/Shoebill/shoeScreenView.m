@@ -88,7 +88,9 @@
 
 - (void)timerFireMethod:(NSTimer *)timer
 {
-    [self setNeedsDisplay:YES];
+    // The core sends VBLs on its own, so there's no need to convert frames nobody can see
+    if (![[self window] isMiniaturized] && [[self window] isVisible])
+        [self setNeedsDisplay:YES];
 }
 
 - (void)prepareOpenGL
@@ -145,8 +147,6 @@
                      frame.buf);
         
         [[self openGLContext] flushBuffer];
-        
-        shoebill_send_vbl_interrupt(slotnum);
     }
     else {
         [[self openGLContext] flushBuffer];
@@ -0,0 +1,806 @@
+/*
+ * Copyright (c) 2014, Peter Rutenbar <pruten@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * A front end with no display at all. It optionally dumps frames to disk
+ * (as numbered PNGs, or as one gzip'd stream of raw RGB frames), so A/UX
+ * can be booted and screenshotted on machines without an X server.
+ * (The core sends VBL interrupts itself, so no display loop is needed.)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/time.h>
+#include <zlib.h>
+#include "../core/shoebill.h"
+
+#define VIDEO_SLOT 9
+
+enum {
+    capture_none = 0,
+    capture_png,
+    capture_raw
+};
+
+struct {
+    const char *scsi_path[8];
+    const char *rom_path;
+    const char *relative_unix_path;
+    const char *pram_path;
+
+    uint32_t height, width;
+    uint32_t ram_megabytes;
+    _Bool verbose, use_tfb;
+
+    uint32_t capture_format;
+    const char *capture_path; // directory for PNGs, file for the raw stream
+    uint32_t capture_fps; // frames dumped per second
+    uint32_t seconds; // stop after this many seconds (0 = run forever)
+
+    const char *server_address; // for shoebill_start_fb_server()
+    uint32_t server_fps;
+
+    const char *load_state_path, *save_state_path;
+
+    const char *profile_path; // for shoebill_profile_write()
+    uint32_t profile_hz;
+
+    const char *histogram_path; // for shoebill_write_histogram()
+
+    const char *trace_path; // for shoebill_trace_start()
+    _Bool trace_mem;
+
+    const char *tracepoint_path; // for shoebill_tracepoint_dump()
+
+    const char *record_path, *replay_path; // for shoebill_record_start()/shoebill_replay_start()
+} user_params;
+
+/*
+ * The encoder thread has room for one pending frame. If the capture loop
+ * comes around again before the encoder has picked up the last one, the
+ * new frame is dropped rather than letting the capture rate drift.
+ */
+struct {
+    pthread_t threadid;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    uint8_t *pending; // RGB frame waiting to be encoded
+    uint8_t *working; // RGB frame being encoded
+    uint16_t width, height;
+    uint32_t frame_num;
+    uint32_t pending_ms, working_ms; // capture time, for the raw stream header
+    _Bool has_pending, tear_down;
+
+    gzFile raw; // capture_raw output
+
+    uint64_t written, dropped;
+} encoder;
+
+static void _print_vers(void)
+{
+    printf("Shoebill v0.0.4 (headless) - http://github.com/pruten/shoebill - Peter Rutenbar (c) 2014\n\n");
+}
+
+static void _print_help (void)
+{
+    printf("Arguments have the form name=value.\n");
+    printf("\n");
+    printf("rom=<path to Mac II ROM>\n");
+    printf("disk0..disk6=<path to disk image>\n");
+    printf("ram=<megabytes of memory>\n");
+    printf("height=<num pixels>\n");
+    printf("width=<num pixels>\n");
+    printf("toby\n");
+    printf("Use the Toby frame buffer card (640x480) instead of the shoebill video card.\n");
+    printf("pram-path=<path to PRAM file>\n");
+    printf("Read-only here. Defaults to a freshly zapped PRAM.\n");
+    printf("verbose=<1 or 0>\n");
+    printf("unix-path=<path to kernel on disk0>\n");
+    printf("\n");
+    printf("png=<directory>\n");
+    printf("Write frames to <directory>/frame_000000.png, frame_000001.png, ...\n");
+    printf("\n");
+    printf("raw=<file>\n");
+    printf("Write frames to a single gzip'd stream. Each frame is a 16 byte header\n");
+    printf("(\"SHBF\", then big-endian u32 frame number, u16 width, u16 height,\n");
+    printf("u32 milliseconds since boot) followed by width*height RGB triplets.\n");
+    printf("\n");
+    printf("fps=<rate>\n");
+    printf("How many frames per second to dump. Defaults to 1.\n");
+    printf("\n");
+    printf("seconds=<n>\n");
+    printf("Exit after n seconds. Defaults to running forever.\n");
+    printf("\n");
+    printf("server=<unix:path or tcp:port>\n");
+    printf("Serve changed screen tiles (and accept keyboard/mouse input) on a unix socket\n");
+    printf("or a loopback TCP port. See core/fb_server.c for the protocol.\n");
+    printf("\n");
+    printf("server-fps=<rate>\n");
+    printf("How often the server looks for changed tiles. Defaults to 30.\n");
+    printf("\n");
+    printf("load-state=<path>\n");
+    printf("Resume from a snapshot instead of booting. rom= and the disks must be the same\n");
+    printf("ones the snapshot was taken with (and the disks unchanged since).\n");
+    printf("\n");
+    printf("save-state=<path>\n");
+    printf("Write a snapshot when the run ends (see seconds=).\n");
+    printf("\n");
+    printf("profile=<path>\n");
+    printf("Sample the guest's pc and stack, and write folded stacks (for flamegraph.pl)\n");
+    printf("to <path> when the run ends.\n");
+    printf("\n");
+    printf("profile-hz=<rate>\n");
+    printf("Samples per second. Defaults to 997.\n");
+    printf("\n");
+    printf("histogram=<path>\n");
+    printf("Write the opcode/EA-mode histogram to <path> when the run ends.\n");
+    printf("Needs a core built with SHOEBILL_OP_HISTOGRAM.\n");
+    printf("\n");
+    printf("trace=<path>\n");
+    printf("Write a gzip'd binary trace of every instruction from boot on.\n");
+    printf("Decode it with trace/shoebill_trace_decode.\n");
+    printf("\n");
+    printf("trace-mem=<1 or 0>\n");
+    printf("Include memory accesses in the trace. Defaults to 0.\n");
+    printf("\n");
+    printf("tracepoints=<path>\n");
+    printf("Dump the tracepoint rings (see SHOEBILL_TP_LEVEL) to <path> when the run ends.\n");
+    printf("\n");
+    printf("record=<path>\n");
+    printf("Record the machine's external inputs (timers, input, packets, clock reads) to <path>.\n");
+    printf("\n");
+    printf("replay=<path>\n");
+    printf("Replay a recording, reproducing the recorded run exactly. Start from copies of the\n");
+    printf("disks as they were when recording started (and the same load-state=, if any).\n");
+    printf("\n");
+    printf("Example:\n");
+    printf("\n");
+    printf("./shoebill_headless disk0=/aux3.img rom=/macii.rom png=/tmp/shots fps=1 seconds=300\n");
+    printf("\n");
+}
+
+static void _init_user_params (int argc, char **argv)
+{
+    char *key;
+    uint32_t i;
+    for (i=0; i<8; i++)
+        user_params.scsi_path[i] = NULL;
+
+    user_params.rom_path = "macii.rom";
+    user_params.relative_unix_path = "/unix";
+    user_params.pram_path = NULL;
+
+    user_params.height = 640;
+    user_params.width = 800;
+    user_params.ram_megabytes = 16;
+    user_params.verbose = 1;
+    user_params.use_tfb = 0;
+
+    user_params.capture_format = capture_none;
+    user_params.capture_path = NULL;
+    user_params.capture_fps = 1;
+    user_params.seconds = 0;
+    user_params.server_address = NULL;
+    user_params.server_fps = 30;
+    user_params.load_state_path = NULL;
+    user_params.save_state_path = NULL;
+
+    if (argc < 2) {
+        _print_help();
+        exit(0);
+    }
+
+    for (i=1; i<argc; i++) {
+        key = "-h";
+        if (strncmp(key, argv[i], strlen(key)) == 0) {
+            _print_help();
+            exit(0);
+        }
+
+        key = "help";
+        if (strncmp(key, argv[i], strlen(key)) == 0) {
+            _print_help();
+            exit(0);
+        }
+
+        key = "toby";
+        if(strncmp(key, argv[i], strlen(key)) == 0) {
+            user_params.use_tfb = 1;
+            continue;
+        }
+
+        key = "ram=";
+        if (strncmp(key, argv[i], strlen(key)) == 0) {
+            user_params.ram_megabytes = strtoul(argv[i]+strlen(key), NULL, 10);
+            continue;
+        }
+
+        key = "height=";
+        if (strncmp(key, argv[i], strlen(key)) == 0) {
+            user_params.height = strtoul(argv[i]+strlen(key), NULL, 10);
+            continue;
+        }
+
+        key = "width=";
+        if (strncmp(key, argv[i], strlen(key)) == 0) {
+            user_params.width = strtoul(argv[i]+strlen(key), NULL, 10);
+            continue;
+        }
+
+        key = "verbose=";
+        if (strncmp(key, argv[i], strlen(key)) == 0) {
+            user_params.verbose = strtoul(argv[i]+strlen(key), NULL, 10);
+            continue;
+        }
+
+        key = "rom=";
+        if (strncmp(key, argv[i], strlen(key)) == 0) {
+            user_params.rom_path = argv[i] + strlen(key);
+            continue;
+        }
+
+        key = "unix-path=";
+        if (strncmp(key, argv[i], strlen(key)) == 0) {
+            user_params.relative_unix_path = argv[i] + strlen(key);
+            continue;
+        }
+
+        key = "pram-path=";
+        if (strncmp(key, argv[i], strlen(key)) == 0) {
+            user_params.pram_path = argv[i] + strlen(key);
+            continue;
+        }
+
+        key = "png=";
+        if (strncmp(key, argv[i], strlen(key)) == 0) {
+            user_params.capture_format = capture_png;
+            user_params.capture_path = argv[i] + strlen(key);
+            continue;
+        }
+
+        key = "raw=";
+        if (strncmp(key, argv[i], strlen(key)) == 0) {
+            user_params.capture_format = capture_raw;
+            user_params.capture_path = argv[i] + strlen(key);
+            continue;
+        }
+
+        key = "fps=";
+        if (strncmp(key, argv[i], strlen(key)) == 0) {
+            user_params.capture_fps = strtoul(argv[i]+strlen(key), NULL, 10);
+            continue;
+        }
+
+        key = "server=";
+        if (strncmp(key, argv[i], strlen(key)) == 0) {
+            user_params.server_address = argv[i] + strlen(key);
+            continue;
+        }
+
+        key = "server-fps=";
+        if (strncmp(key, argv[i], strlen(key)) == 0) {
+            user_params.server_fps = strtoul(argv[i]+strlen(key), NULL, 10);
+            continue;
+        }
+
+        key = "load-state=";
+        if (strncmp(key, argv[i], strlen(key)) == 0) {
+            user_params.load_state_path = argv[i] + strlen(key);
+            continue;
+        }
+
+        key = "save-state=";
+        if (strncmp(key, argv[i], strlen(key)) == 0) {
+            user_params.save_state_path = argv[i] + strlen(key);
+            continue;
+        }
+
+        key = "profile=";
+        if (strncmp(key, argv[i], strlen(key)) == 0) {
+            user_params.profile_path = argv[i] + strlen(key);
+            continue;
+        }
+
+        key = "profile-hz=";
+        if (strncmp(key, argv[i], strlen(key)) == 0) {
+            user_params.profile_hz = strtoul(argv[i]+strlen(key), NULL, 10);
+            continue;
+        }
+
+        key = "histogram=";
+        if (strncmp(key, argv[i], strlen(key)) == 0) {
+            user_params.histogram_path = argv[i] + strlen(key);
+            continue;
+        }
+
+        key = "trace=";
+        if (strncmp(key, argv[i], strlen(key)) == 0) {
+            user_params.trace_path = argv[i] + strlen(key);
+            continue;
+        }
+
+        key = "trace-mem=";
+        if (strncmp(key, argv[i], strlen(key)) == 0) {
+            user_params.trace_mem = strtoul(argv[i]+strlen(key), NULL, 10);
+            continue;
+        }
+
+        key = "tracepoints=";
+        if (strncmp(key, argv[i], strlen(key)) == 0) {
+            user_params.tracepoint_path = argv[i] + strlen(key);
+            continue;
+        }
+
+        key = "record=";
+        if (strncmp(key, argv[i], strlen(key)) == 0) {
+            user_params.record_path = argv[i] + strlen(key);
+            continue;
+        }
+
+        key = "replay=";
+        if (strncmp(key, argv[i], strlen(key)) == 0) {
+            user_params.replay_path = argv[i] + strlen(key);
+            continue;
+        }
+
+        key = "seconds=";
+        if (strncmp(key, argv[i], strlen(key)) == 0) {
+            user_params.seconds = strtoul(argv[i]+strlen(key), NULL, 10);
+            continue;
+        }
+
+        if ((strncmp("disk", argv[i], 4) == 0) && (isdigit(argv[i][4])) && (argv[i][5] == '=')) {
+            uint8_t scsi_num = argv[i][4] - '0';
+            if (scsi_num < 7) {
+                user_params.scsi_path[scsi_num] = &argv[i][6];
+                continue;
+            }
+        }
+
+        printf("Unknown argument [%s]\n", argv[i]);
+        exit(1);
+    }
+
+    if (user_params.capture_fps == 0)
+        user_params.capture_fps = 1;
+}
+
+#pragma mark PNG encoding
+
+static void _put_be32 (uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static _Bool _png_chunk (FILE *f, const char *type, const uint8_t *data, uint32_t len)
+{
+    uint8_t buf[4];
+    uint32_t crc;
+
+    _put_be32(buf, len);
+    if (fwrite(buf, 4, 1, f) != 1)
+        return 0;
+    if (fwrite(type, 4, 1, f) != 1)
+        return 0;
+    if (len && (fwrite(data, len, 1, f) != 1))
+        return 0;
+
+    crc = crc32(0, (const uint8_t*)type, 4);
+    if (len) // crc32() resets to 0 when handed a NULL buffer
+        crc = crc32(crc, data, len);
+    _put_be32(buf, crc);
+    return fwrite(buf, 4, 1, f) == 1;
+}
+
+/* Write an 8-bit RGB PNG, using the "none" filter on every scanline */
+static _Bool _write_png (const char *path, const uint8_t *rgb, uint16_t width, uint16_t height)
+{
+    static const uint8_t sig[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    const uint32_t stride = width * 3;
+    uint8_t ihdr[13];
+    uint8_t *filtered, *compressed;
+    uLongf compressed_len;
+    uint32_t y;
+    _Bool result = 0;
+    FILE *f;
+
+    filtered = malloc((stride + 1) * height);
+    compressed_len = compressBound((stride + 1) * height);
+    compressed = malloc(compressed_len);
+
+    for (y=0; y<height; y++) {
+        filtered[y * (stride + 1)] = 0;
+        memcpy(&filtered[y * (stride + 1) + 1], &rgb[y * stride], stride);
+    }
+
+    if (compress2(compressed, &compressed_len, filtered, (stride + 1) * height, 6) != Z_OK)
+        goto done;
+
+    f = fopen(path, "wb");
+    if (f == NULL) {
+        printf("Can't open %s [errno=%s]\n", path, strerror(errno));
+        goto done;
+    }
+
+    _put_be32(&ihdr[0], width);
+    _put_be32(&ihdr[4], height);
+    ihdr[8] = 8; // bit depth
+    ihdr[9] = 2; // color type: RGB
+    ihdr[10] = 0; // compression: deflate
+    ihdr[11] = 0; // filter method
+    ihdr[12] = 0; // no interlacing
+
+    result = (fwrite(sig, sizeof(sig), 1, f) == 1) &&
+             _png_chunk(f, "IHDR", ihdr, sizeof(ihdr)) &&
+             _png_chunk(f, "IDAT", compressed, compressed_len) &&
+             _png_chunk(f, "IEND", NULL, 0);
+
+    if (fclose(f) != 0)
+        result = 0;
+
+done:
+    free(filtered);
+    free(compressed);
+    return result;
+}
+
+#pragma mark Encoder thread
+
+static uint32_t _ms_since (const struct timeval *start)
+{
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return ((now.tv_sec - start->tv_sec) * 1000) + ((now.tv_usec - start->tv_usec) / 1000);
+}
+
+static struct timeval boot_time;
+
+static void _encode_frame (void)
+{
+    const uint32_t len = encoder.width * encoder.height * 3;
+
+    if (user_params.capture_format == capture_png) {
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/frame_%06u.png", user_params.capture_path, encoder.frame_num);
+        if (!_write_png(path, encoder.working, encoder.width, encoder.height))
+            printf("headless: failed to write %s\n", path);
+    }
+    else {
+        uint8_t header[16];
+        memcpy(header, "SHBF", 4);
+        _put_be32(&header[4], encoder.frame_num);
+        header[8] = encoder.width >> 8;
+        header[9] = encoder.width;
+        header[10] = encoder.height >> 8;
+        header[11] = encoder.height;
+        _put_be32(&header[12], encoder.working_ms);
+
+        if ((gzwrite(encoder.raw, header, sizeof(header)) != sizeof(header)) ||
+            (gzwrite(encoder.raw, encoder.working, len) != len))
+            printf("headless: failed to write frame %u to %s\n", encoder.frame_num, user_params.capture_path);
+    }
+
+    encoder.written++;
+}
+
+static void* _encoder_thread (void *param)
+{
+    pthread_mutex_lock(&encoder.lock);
+    while (1) {
+        while (!encoder.has_pending && !encoder.tear_down)
+            pthread_cond_wait(&encoder.cond, &encoder.lock);
+
+        if (!encoder.has_pending)
+            break;
+
+        // Swap the pending frame into the working slot, and encode it without holding the lock
+        uint8_t *tmp = encoder.working;
+        encoder.working = encoder.pending;
+        encoder.pending = tmp;
+        encoder.working_ms = encoder.pending_ms;
+        encoder.has_pending = 0;
+
+        pthread_mutex_unlock(&encoder.lock);
+        _encode_frame();
+        pthread_mutex_lock(&encoder.lock);
+
+        encoder.frame_num++;
+    }
+    pthread_mutex_unlock(&encoder.lock);
+
+    return NULL;
+}
+
+static _Bool _init_encoder (void)
+{
+    memset(&encoder, 0, sizeof(encoder));
+
+    if (user_params.capture_format == capture_none)
+        return 1;
+
+    if (user_params.capture_format == capture_raw) {
+        encoder.raw = gzopen(user_params.capture_path, "wb6");
+        if (encoder.raw == NULL) {
+            printf("Can't open %s [errno=%s]\n", user_params.capture_path, strerror(errno));
+            return 0;
+        }
+    }
+
+    pthread_mutex_init(&encoder.lock, NULL);
+    pthread_cond_init(&encoder.cond, NULL);
+    pthread_create(&encoder.threadid, NULL, _encoder_thread, NULL);
+    return 1;
+}
+
+/* Hand the current frame to the encoder thread (RGBA -> RGB on the way) */
+static void _capture_frame (void)
+{
+    shoebill_video_frame_info_t frame = shoebill_get_video_frame(VIDEO_SLOT, 0);
+    const uint32_t pixels = frame.width * frame.height;
+    uint32_t i;
+
+    if (frame.buf == NULL)
+        return ;
+
+    pthread_mutex_lock(&encoder.lock);
+
+    if (encoder.has_pending) {
+        encoder.dropped++;
+        pthread_mutex_unlock(&encoder.lock);
+        return ;
+    }
+
+    // Neither card changes resolution at runtime, but don't overrun the buffers if one ever does
+    if ((frame.width != encoder.width) || (frame.height != encoder.height)) {
+        encoder.dropped++;
+        pthread_mutex_unlock(&encoder.lock);
+        return ;
+    }
+
+    for (i=0; i<pixels; i++) {
+        encoder.pending[i*3 + 0] = frame.buf[i*4 + 0];
+        encoder.pending[i*3 + 1] = frame.buf[i*4 + 1];
+        encoder.pending[i*3 + 2] = frame.buf[i*4 + 2];
+    }
+    encoder.pending_ms = _ms_since(&boot_time);
+    encoder.has_pending = 1;
+
+    pthread_cond_signal(&encoder.cond);
+    pthread_mutex_unlock(&encoder.lock);
+}
+
+static void _tear_down_encoder (void)
+{
+    if (user_params.capture_format == capture_none)
+        return ;
+
+    pthread_mutex_lock(&encoder.lock);
+    encoder.tear_down = 1;
+    pthread_cond_signal(&encoder.cond);
+    pthread_mutex_unlock(&encoder.lock);
+
+    pthread_join(encoder.threadid, NULL);
+
+    if (encoder.raw)
+        gzclose(encoder.raw);
+
+    printf("headless: wrote %llu frames, dropped %llu\n",
+           (unsigned long long)encoder.written,
+           (unsigned long long)encoder.dropped);
+}
+
+#pragma mark Setup
+
+static _Bool _init_pram (uint8_t *pram)
+{
+    FILE *f;
+
+    shoebill_validate_or_zap_pram(pram, 1);
+
+    if (user_params.pram_path == NULL)
+        return 1;
+
+    f = fopen(user_params.pram_path, "rb");
+    if ((f == NULL) || (fread(pram, 256, 1, f) != 1)) {
+        printf("Can't read pram_path! [%s] [errno=%s]\n",
+               user_params.pram_path,
+               strerror(errno));
+        if (f)
+            fclose(f);
+        return 0;
+    }
+    fclose(f);
+
+    shoebill_validate_or_zap_pram(pram, 0);
+    return 1;
+}
+
+static _Bool _setup_shoebill (void)
+{
+    uint32_t i;
+    shoebill_config_t config;
+
+    memset(&config, 0, sizeof(shoebill_config_t));
+
+    config.aux_verbose = user_params.verbose;
+    config.ram_size = user_params.ram_megabytes * 1024 * 1024;
+    config.aux_kernel_path = user_params.relative_unix_path;
+    config.rom_path = user_params.rom_path;
+    if (!_init_pram(config.pram))
+        return 0;
+
+    for (i=0; i<7; i++)
+        config.scsi_devices[i].path = user_params.scsi_path[i];
+
+    // A snapshot brings its own cards along
+    if (user_params.load_state_path) {
+        if (!shoebill_load_state(&config, user_params.load_state_path)) {
+            printf("%s\n", config.error_msg);
+            return 0;
+        }
+    }
+    else if (!shoebill_initialize(&config)) {
+        printf("%s\n", config.error_msg);
+        return 0;
+    }
+    else if (user_params.use_tfb) {
+        shoebill_install_tfb_card(&config, VIDEO_SLOT);
+    }
+    else {
+        shoebill_install_video_card(&config,
+                                    VIDEO_SLOT,
+                                    user_params.width,
+                                    user_params.height);
+    }
+
+    if (user_params.trace_path && !shoebill_trace_start(user_params.trace_path, 1, user_params.trace_mem)) {
+        printf("Can't write a trace to %s\n", user_params.trace_path);
+        return 0;
+    }
+
+    if (user_params.record_path && !shoebill_record_start(user_params.record_path, config.error_msg)) {
+        printf("%s\n", config.error_msg);
+        return 0;
+    }
+    if (user_params.replay_path && !shoebill_replay_start(user_params.replay_path, config.error_msg)) {
+        printf("%s\n", config.error_msg);
+        return 0;
+    }
+
+    shoebill_start();
+
+    if (user_params.profile_path && !shoebill_profile_start(user_params.profile_hz)) {
+        printf("Can't start the profiler\n");
+        return 0;
+    }
+
+    if (user_params.server_address &&
+        !shoebill_start_fb_server(VIDEO_SLOT, user_params.server_address, user_params.server_fps)) {
+        printf("Can't start the framebuffer server on %s\n", user_params.server_address);
+        return 0;
+    }
+
+    return 1;
+}
+
+static void _sleep_until (const struct timespec *deadline)
+{
+    struct timespec now, delta;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if ((now.tv_sec > deadline->tv_sec) ||
+        ((now.tv_sec == deadline->tv_sec) && (now.tv_nsec >= deadline->tv_nsec)))
+        return ;
+
+    delta.tv_sec = deadline->tv_sec - now.tv_sec;
+    delta.tv_nsec = deadline->tv_nsec - now.tv_nsec;
+    if (delta.tv_nsec < 0) {
+        delta.tv_sec--;
+        delta.tv_nsec += 1000000000L;
+    }
+    while ((nanosleep(&delta, &delta) != 0) && (errno == EINTR)) ;
+}
+
+int main (int argc, char **argv)
+{
+    struct timespec next_tick;
+    uint64_t ticks = 0;
+
+    _print_vers();
+    _init_user_params(argc, argv);
+
+    if (!_init_encoder())
+        return 1;
+    else if (!_setup_shoebill())
+        return 1;
+
+    gettimeofday(&boot_time, NULL);
+
+    // The encoder's buffers are sized for the card's (fixed) resolution
+    if (user_params.capture_format != capture_none) {
+        shoebill_video_frame_info_t frame = shoebill_get_video_frame(VIDEO_SLOT, 1);
+        encoder.width = frame.width;
+        encoder.height = frame.height;
+        encoder.pending = malloc(frame.width * frame.height * 3);
+        encoder.working = malloc(frame.width * frame.height * 3);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &next_tick);
+    while ((user_params.seconds == 0) ||
+           (ticks < ((uint64_t)user_params.seconds * user_params.capture_fps))) {
+
+        if (user_params.capture_format != capture_none)
+            _capture_frame();
+        ticks++;
+
+        next_tick.tv_nsec += 1000000000L / user_params.capture_fps;
+        while (next_tick.tv_nsec >= 1000000000L) {
+            next_tick.tv_nsec -= 1000000000L;
+            next_tick.tv_sec++;
+        }
+        _sleep_until(&next_tick);
+    }
+
+    _tear_down_encoder();
+
+    if (user_params.profile_path) {
+        shoebill_profile_stop();
+        if (!shoebill_profile_write(user_params.profile_path)) {
+            printf("Can't write the profile to %s\n", user_params.profile_path);
+            return 1;
+        }
+    }
+
+    // Flush the rest of the trace, and the recording
+    shoebill_trace_stop();
+    shoebill_record_stop();
+
+    if (user_params.histogram_path && !shoebill_write_histogram(user_params.histogram_path))
+        printf("Can't write the histogram to %s\n", user_params.histogram_path);
+
+    if (user_params.tracepoint_path && !shoebill_tracepoint_dump(user_params.tracepoint_path))
+        printf("Can't write the tracepoints to %s\n", user_params.tracepoint_path);
+
+    if (user_params.save_state_path) {
+        char error_msg[8192];
+        if (!shoebill_save_state(user_params.save_state_path, error_msg)) {
+            printf("%s\n", error_msg);
+            return 1;
+        }
+    }
+
+    return 0;
+}
@@ -8,7 +8,7 @@ for i in adb fpu mc68851 mem via floppy core_api cpu dis; do
 	files="$files $i.post.c"
 done
 
-for i in SoftFloat/softfloat atrap_tab coff exception macii_symbols redblack scsi video filesystem alloc_pool toby_frame_buffer ethernet sound; do
+for i in SoftFloat/softfloat atrap_tab coff exception macii_symbols redblack scsi video filesystem alloc_pool toby_frame_buffer ethernet sound fb_server snapshot clone profiler histogram trace tracepoint symbols replay; do
 	files="$files ../core/$i.c"
 done
 
@@ -17,6 +17,6 @@ $CC -O1 ../core/decoder_gen.c -o decoder_gen
 ./decoder_gen dis .
 
 
-cmd="$CC -F/Library/Frameworks -O3 -ggdb -flto $files sdl.c -framework OpenGL -framework SDL2 -o shoebill"
+cmd="$CC -F/Library/Frameworks -O3 -ggdb -flto $files sdl.c -lz -framework OpenGL -framework SDL2 -o shoebill"
 echo $cmd
 $cmd
@@ -168,11 +168,179 @@ static void _init_keyboard_map (void)
     mapkey(SDLK_TAB, 0x30); // tab
 }
 
+#pragma mark Stats overlay
+
+/*
+ * A bare-bones 5x7 font for the stats overlay, so we don't need
+ * SDL_ttf. Rows are stored bottom-up, MSB leftmost, the way
+ * glBitmap() wants them.
+ */
+static const char overlay_font_chars[] = " 0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ.:%/-";
+static const uint8_t overlay_font[][7] = {
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, // ' '
+    {0x70, 0x88, 0xc8, 0xa8, 0x98, 0x88, 0x70}, // '0'
+    {0x70, 0x20, 0x20, 0x20, 0x20, 0x60, 0x20}, // '1'
+    {0xf8, 0x40, 0x20, 0x10, 0x08, 0x88, 0x70}, // '2'
+    {0x70, 0x88, 0x08, 0x10, 0x20, 0x10, 0xf8}, // '3'
+    {0x10, 0x10, 0xf8, 0x90, 0x50, 0x30, 0x10}, // '4'
+    {0x70, 0x88, 0x08, 0x08, 0xf0, 0x80, 0xf8}, // '5'
+    {0x70, 0x88, 0x88, 0xf0, 0x80, 0x40, 0x30}, // '6'
+    {0x40, 0x40, 0x40, 0x20, 0x10, 0x08, 0xf8}, // '7'
+    {0x70, 0x88, 0x88, 0x70, 0x88, 0x88, 0x70}, // '8'
+    {0x60, 0x10, 0x08, 0x78, 0x88, 0x88, 0x70}, // '9'
+    {0x88, 0x88, 0x88, 0xf8, 0x88, 0x88, 0x70}, // 'A'
+    {0xf0, 0x88, 0x88, 0xf0, 0x88, 0x88, 0xf0}, // 'B'
+    {0x70, 0x88, 0x80, 0x80, 0x80, 0x88, 0x70}, // 'C'
+    {0xe0, 0x90, 0x88, 0x88, 0x88, 0x90, 0xe0}, // 'D'
+    {0xf8, 0x80, 0x80, 0xf0, 0x80, 0x80, 0xf8}, // 'E'
+    {0x80, 0x80, 0x80, 0xf0, 0x80, 0x80, 0xf8}, // 'F'
+    {0x78, 0x88, 0x88, 0xb8, 0x80, 0x88, 0x70}, // 'G'
+    {0x88, 0x88, 0x88, 0xf8, 0x88, 0x88, 0x88}, // 'H'
+    {0x70, 0x20, 0x20, 0x20, 0x20, 0x20, 0x70}, // 'I'
+    {0x60, 0x90, 0x10, 0x10, 0x10, 0x10, 0x38}, // 'J'
+    {0x88, 0x90, 0xa0, 0xc0, 0xa0, 0x90, 0x88}, // 'K'
+    {0xf8, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80}, // 'L'
+    {0x88, 0x88, 0x88, 0xa8, 0xa8, 0xd8, 0x88}, // 'M'
+    {0x88, 0x88, 0x98, 0xa8, 0xc8, 0x88, 0x88}, // 'N'
+    {0x70, 0x88, 0x88, 0x88, 0x88, 0x88, 0x70}, // 'O'
+    {0x80, 0x80, 0x80, 0xf0, 0x88, 0x88, 0xf0}, // 'P'
+    {0x68, 0x90, 0xa8, 0x88, 0x88, 0x88, 0x70}, // 'Q'
+    {0x88, 0x90, 0xa0, 0xf0, 0x88, 0x88, 0xf0}, // 'R'
+    {0xf0, 0x08, 0x08, 0x70, 0x80, 0x80, 0x78}, // 'S'
+    {0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0xf8}, // 'T'
+    {0x70, 0x88, 0x88, 0x88, 0x88, 0x88, 0x88}, // 'U'
+    {0x20, 0x50, 0x88, 0x88, 0x88, 0x88, 0x88}, // 'V'
+    {0x50, 0xa8, 0xa8, 0xa8, 0x88, 0x88, 0x88}, // 'W'
+    {0x88, 0x88, 0x50, 0x20, 0x50, 0x88, 0x88}, // 'X'
+    {0x20, 0x20, 0x20, 0x20, 0x50, 0x88, 0x88}, // 'Y'
+    {0xf8, 0x80, 0x40, 0x20, 0x10, 0x08, 0xf8}, // 'Z'
+    {0x60, 0x60, 0x00, 0x00, 0x00, 0x00, 0x00}, // '.'
+    {0x00, 0x60, 0x60, 0x00, 0x60, 0x60, 0x00}, // ':'
+    {0x18, 0x98, 0x40, 0x20, 0x10, 0xc8, 0xc0}, // '%'
+    {0x00, 0x80, 0x40, 0x20, 0x10, 0x08, 0x00}, // '/'
+    {0x00, 0x00, 0x00, 0xf8, 0x00, 0x00, 0x00}, // '-'
+};
+
+#define OVERLAY_LINES 9
+#define OVERLAY_LINE_LEN 40
+
+static _Bool show_stats = 0;
+static uint32_t last_stats_ticks = 0;
+static shoebill_stats_t last_stats;
+static char overlay_text[OVERLAY_LINES][OVERLAY_LINE_LEN];
+
+static uint64_t _sum_counters (const uint64_t *counters, uint32_t n)
+{
+    uint64_t sum = 0;
+    uint32_t i;
+    for (i=0; i<n; i++)
+        sum += counters[i];
+    return sum;
+}
+
+/*
+ * Recompute the overlay text from the deltas since the last sample.
+ * Called at most once a second so the numbers are readable.
+ */
+static void _update_stats_overlay (void)
+{
+    const uint32_t now = SDL_GetTicks();
+    const uint32_t elapsed = now - last_stats_ticks;
+    shoebill_stats_t s;
+    
+    if (elapsed < 1000)
+        return ;
+    
+    shoebill_get_stats(&s);
+    
+    const double secs = elapsed / 1000.0;
+    #define per_sec(field) ((double)(s.field - last_stats.field) / secs)
+    #define sum_per_sec(field) ((double)(_sum_counters(s.field, sizeof(s.field)/8) - \
+        _sum_counters(last_stats.field, sizeof(s.field)/8)) / secs)
+    
+    const uint64_t lookups = s.atc_lookups - last_stats.atc_lookups;
+    const uint64_t misses = s.atc_misses - last_stats.atc_misses;
+    const double stopped = (double)(s.stopped_usecs - last_stats.stopped_usecs) / (elapsed * 1000.0);
+    
+    snprintf(overlay_text[0], OVERLAY_LINE_LEN, "MIPS %.2f  IDLE %.0f%%",
+             per_sec(instructions) / 1000000.0, stopped * 100.0);
+    snprintf(overlay_text[1], OVERLAY_LINE_LEN, "ATC HIT %.2f%%  WALKS/S %.0f",
+             lookups ? (100.0 * (lookups - misses) / lookups) : 100.0, per_sec(table_walks));
+    snprintf(overlay_text[2], OVERLAY_LINE_LEN, "PCCACHE MISS/S %.0f  PFLUSH/S %.0f",
+             per_sec(pccache_misses), per_sec(pflushes));
+    snprintf(overlay_text[3], OVERLAY_LINE_LEN, "EXC/S %.0f  INT/S %.0f",
+             sum_per_sec(exceptions), sum_per_sec(interrupts));
+    snprintf(overlay_text[4], OVERLAY_LINE_LEN, "SCSI CMD/S %.0f  KB/S %.0f",
+             sum_per_sec(scsi_commands), sum_per_sec(scsi_bytes) / 1024.0);
+    snprintf(overlay_text[5], OVERLAY_LINE_LEN, "VIA RD/S %.0f  WR/S %.0f",
+             per_sec(via_reads), per_sec(via_writes));
+    snprintf(overlay_text[6], OVERLAY_LINE_LEN, "NUBUS RD/S %.0f  WR/S %.0f",
+             sum_per_sec(slot_reads), sum_per_sec(slot_writes));
+    snprintf(overlay_text[7], OVERLAY_LINE_LEN, "ETH IN/S %.0f  OUT/S %.0f  DROP %llu",
+             per_sec(ethernet_packets_in), per_sec(ethernet_packets_out),
+             (unsigned long long)s.ethernet_drops);
+    snprintf(overlay_text[8], OVERLAY_LINE_LEN, "FRAMES/S %.1f", per_sec(frames_converted));
+    
+    #undef per_sec
+    #undef sum_per_sec
+    
+    memcpy(&last_stats, &s, sizeof(s));
+    last_stats_ticks = now;
+}
+
+static void _draw_overlay_string (int32_t x, int32_t y, const char *str)
+{
+    glRasterPos2i(x, y);
+    for (; *str; str++) {
+        const char *c = strchr(overlay_font_chars, *str);
+        const uint32_t idx = c ? (c - overlay_font_chars) : 0;
+        glBitmap(8, 7, 0, 0, 6, 0, overlay_font[idx]);
+    }
+}
+
+static void _draw_stats_overlay (uint16_t height)
+{
+    const int32_t line_height = 10, margin = 4;
+    const int32_t box_height = OVERLAY_LINES * line_height + 2 * margin;
+    const int32_t box_width = (OVERLAY_LINE_LEN - 1) * 6 + 2 * margin;
+    uint32_t i;
+    
+    _update_stats_overlay();
+    
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    glColor4f(0.0, 0.0, 0.0, 0.7);
+    glRecti(0, height - box_height, box_width, height);
+    glDisable(GL_BLEND);
+    
+    glPixelStorei(GL_UNPACK_LSB_FIRST, GL_FALSE);
+    glColor3f(0.2, 1.0, 0.2);
+    for (i=0; i<OVERLAY_LINES; i++)
+        _draw_overlay_string(margin, height - margin - (i+1) * line_height + 2, overlay_text[i]);
+}
+
+static void _toggle_stats_overlay (void)
+{
+    show_stats = !show_stats;
+    if (show_stats) {
+        // Start from the current counters, and show something immediately
+        shoebill_get_stats(&last_stats);
+        last_stats_ticks = SDL_GetTicks();
+        memset(overlay_text, 0, sizeof(overlay_text));
+        strcpy(overlay_text[0], "COLLECTING STATS...");
+    }
+}
+
 static void _display_frame (SDL_Window *win)
 {
-    shoebill_video_frame_info_t frame = shoebill_get_video_frame(9, 0);
+    /*
+     * The core sends VBLs at the card's refresh rate on its own, so if
+     * nobody can see the window, skip the frame (and its CLUT conversion)
+     */
+    if (SDL_GetWindowFlags(win) & (SDL_WINDOW_MINIMIZED | SDL_WINDOW_HIDDEN))
+        return ;
     
-    shoebill_send_vbl_interrupt(9);
+    shoebill_video_frame_info_t frame = shoebill_get_video_frame(9, 0);
     
     glDrawBuffer(GL_BACK);
     glClear(GL_COLOR_BUFFER_BIT);
@@ -192,6 +360,9 @@ static void _display_frame (SDL_Window *win)
                  GL_UNSIGNED_BYTE,
                  frame.buf);
     
+    if (show_stats)
+        _draw_stats_overlay(frame.height);
+    
     SDL_GL_SwapWindow(win);
 }
 
@@ -612,7 +783,12 @@ int main (int argc, char **argv)
                 
             case SDL_KEYDOWN:
             case SDL_KEYUP:
-                if (!event.key.repeat)
+                // F12 toggles the stats overlay, and never reaches the guest
+                if (event.key.keysym.sym == SDLK_F12) {
+                    if ((event.type == SDL_KEYDOWN) && !event.key.repeat)
+                        _toggle_stats_overlay();
+                }
+                else if (!event.key.repeat)
                     _handle_key_event(&event);
                 break;
         }
@@ -0,0 +1,270 @@
+/*
+ * Copyright (c) 2014, Peter Rutenbar <pruten@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Decode a trace written by shoebill_trace_start() (see core/trace.c)
+ * into one line per instruction, plus indented lines for its memory
+ * accesses, register changes and exceptions:
+ *
+ *   *0x0000101c  [2410]  move.l (a0),d2
+ *       R4 *0x00002000 = 0x00000000
+ *       d2=00000000
+ *
+ * Traces have to be decoded on a host with the same byte order as the
+ * one that wrote them.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#include "../core/shoebill.h"
+
+static struct {
+    const char *path;
+    uint64_t skip, limit; // in instructions
+    _Bool regs, mem;
+} user_params;
+
+static gzFile f;
+static uint64_t inst_num = 0;
+
+static void _print_help (void)
+{
+    printf("Usage: shoebill_trace_decode <trace file> [skip=n] [limit=n] [regs=0] [mem=0]\n");
+    printf("\n");
+    printf("skip=n   Don't print the first n instructions\n");
+    printf("limit=n  Stop after printing n instructions\n");
+    printf("regs=0   Don't print register changes\n");
+    printf("mem=0    Don't print memory accesses\n");
+}
+
+static _Bool _read (void *buf, uint32_t len)
+{
+    return (len == 0) || (gzread(f, buf, len) == (int)len);
+}
+
+#define get(type) ({ \
+    type _v; \
+    if (!_read(&_v, sizeof(type))) goto truncated; \
+    _v; \
+})
+
+#define printing() ((inst_num > user_params.skip) && \
+    ((user_params.limit == 0) || (inst_num <= (user_params.skip + user_params.limit))))
+
+static void _print_inst (uint32_t pc, const uint16_t *words, uint8_t num_words)
+{
+    uint8_t binary[32];
+    char str[1024];
+    uint32_t i, len;
+    
+    if (num_words == 0) {
+        printf("*0x%08x  []  (couldn't fetch the instruction)\n", pc);
+        return ;
+    }
+    
+    memset(binary, 0, sizeof(binary));
+    for (i=0; i<num_words; i++) {
+        binary[i*2] = words[i] >> 8;
+        binary[i*2 + 1] = words[i] & 0xff;
+    }
+    disassemble_inst(binary, pc, str, &len);
+    
+    // Non-sequential instructions carry every word we could fetch, so trim to the real length
+    if ((len / 2) < num_words)
+        num_words = len / 2;
+    
+    printf("*0x%08x  [", pc);
+    for (i=0; i<num_words; i++)
+        printf("%s%04x", i ? " " : "", words[i]);
+    printf("]  %s\n", str);
+}
+
+static const char *reg_names[17] = {
+    "d0", "d1", "d2", "d3", "d4", "d5", "d6", "d7",
+    "a0", "a1", "a2", "a3", "a4", "a5", "a6", "a7", "sr"
+};
+
+static int _decode (void)
+{
+    char magic[8];
+    uint32_t version, byte_order, flags, pc = 0, i;
+    uint16_t words[TRACE_MAX_INST_WORDS];
+    int tag;
+    
+    if (!_read(magic, 8) || (memcmp(magic, TRACE_MAGIC, 8) != 0)) {
+        printf("%s isn't a shoebill trace\n", user_params.path);
+        return 1;
+    }
+    version = get(uint32_t);
+    byte_order = get(uint32_t);
+    flags = get(uint32_t);
+    if (version != TRACE_VERSION) {
+        printf("Unsupported trace version %u\n", version);
+        return 1;
+    }
+    if (byte_order != TRACE_BYTE_ORDER) {
+        printf("This trace was written on a host with a different byte order\n");
+        return 1;
+    }
+    printf("# trace version %u%s\n", version, (flags & TRACE_FLAG_MEMORY) ? ", with memory accesses" : "");
+    
+    while ((tag = gzgetc(f)) != -1) {
+        switch (tag) {
+            case TRACE_REC_START: {
+                pc = get(uint32_t);
+                const uint16_t sr = get(uint16_t);
+                printf("# start: pc=0x%08x sr=0x%04x\n#", pc, sr);
+                for (i=0; i<16; i++) {
+                    const uint32_t r = get(uint32_t);
+                    printf(" %s=%08x", reg_names[i], r);
+                }
+                printf("\n");
+                break;
+            }
+            case TRACE_REC_INST_PC:
+                pc = get(uint32_t);
+                // fall through
+            case TRACE_REC_INST: {
+                const uint8_t num_words = get(uint8_t);
+                if (num_words > TRACE_MAX_INST_WORDS) {
+                    printf("# corrupt instruction record\n");
+                    return 1;
+                }
+                for (i=0; i<num_words; i++)
+                    words[i] = get(uint16_t);
+                
+                inst_num++;
+                if ((user_params.limit != 0) && (inst_num > (user_params.skip + user_params.limit)))
+                    return 0;
+                if (printing())
+                    _print_inst(pc, words, num_words);
+                pc += 2 * num_words;
+                break;
+            }
+            case TRACE_REC_REGS: {
+                const uint32_t mask = get(uint32_t);
+                _Bool first = 1;
+                for (i=0; i<17; i++) {
+                    if (!(mask & (1 << i)))
+                        continue;
+                    const uint32_t r = (i < 16) ? get(uint32_t) : get(uint16_t);
+                    if (printing() && user_params.regs) {
+                        printf("%s%s=%0*x", first ? "    " : " ", reg_names[i], (i < 16) ? 8 : 4, r);
+                        first = 0;
+                    }
+                }
+                if (!first)
+                    printf("\n");
+                break;
+            }
+            case TRACE_REC_MEM: {
+                const uint8_t mflags = get(uint8_t);
+                const uint8_t size = get(uint8_t);
+                const uint32_t addr = get(uint32_t);
+                const uint64_t dat = get(uint64_t);
+                if (printing() && user_params.mem) {
+                    printf("    %c%u *0x%08x", (mflags & 1) ? 'W' : 'R', size, addr);
+                    if (mflags & 2)
+                        printf(" (fault)\n");
+                    else
+                        printf(" = 0x%0*llx\n", size * 2, (unsigned long long)dat);
+                }
+                break;
+            }
+            case TRACE_REC_EXCEPTION: {
+                const uint16_t vector = get(uint16_t);
+                pc = get(uint32_t);
+                if (printing())
+                    printf("    exception: vector %u -> *0x%08x\n", vector, pc);
+                break;
+            }
+            case TRACE_REC_DROPPED: {
+                const uint32_t dropped = get(uint32_t);
+                if (printing() && user_params.mem)
+                    printf("    (%u more memory accesses dropped)\n", dropped);
+                break;
+            }
+            default:
+                printf("# unknown record type 0x%02x after instruction %llu\n", tag, (unsigned long long)inst_num);
+                return 1;
+        }
+    }
+    
+    printf("# %llu instructions\n", (unsigned long long)inst_num);
+    return 0;
+    
+truncated:
+    printf("# trace is truncated after instruction %llu\n", (unsigned long long)inst_num);
+    return 1;
+}
+
+int main (int argc, char **argv)
+{
+    uint32_t i;
+    int result;
+    
+    user_params.regs = 1;
+    user_params.mem = 1;
+    
+    for (i=1; i<argc; i++) {
+        if ((strncmp(argv[i], "-h", 2) == 0) || (strncmp(argv[i], "help", 4) == 0)) {
+            _print_help();
+            return 0;
+        }
+        else if (strncmp(argv[i], "skip=", 5) == 0)
+            user_params.skip = strtoull(argv[i] + 5, NULL, 10);
+        else if (strncmp(argv[i], "limit=", 6) == 0)
+            user_params.limit = strtoull(argv[i] + 6, NULL, 10);
+        else if (strncmp(argv[i], "regs=", 5) == 0)
+            user_params.regs = strtoul(argv[i] + 5, NULL, 10);
+        else if (strncmp(argv[i], "mem=", 4) == 0)
+            user_params.mem = strtoul(argv[i] + 4, NULL, 10);
+        else if (user_params.path == NULL)
+            user_params.path = argv[i];
+        else {
+            printf("Unknown argument %s\n", argv[i]);
+            _print_help();
+            return 1;
+        }
+    }
+    
+    if (user_params.path == NULL) {
+        _print_help();
+        return 1;
+    }
+    
+    f = gzopen(user_params.path, "rb");
+    if (f == NULL) {
+        printf("Can't open %s\n", user_params.path);
+        return 1;
+    }
+    gzbuffer(f, 1024 * 1024);
+    
+    result = _decode();
+    gzclose(f);
+    return result;
+}